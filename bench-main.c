@@ -0,0 +1,685 @@
+#include "editor.h"
+#include "common.h"
+#include "buffer.h"
+#include "block.h"
+#include "change.h"
+#include "view.h"
+#include "load-save.h"
+#include "newline.h"
+#include "utf8.h"
+#include "search.h"
+#include "uchar.h"
+#include "cconv.h"
+#include "state.h"
+#include "syntax.h"
+#include "hl.h"
+#include "config.h"
+#include "command.h"
+
+#include <locale.h>
+#include <langinfo.h>
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const char *name, double bytes, double seconds)
+{
+	printf("%-32s %9.1f MB/s\n", name, bytes / seconds / 1e6);
+}
+
+static void report_rate(const char *name, double count, double seconds)
+{
+	printf("%-32s %9.1f M/s\n", name, count / seconds / 1e6);
+}
+
+static char *write_temp_file(const char *buf, long size)
+{
+	char *filename = xstrdup("/tmp/dex-bench-XXXXXX");
+	int fd = mkstemp(filename);
+
+	if (fd < 0 || xwrite(fd, buf, size) < 0) {
+		perror("bench");
+		exit(1);
+	}
+	close(fd);
+	return filename;
+}
+
+// CSV with short lines
+static char *make_csv(long size, bool ascii, long *sizep)
+{
+	char *buf = xnew(char, size + 64);
+	long pos = 0, i = 0;
+
+	if (!ascii)
+		pos = sprintf(buf, "id,name,v\xc3\xa4rde\n");
+	while (pos < size) {
+		pos += sprintf(buf + pos, "%ld,item%ld,%ld\n", i, i % 1000, i * 7 % 100003);
+		i++;
+	}
+	*sizep = pos;
+	return buf;
+}
+
+static void bench_load_file(const char *name, const char *filename, long size)
+{
+	double best = 1e9;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		struct buffer *b = buffer_new(NULL);
+		double t = now();
+
+		if (load_buffer(b, true, filename)) {
+			fprintf(stderr, "bench: could not load %s\n", filename);
+			exit(1);
+		}
+		t = now() - t;
+		if (t < best)
+			best = t;
+		free_buffer(b);
+	}
+	report(name, size, best);
+}
+
+static void bench_load(void)
+{
+	static const struct {
+		const char *name;
+		bool ascii;
+		bool map;
+	} cases[] = {
+		{ "load ASCII CSV", true, false },
+		{ "load UTF-8 CSV", false, false },
+		{ "load UTF-8 CSV, map-files", false, true },
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_COUNT(cases); i++) {
+		long size;
+		char *buf = make_csv(64 * 1024 * 1024, cases[i].ascii, &size);
+		char *filename = write_temp_file(buf, size);
+
+		options.map_files = cases[i].map;
+		bench_load_file(cases[i].name, filename, size);
+		options.map_files = 0;
+
+		unlink(filename);
+		free(filename);
+		free(buf);
+	}
+}
+
+// UTF-16LE with BOM and CRLF line endings, as written by Windows tools
+static char *make_utf16(const char *buf, long size, long *sizep)
+{
+	char *out = xnew(char, size * 4 + 2);
+	long pos = 2, i = 0;
+
+	memcpy(out, "\xff\xfe", 2);
+	while (i < size) {
+		unsigned int u = u_get_char(buf, size, &i);
+
+		if (u == '\n') {
+			out[pos++] = '\r';
+			out[pos++] = 0;
+		}
+		out[pos++] = u & 0xff;
+		out[pos++] = u >> 8;
+	}
+	*sizep = pos;
+	return out;
+}
+
+static void bench_load_utf16(void)
+{
+	long size, csv_size;
+	char *csv = make_csv(32 * 1024 * 1024, false, &csv_size);
+	char *buf = make_utf16(csv, csv_size, &size);
+	char *filename = write_temp_file(buf, size);
+
+	bench_load_file("load UTF-16LE CRLF CSV", filename, size);
+	unlink(filename);
+	free(filename);
+	free(buf);
+	free(csv);
+}
+
+// convert in 64 KiB pieces like when loading and saving
+static double bench_convert(struct cconv *c, const char *buf, long size)
+{
+	double t = now();
+	long i;
+
+	for (i = 0; i < size; i += 64 * 1024) {
+		size_t count;
+
+		cconv_process(c, buf + i, size - i < 64 * 1024 ? size - i : 64 * 1024);
+		cconv_consume_all(c, &count);
+	}
+	cconv_flush(c);
+	t = now() - t;
+	cconv_free(c);
+	return t;
+}
+
+static void bench_cconv(void)
+{
+	static const char *const encodings[] = {
+		"UTF-16LE", "UTF-16BE", "UTF-32LE", "ISO-8859-1", "WINDOWS-1252",
+	};
+	long size, i;
+	char *csv = make_csv(32 * 1024 * 1024, false, &size);
+	int k;
+
+	for (k = 0; k < ARRAY_COUNT(encodings); k++) {
+		const char *e = encodings[k];
+		struct cconv *c = cconv_from_utf8(e);
+		char name[64], *encoded;
+		size_t esize;
+
+		for (i = 0; i < size; i += 64 * 1024)
+			cconv_process(c, csv + i, size - i < 64 * 1024 ? size - i : 64 * 1024);
+		encoded = cconv_consume_all(c, &esize);
+		encoded = xmemdup(encoded, esize);
+		cconv_free(c);
+
+		snprintf(name, sizeof(name), "decode %s, iconv", e);
+		report(name, esize, bench_convert(iconv_to_utf8(e), encoded, esize));
+		snprintf(name, sizeof(name), "decode %s, built-in", e);
+		report(name, esize, bench_convert(cconv_to_utf8(e), encoded, esize));
+		snprintf(name, sizeof(name), "encode %s, iconv", e);
+		report(name, size, bench_convert(iconv_from_utf8(e), csv, size));
+		snprintf(name, sizeof(name), "encode %s, built-in", e);
+		report(name, size, bench_convert(cconv_from_utf8(e), csv, size));
+		free(encoded);
+	}
+	free(csv);
+}
+
+static void bench_newline(void)
+{
+	const struct newline_kernel *saved = newline_kernel;
+	long size, total = 0;
+	char *buf = make_csv(64 * 1024 * 1024, true, &size);
+	char *dst = xnew(char, size);
+	int k;
+
+	// fault in pages so that first kernel is not penalized
+	memset(dst, 0, size);
+	for (k = 0; newline_kernels[k]; k++) {
+		char name[64];
+		long nl;
+		double t;
+
+		if (!newline_kernels[k]->supported())
+			continue;
+		newline_kernel = newline_kernels[k];
+
+		t = now();
+		nl = count_nl(buf, size);
+		snprintf(name, sizeof(name), "count_nl, %s", newline_kernel->name);
+		report(name, size, now() - t);
+
+		t = now();
+		total += copy_count_nl(dst, buf, size);
+		snprintf(name, sizeof(name), "copy_count_nl, %s", newline_kernel->name);
+		report(name, size, now() - t);
+
+		t = now();
+		total += find_nth_nl(buf, size, &nl) - buf;
+		snprintf(name, sizeof(name), "find_nth_nl, %s", newline_kernel->name);
+		report(name, size, now() - t);
+	}
+	newline_kernel = saved;
+	// keep results alive
+	if (total == 42)
+		printf("\n");
+	free(dst);
+	free(buf);
+}
+
+// small separate edits, e.g. typing with cursor movement in between
+static char *repeat_text(const char *text, long size)
+{
+	char *buf = xnew(char, size);
+	long len = strlen(text), pos;
+
+	for (pos = 0; pos + len <= size; pos += len)
+		memcpy(buf + pos, text, len);
+	memset(buf + pos, '\n', size - pos);
+	return buf;
+}
+
+static void bench_utf8(void)
+{
+	static const struct {
+		const char *name;
+		const char *text;
+	} inputs[] = {
+		{ "ASCII", "12345,item345,86415\n" },
+		{ "mixed", "Gr\xc3\xbc\xc3\x9f""e, na\xc3\xafve caf\xc3\xa9 \xe2\x80\x93 ok\n" },
+		{ "CJK", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88\n" },
+	};
+	long size = 64 * 1024 * 1024;
+	int i, k;
+
+	for (i = 0; i < ARRAY_COUNT(inputs); i++) {
+		char *buf = repeat_text(inputs[i].text, size);
+
+		for (k = 0; utf8_kernels[k]; k++) {
+			char name[64];
+			double t;
+
+			if (!utf8_kernels[k]->supported())
+				continue;
+			t = now();
+			if (utf8_kernels[k]->classify((unsigned char *)buf, size) == UTF8_INVALID)
+				printf("\n");
+			snprintf(name, sizeof(name), "classify %s, %s", inputs[i].name, utf8_kernels[k]->name);
+			report(name, size, now() - t);
+		}
+		free(buf);
+	}
+}
+
+static void bench_undo(void)
+{
+	const long count = 1000000;
+	struct buffer *b = buffer_new(NULL);
+	struct view v;
+	double t;
+	long i;
+
+	block_add_tail(&b->blocks, block_new(b, 1));
+	clear(&v);
+	v.buffer = b;
+	v.cursor.head = &b->blocks;
+	v.cursor.blk = BLOCK(b->blocks.next);
+	buffer = b;
+	view = &v;
+
+	t = now();
+	for (i = 0; i < count; i++) {
+		begin_change(CHANGE_MERGE_NONE);
+		if (i % 4 == 3) {
+			block_iter_back_bytes(&v.cursor, 1);
+			buffer_delete_bytes(1);
+		} else {
+			buffer_insert_bytes("x\n", 2);
+			block_iter_skip_bytes(&v.cursor, 2);
+		}
+		end_change();
+	}
+	report_rate("edit", count, now() - t);
+
+	t = now();
+	while (undo())
+		;
+	report_rate("undo", count, now() - t);
+
+	t = now();
+	while (redo(0))
+		;
+	report_rate("redo", count, now() - t);
+
+	t = now();
+	free_buffer(b);
+	report_rate("free changes", count, now() - t);
+	buffer = NULL;
+	view = NULL;
+}
+
+// write syscalls made by this process so far
+static long write_syscalls(void)
+{
+	char buf[1024];
+	int fd = open("/proc/self/io", O_RDONLY);
+	ssize_t len = fd < 0 ? -1 : xread(fd, buf, sizeof(buf) - 1);
+	char *p;
+
+	if (fd >= 0)
+		close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = 0;
+	p = strstr(buf, "syscw: ");
+	return p ? atol(p + 7) : -1;
+}
+
+static void bench_save_buffer(const char *name, struct buffer *b, long size, enum newline_sequence newline)
+{
+	char *filename = write_temp_file("", 0);
+	double best = 1e9;
+	long calls = 0;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		long c = write_syscalls();
+		double t = now();
+
+		if (save_buffer(b, filename, "UTF-8", newline)) {
+			fprintf(stderr, "bench: could not save %s\n", filename);
+			exit(1);
+		}
+		t = now() - t;
+		if (t < best)
+			best = t;
+		calls = write_syscalls() - c;
+	}
+	printf("%-32s %9.1f MB/s %8ld writes\n", name, size / best / 1e6, calls);
+	unlink(filename);
+	free(filename);
+}
+
+// buffer fragmented by editing into blocks of about 512 bytes
+static void bench_save(void)
+{
+	struct buffer *b = buffer_new(NULL);
+	long size = 0;
+
+	while (size < 64 * 1024 * 1024) {
+		struct block *blk = block_new(b, 512);
+
+		while (blk->size < 480) {
+			blk->size += sprintf((char *)blk->data + blk->size, "%ld,item%ld\n", b->nl, b->nl % 1000);
+			blk->nl++;
+			b->nl++;
+		}
+		size += blk->size;
+		block_add_tail(&b->blocks, blk);
+	}
+
+	bench_save_buffer("save fragmented", b, size, NEWLINE_UNIX);
+	bench_save_buffer("save fragmented, CRLF", b, size, NEWLINE_DOS);
+	compact_blocks(b);
+	bench_save_buffer("save compacted", b, size, NEWLINE_UNIX);
+	free_buffer(b);
+}
+
+// replace all matches without confirmation, then undo and redo it
+static void bench_replace(void)
+{
+	struct buffer *b = buffer_new(NULL);
+	long size;
+	char *buf = make_csv(32 * 1024 * 1024, true, &size);
+	char *filename = write_temp_file(buf, size);
+	struct view v;
+	double t;
+
+	if (load_buffer(b, true, filename)) {
+		fprintf(stderr, "bench: could not load %s\n", filename);
+		exit(1);
+	}
+	clear(&v);
+	v.buffer = b;
+	v.cursor.head = &b->blocks;
+	v.cursor.blk = BLOCK(b->blocks.next);
+	buffer = b;
+	view = &v;
+
+	t = now();
+	reg_replace("item", "thing", REPLACE_GLOBAL);
+	report("replace -g", size, now() - t);
+
+	t = now();
+	undo();
+	report("undo replace -g", size, now() - t);
+
+	t = now();
+	redo(0);
+	report("redo replace -g", size, now() - t);
+
+	free_buffer(b);
+	buffer = NULL;
+	view = NULL;
+	unlink(filename);
+	free(filename);
+	free(buf);
+}
+
+// syntaxes and colors are read from share, run from source directory
+static struct syntax *load_bench_syntax(const char *name)
+{
+	static bool colors_loaded;
+	struct syntax *syn = find_syntax(name);
+	char *filename;
+	int err;
+
+	if (!colors_loaded) {
+		read_config(commands, "share/color/light", false);
+		colors_loaded = true;
+	}
+	if (syn)
+		return syn;
+	filename = xsprintf("share/syntax/%s", name);
+	syn = load_syntax_file(filename, true, &err);
+	free(filename);
+	if (syn)
+		update_syntax_colors(syn);
+	else
+		fprintf(stderr, "bench: no syntax %s\n", name);
+	return syn;
+}
+
+// highlight whole file
+static void bench_hl(void)
+{
+	static const struct {
+		const char *syntax;
+		const char *text;
+	} inputs[] = {
+		{ "c",
+			"/* comment */\n#include <stdio.h>\n"
+			"static int f(const char *s, int n)\n{\n"
+			"\tif (n > 0x10 && s[0] == '\\n')\n\t\treturn printf(\"%d\\n\", n);\n"
+			"\treturn 0; // done\n}\n" },
+		{ "php",
+			"<?php\n// comment\n$a = array(1, 2.5, \"s $v {$o->x}\", 'q');\n"
+			"function foo($x) { return $x + 1; }\n"
+			"if ($a == NULL && TRUE) { echo <<<EOT\nhere $x\nEOT;\n}\n?>\n<p class=\"x\">t</p>\n" },
+		{ "python",
+			"# comment\nimport os\ndef f(x, *args):\n"
+			"    s = 'a' + \"b\" + r'c\\n'\n"
+			"    if x is None and not True:\n        return [i for i in range(10)]\n" },
+		{ "sh",
+			"# comment\nx=\"str $y ${z:-d} $(cmd a)\"\n"
+			"for i in 1 2 3; do echo \"$i\" | grep -q f && exit 1; done\n"
+			"case \"$1\" in a|b) echo ok ;; esac\n" },
+		{ "html",
+			"<!-- comment -->\n<html><body class=\"x\">\n"
+			"<p>text &amp; <a href=\"x\">link</a></p>\n<br/>\n</body></html>\n" },
+		{ "sql",
+			"SELECT DISTINCT name, created FROM users WHERE active IS NOT NULL\n"
+			"AND role IN (SELECT role FROM roles WHERE level BETWEEN low AND high)\n"
+			"GROUP BY name HAVING count > limit ORDER BY created DESC;\n" },
+	};
+	long size = 16 * 1024 * 1024;
+	int i;
+
+	for (i = 0; i < ARRAY_COUNT(inputs); i++) {
+		struct syntax *syn = load_bench_syntax(inputs[i].syntax);
+		char *buf, *filename, name[64];
+		struct buffer *b;
+		double best = 1e9;
+		int k;
+
+		if (!syn)
+			continue;
+		buf = repeat_text(inputs[i].text, size);
+		filename = write_temp_file(buf, size);
+		b = buffer_new(NULL);
+		if (load_buffer(b, true, filename)) {
+			fprintf(stderr, "bench: could not load %s\n", filename);
+			exit(1);
+		}
+		b->syn = syn;
+
+		for (k = 0; k < 3; k++) {
+			double t = now();
+
+			line_states_reset(&b->line_start_states, syn->states.ptrs[0]);
+			hl_fill_start_states(b, b->nl, -1);
+			t = now() - t;
+			if (t < best)
+				best = t;
+		}
+		snprintf(name, sizeof(name), "highlight %s", inputs[i].syntax);
+		report(name, size, best);
+
+		free_buffer(b);
+		unlink(filename);
+		free(filename);
+		free(buf);
+	}
+}
+
+// JSON array on one line
+static void bench_hl_long_line(void)
+{
+	static const char text[] = "{\"id\":12345,\"name\":\"item 12345\",\"tags\":[\"alpha\",\"beta\"],\"value\":3.14159,\"active\":true},";
+	long size = 16 * 1024 * 1024;
+	struct syntax *syn = load_bench_syntax("javascript");
+	struct buffer *b;
+	struct hl_span *spans;
+	int nr_spans, next_changed;
+	long pos;
+	char *buf;
+	double t;
+
+	if (!syn)
+		return;
+	buf = xnew(char, size);
+	memset(buf, ' ', size);
+	for (pos = 0; pos + sizeof(text) < size; pos += sizeof(text) - 1)
+		memcpy(buf + pos, text, sizeof(text) - 1);
+	buf[size - 1] = '\n';
+
+	b = buffer_new(NULL);
+	b->syn = syn;
+	line_states_reset(&b->line_start_states, syn->states.ptrs[0]);
+
+	t = now();
+	spans = hl_line(b, buf, size, 0, &nr_spans, &next_changed);
+	report("highlight long line", size, now() - t);
+	printf("%-32s %9.1f MB\n", "highlight scratch", hl_scratch_size() / 1e6);
+	if (spans == NULL)
+		printf("\n");
+
+	free_buffer(b);
+	free(buf);
+}
+
+// inlist lookups of identifiers and keywords in mixed case
+// edits in a big file only update runs of line start states
+static void bench_hl_edits(void)
+{
+	static const char text[] =
+		"/*\n * Returns something.\n */\nstatic int f(const char *s, int n)\n{\n"
+		"\tint i;\n\n\tfor (i = 0; i < n; i++) {\n\t\tif (s[i] == '\\n')\n"
+		"\t\t\tbreak;\n\t}\n\t// done\n\treturn printf(\"%d\\n\", i);\n}\n\n";
+	long size = 64 * 1024 * 1024;
+	struct syntax *syn = load_bench_syntax("c");
+	struct line_states *s;
+	struct buffer *b;
+	char *buf, *filename;
+	double t;
+	int i;
+
+	if (!syn)
+		return;
+	buf = repeat_text(text, size);
+	filename = write_temp_file(buf, size);
+	b = buffer_new(NULL);
+	if (load_buffer(b, true, filename)) {
+		fprintf(stderr, "bench: could not load %s\n", filename);
+		exit(1);
+	}
+	b->syn = syn;
+	s = &b->line_start_states;
+	line_states_reset(s, syn->states.ptrs[0]);
+	hl_fill_start_states(b, b->nl, -1);
+	printf("%-32s %9.1f MB for %ld lines\n", "line start states",
+		s->nr_runs * sizeof(struct state_run) / 1e6, b->nl);
+
+	srand(1);
+	t = now();
+	for (i = 0; i < 100000; i++) {
+		int line = rand() % (b->nl - 10);
+
+		hl_insert(b, line, 3);
+		hl_delete(b, line, 3);
+	}
+	report_rate("line start state edits", 200000, now() - t);
+
+	free_buffer(b);
+	unlink(filename);
+	free(filename);
+	free(buf);
+}
+
+static void bench_string_list(void)
+{
+	static const char *const words[] = {
+		"SELECT", "name", "from", "users", "Where", "active", "IS", "not",
+		"NULL", "and", "role", "in", "level", "BETWEEN", "x", "ORDER",
+	};
+	const long count = 20000000;
+	struct syntax *syn = find_syntax("sql");
+	struct string_list *list;
+	int lens[ARRAY_COUNT(words)];
+	long i, found = 0;
+	double t;
+
+	if (!syn)
+		return;
+	list = find_string_list(syn, "keyword");
+	for (i = 0; i < ARRAY_COUNT(words); i++)
+		lens[i] = strlen(words[i]);
+
+	t = now();
+	for (i = 0; i < count; i++) {
+		int w = i % ARRAY_COUNT(words);
+		found += in_string_list(list, words[w], lens[w]);
+	}
+	report_rate("inlist sql keyword", count, now() - t);
+	// keep results alive
+	if (found == 42)
+		printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *home = getenv("HOME");
+
+	if (!home)
+		home = "";
+	home_dir = xstrdup(home);
+
+	select_newline_kernel();
+	select_utf8_kernel();
+
+	setlocale(LC_CTYPE, "");
+	charset = nl_langinfo(CODESET);
+	if (streq(charset, "UTF-8"))
+		term_utf8 = true;
+
+	bench_newline();
+	bench_utf8();
+	bench_undo();
+	bench_replace();
+	bench_hl();
+	bench_hl_long_line();
+	bench_hl_edits();
+	bench_string_list();
+	bench_load();
+	bench_load_utf16();
+	bench_cconv();
+	bench_save();
+	return 0;
+}
@@ -0,0 +1,162 @@
+#include "block-arena.h"
+#include "common.h"
+
+#define SLAB_SIZE (64 * 1024)
+#define MIN_CLASS_SIZE 64L
+#define MAX_CLASS_SIZE (MIN_CLASS_SIZE << (ARENA_NR_CLASSES - 1))
+
+// objects are 16 byte aligned
+#define BLOCK_SIZE ROUND_UP(sizeof(struct block), 16)
+#define SLAB_HEADER_SIZE ROUND_UP(sizeof(struct arena_slab), 16)
+
+struct arena_slab {
+	struct arena_slab *next;
+};
+
+struct arena_free {
+	struct arena_free *next;
+};
+
+static int size_class(long size)
+{
+	int c = 0;
+
+	while ((MIN_CLASS_SIZE << c) < size)
+		c++;
+	return c;
+}
+
+static void push_free(struct arena_free **list, void *ptr)
+{
+	struct arena_free *f = ptr;
+
+	f->next = *list;
+	*list = f;
+}
+
+static void *pop_free(struct arena_free **list)
+{
+	struct arena_free *f = *list;
+
+	if (f)
+		*list = f->next;
+	return f;
+}
+
+static void *carve(struct block_arena *a, long size)
+{
+	void *ptr;
+
+	if (a->avail < size) {
+		struct arena_slab *slab;
+		int c;
+
+		// rest of the current slab is not wasted
+		for (c = ARENA_NR_CLASSES - 1; c >= 0; c--) {
+			long class_size = MIN_CLASS_SIZE << c;
+
+			while (a->avail >= class_size) {
+				push_free(&a->free_data[c], a->pos);
+				a->pos += class_size;
+				a->avail -= class_size;
+			}
+		}
+
+		slab = xmalloc(SLAB_SIZE);
+		slab->next = a->slabs;
+		a->slabs = slab;
+		a->pos = (char *)slab + SLAB_HEADER_SIZE;
+		a->avail = SLAB_SIZE - SLAB_HEADER_SIZE;
+		a->nr_mallocs++;
+		a->heap_size += SLAB_SIZE;
+	}
+	ptr = a->pos;
+	a->pos += size;
+	a->avail -= size;
+	return ptr;
+}
+
+struct block *block_arena_new_block(struct block_arena *a)
+{
+	struct block *blk = pop_free(&a->free_blocks);
+
+	if (!blk)
+		blk = carve(a, BLOCK_SIZE);
+	a->nr_allocs++;
+	clear(blk);
+	return blk;
+}
+
+void block_arena_free_block(struct block_arena *a, struct block *blk)
+{
+	push_free(&a->free_blocks, blk);
+}
+
+// *sizep is rounded up to the allocated size
+unsigned char *block_arena_alloc(struct block_arena *a, long *sizep)
+{
+	unsigned char *data;
+	int c;
+
+	a->nr_allocs++;
+	if (*sizep > MAX_CLASS_SIZE) {
+		*sizep = ROUND_UP(*sizep, 64);
+		a->nr_mallocs++;
+		a->heap_size += *sizep;
+		return xmalloc(*sizep);
+	}
+
+	c = size_class(*sizep);
+	*sizep = MIN_CLASS_SIZE << c;
+	data = pop_free(&a->free_data[c]);
+	if (!data)
+		data = carve(a, *sizep);
+	return data;
+}
+
+// only used bytes are copied if data has to be moved
+unsigned char *block_arena_realloc(struct block_arena *a, unsigned char *data, long alloc, long used, long *sizep)
+{
+	unsigned char *new;
+
+	if (alloc > MAX_CLASS_SIZE && *sizep > MAX_CLASS_SIZE) {
+		*sizep = ROUND_UP(*sizep, 64);
+		a->nr_allocs++;
+		a->nr_mallocs++;
+		a->heap_size += *sizep - alloc;
+		xrenew(data, *sizep);
+		return data;
+	}
+	new = block_arena_alloc(a, sizep);
+	memcpy(new, data, used);
+	block_arena_free(a, data, alloc);
+	return new;
+}
+
+void block_arena_free(struct block_arena *a, unsigned char *data, long alloc)
+{
+	if (alloc > MAX_CLASS_SIZE) {
+		a->heap_size -= alloc;
+		free(data);
+	} else {
+		push_free(&a->free_data[size_class(alloc)], data);
+	}
+}
+
+// frees data of the blocks that were allocated with malloc() and all slabs
+void block_arena_release(struct block_arena *a, struct list_head *blocks)
+{
+	struct block *blk;
+
+	list_for_each_entry(blk, blocks, node) {
+		if (!blk->mapped && blk->alloc > MAX_CLASS_SIZE)
+			free(blk->data);
+	}
+	while (a->slabs) {
+		struct arena_slab *next = a->slabs->next;
+
+		free(a->slabs);
+		a->slabs = next;
+	}
+	clear(a);
+}
@@ -0,0 +1,38 @@
+#ifndef BLOCK_ARENA_H
+#define BLOCK_ARENA_H
+
+#include "iter.h"
+
+#define ARENA_NR_CLASSES 8
+
+/*
+ * Blocks and their data are carved from big slabs owned by the buffer.
+ * Freed memory goes to a free list of its size class and is reused by
+ * later allocations. All slabs are released at once when the buffer is
+ * freed. Data larger than the biggest size class is allocated with
+ * malloc().
+ */
+struct block_arena {
+	struct arena_slab *slabs;
+	char *pos;
+	long avail;
+
+	struct arena_free *free_blocks;
+	struct arena_free *free_data[ARENA_NR_CLASSES];
+
+	// statistics
+	long nr_allocs;
+	long nr_mallocs;
+
+	// bytes currently allocated with malloc(), slabs included
+	long heap_size;
+};
+
+struct block *block_arena_new_block(struct block_arena *a);
+void block_arena_free_block(struct block_arena *a, struct block *blk);
+unsigned char *block_arena_alloc(struct block_arena *a, long *sizep);
+unsigned char *block_arena_realloc(struct block_arena *a, unsigned char *data, long alloc, long used, long *sizep);
+void block_arena_free(struct block_arena *a, unsigned char *data, long alloc);
+void block_arena_release(struct block_arena *a, struct list_head *blocks);
+
+#endif
@@ -0,0 +1,273 @@
+#include "block-tree.h"
+#include "common.h"
+
+static unsigned int next_prio(void)
+{
+	// xorshift32, priorities need not be good random numbers
+	static unsigned int x = 2463534242U;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static inline long subtree_size(const struct block *n)
+{
+	return n ? n->tree_size : 0;
+}
+
+static inline long subtree_nl(const struct block *n)
+{
+	return n ? n->tree_nl : 0;
+}
+
+static void pull(struct block *n)
+{
+	n->tree_size = n->size + subtree_size(n->left) + subtree_size(n->right);
+	n->tree_nl = n->nl + subtree_nl(n->left) + subtree_nl(n->right);
+}
+
+static void pull_path(struct block *n)
+{
+	while (n) {
+		pull(n);
+		n = n->parent;
+	}
+}
+
+static struct block *root_of(struct block *n)
+{
+	while (n->parent)
+		n = n->parent;
+	return n;
+}
+
+// rotate x above its parent, totals of the subtree do not change
+static void rotate_up(struct block *x)
+{
+	struct block *p = x->parent;
+	struct block *g = p->parent;
+
+	if (p->left == x) {
+		p->left = x->right;
+		if (x->right)
+			x->right->parent = p;
+		x->right = p;
+	} else {
+		p->right = x->left;
+		if (x->left)
+			x->left->parent = p;
+		x->left = p;
+	}
+	p->parent = x;
+	x->parent = g;
+	if (g) {
+		if (g->left == p)
+			g->left = x;
+		else
+			g->right = x;
+	}
+	pull(p);
+	pull(x);
+}
+
+static void init_node(struct block *blk)
+{
+	blk->parent = NULL;
+	blk->left = NULL;
+	blk->right = NULL;
+	blk->prio = next_prio();
+	pull(blk);
+}
+
+static void sift_up(struct block *blk)
+{
+	pull_path(blk->parent);
+	while (blk->parent && blk->parent->prio < blk->prio)
+		rotate_up(blk);
+}
+
+// next is NULL if tree is empty
+void block_tree_insert_before(struct block *blk, struct block *next)
+{
+	init_node(blk);
+	if (!next)
+		return;
+
+	if (!next->left) {
+		next->left = blk;
+		blk->parent = next;
+	} else {
+		struct block *n = next->left;
+
+		while (n->right)
+			n = n->right;
+		n->right = blk;
+		blk->parent = n;
+	}
+	sift_up(blk);
+}
+
+// prev is NULL if tree is empty
+void block_tree_insert_after(struct block *blk, struct block *prev)
+{
+	init_node(blk);
+	if (!prev)
+		return;
+
+	if (!prev->right) {
+		prev->right = blk;
+		blk->parent = prev;
+	} else {
+		struct block *n = prev->right;
+
+		while (n->left)
+			n = n->left;
+		n->left = blk;
+		blk->parent = n;
+	}
+	sift_up(blk);
+}
+
+void block_tree_remove(struct block *blk)
+{
+	struct block *p;
+
+	// rotate down to a leaf
+	while (blk->left || blk->right) {
+		struct block *child = blk->left;
+
+		if (!child || (blk->right && blk->right->prio > child->prio))
+			child = blk->right;
+		rotate_up(child);
+	}
+
+	p = blk->parent;
+	if (p) {
+		if (p->left == blk)
+			p->left = NULL;
+		else
+			p->right = NULL;
+		pull_path(p);
+	}
+	blk->parent = NULL;
+}
+
+// call after size or nl of blk has changed
+void block_tree_update(struct block *blk)
+{
+	pull_path(blk);
+}
+
+// number of bytes before blk
+long block_tree_offset(const struct block *blk)
+{
+	const struct block *n = blk;
+	long offset = subtree_size(blk->left);
+
+	while (n->parent) {
+		const struct block *p = n->parent;
+
+		if (p->right == n)
+			offset += subtree_size(p->left) + p->size;
+		n = p;
+	}
+	return offset;
+}
+
+// number of lines before blk
+long block_tree_line(const struct block *blk)
+{
+	const struct block *n = blk;
+	long line = subtree_nl(blk->left);
+
+	while (n->parent) {
+		const struct block *p = n->parent;
+
+		if (p->right == n)
+			line += subtree_nl(p->left) + p->nl;
+		n = p;
+	}
+	return line;
+}
+
+/*
+ * Find first block whose end is at or after *offsetp. blk can be any block
+ * of the tree. *offsetp is converted to offset inside the returned block.
+ * Returns NULL if offset is beyond end of the buffer.
+ */
+struct block *block_tree_find_offset(struct block *blk, long *offsetp)
+{
+	struct block *n = root_of(blk);
+	long offset = *offsetp;
+
+	while (n) {
+		if (n->left && offset <= n->left->tree_size) {
+			n = n->left;
+			continue;
+		}
+		offset -= subtree_size(n->left);
+		if (offset <= n->size) {
+			*offsetp = offset;
+			return n;
+		}
+		offset -= n->size;
+		n = n->right;
+	}
+	return NULL;
+}
+
+/*
+ * Find first block whose newlines reach line *linep or the last block if
+ * there are not that many lines. *linep is converted to line number
+ * relative to beginning of the returned block.
+ */
+struct block *block_tree_find_line(struct block *blk, long *linep)
+{
+	struct block *n = root_of(blk);
+	long line = *linep;
+
+	while (1) {
+		if (n->left && line <= n->left->tree_nl) {
+			n = n->left;
+			continue;
+		}
+		line -= subtree_nl(n->left);
+		if (line <= n->nl || !n->right)
+			break;
+		line -= n->nl;
+		n = n->right;
+	}
+	*linep = line;
+	return n;
+}
+
+static void check_subtree(struct block *n, struct block **expected, struct list_head *head)
+{
+	if (n->left) {
+		BUG_ON(n->left->parent != n);
+		BUG_ON(n->left->prio > n->prio);
+		check_subtree(n->left, expected, head);
+	}
+	BUG_ON(&(*expected)->node == head);
+	BUG_ON(*expected != n);
+	*expected = BLOCK(n->node.next);
+	if (n->right) {
+		BUG_ON(n->right->parent != n);
+		BUG_ON(n->right->prio > n->prio);
+		check_subtree(n->right, expected, head);
+	}
+	BUG_ON(n->tree_size != n->size + subtree_size(n->left) + subtree_size(n->right));
+	BUG_ON(n->tree_nl != n->nl + subtree_nl(n->left) + subtree_nl(n->right));
+}
+
+// expensive, in-order walk of the tree must match the list
+void block_tree_sanity_check(struct list_head *head)
+{
+	struct block *first = BLOCK(head->next);
+	struct block *expected = first;
+
+	check_subtree(root_of(first), &expected, head);
+	BUG_ON(&expected->node != head);
+}
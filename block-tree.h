@@ -0,0 +1,25 @@
+#ifndef BLOCK_TREE_H
+#define BLOCK_TREE_H
+
+#include "iter.h"
+
+/*
+ * Blocks of a buffer are kept both in a list and in a treap ordered like
+ * the list. Every tree node knows total size and newline count of its
+ * subtree which makes offset and line lookups O(log n).
+ *
+ * Root of the tree is found by walking up from any block so the list head
+ * is enough to find everything.
+ */
+
+void block_tree_insert_before(struct block *blk, struct block *next);
+void block_tree_insert_after(struct block *blk, struct block *prev);
+void block_tree_remove(struct block *blk);
+void block_tree_update(struct block *blk);
+long block_tree_offset(const struct block *blk);
+long block_tree_line(const struct block *blk);
+struct block *block_tree_find_offset(struct block *blk, long *offsetp);
+struct block *block_tree_find_line(struct block *blk, long *linep);
+void block_tree_sanity_check(struct list_head *head);
+
+#endif
@@ -1,9 +1,13 @@
 #include "block.h"
+#include "block-tree.h"
 #include "buffer.h"
 #include "view.h"
 #include "hl.h"
+#include "newline.h"
+#include "gbuf.h"
 
 #define BLOCK_EDIT_SIZE 512
+#define BLOCK_COMPACT_SIZE 8192
 
 static void sanity_check(void)
 {
@@ -26,39 +30,73 @@ static void sanity_check(void)
 	}
 	BUG_ON(!cursor_seen);
 	BUG_ON(view->cursor.offset > view->cursor.blk->size);
+	if (DEBUG > 2)
+		block_tree_sanity_check(&buffer->blocks);
 }
 
-static inline size_t ALLOC_ROUND(size_t size)
+struct block *block_new(struct buffer *b, long alloc)
 {
-	return ROUND_UP(size, 64);
+	struct block *blk = block_arena_new_block(&b->arena);
+
+	blk->data = block_arena_alloc(&b->arena, &alloc);
+	blk->alloc = alloc;
+	return blk;
 }
 
-struct block *block_new(long alloc)
+void block_add_tail(struct list_head *head, struct block *blk)
 {
-	struct block *blk = xnew0(struct block, 1);
+	struct block *prev = NULL;
 
-	alloc = ALLOC_ROUND(alloc);
-	blk->data = xnew(char, alloc);
-	blk->alloc = alloc;
+	if (!list_empty(head))
+		prev = BLOCK(head->prev);
+	block_tree_insert_after(blk, prev);
+	list_add_before(&blk->node, head);
+}
+
+// data must be a whole number of lines inside the file mapping of the buffer
+struct block *block_new_mapped(struct buffer *b, unsigned char *data, long size, long nl)
+{
+	struct block *blk = block_arena_new_block(&b->arena);
+
+	blk->data = data;
+	blk->size = size;
+	blk->alloc = size;
+	blk->nl = nl;
+	blk->mapped = true;
 	return blk;
 }
 
-static void delete_block(struct block *blk)
+void block_free(struct buffer *b, struct block *blk)
 {
-	list_del(&blk->node);
-	free(blk->data);
-	free(blk);
+	if (!blk->mapped)
+		block_arena_free(&b->arena, blk->data, blk->alloc);
+	block_arena_free_block(&b->arena, blk);
 }
 
-static long copy_count_nl(char *dst, const char *src, long len)
+/*
+ * Make data of blk writable and large enough for size bytes.
+ * Data of a mapped block is copied here on first write.
+ */
+void block_grow(struct buffer *b, struct block *blk, long size)
 {
-	long i, nl = 0;
-	for (i = 0; i < len; i++) {
-		dst[i] = src[i];
-		if (src[i] == '\n')
-			nl++;
+	if (blk->mapped) {
+		const unsigned char *data = blk->data;
+
+		blk->data = block_arena_alloc(&b->arena, &size);
+		blk->alloc = size;
+		memcpy(blk->data, data, blk->size);
+		blk->mapped = false;
+	} else if (size > blk->alloc) {
+		blk->data = block_arena_realloc(&b->arena, blk->data, blk->alloc, blk->size, &size);
+		blk->alloc = size;
 	}
-	return nl;
+}
+
+static void delete_block(struct buffer *b, struct block *blk)
+{
+	block_tree_remove(blk);
+	list_del(&blk->node);
+	block_free(b, blk);
 }
 
 static long insert_to_current(const char *buf, long len)
@@ -68,14 +106,12 @@ static long insert_to_current(const char *buf, long len)
 	long size = blk->size + len;
 	long nl;
 
-	if (size > blk->alloc) {
-		blk->alloc = ALLOC_ROUND(size);
-		xrenew(blk->data, blk->alloc);
-	}
+	block_grow(buffer, blk, size);
 	memmove(blk->data + offset + len, blk->data + offset, blk->size - offset);
 	nl = copy_count_nl(blk->data + offset, buf, len);
 	blk->nl += nl;
 	blk->size = size;
+	block_tree_update(blk);
 	return nl;
 }
 
@@ -157,7 +193,7 @@ static long split_and_insert(const char *buf, long len)
 		}
 
 		BUG_ON(!size);
-		new = block_new(size);
+		new = block_new(buffer, size);
 		if (start < size1) {
 			long avail = size1 - start;
 			long count = size;
@@ -192,7 +228,9 @@ static long split_and_insert(const char *buf, long len)
 
 		new->size = size;
 		BUG_ON(copied != size);
+		block_tree_insert_before(new, blk);
 		list_add_before(&new->node, &blk->node);
+		buffer->split_blocks++;
 
 		nl_added += new->nl;
 		size = 0;
@@ -205,7 +243,7 @@ static long split_and_insert(const char *buf, long len)
 	}
 
 	nl_added -= blk->nl;
-	delete_block(blk);
+	delete_block(buffer, blk);
 	return nl_added;
 }
 
@@ -276,15 +314,19 @@ char *do_delete(long len)
 		if (count > avail)
 			count = avail;
 		nl = copy_count_nl(buf + pos, blk->data + offset, count);
-		if (count < avail)
+		if (count < avail) {
+			block_grow(buffer, blk, blk->size);
 			memmove(blk->data + offset, blk->data + offset + count, avail - count);
+		}
 
 		deleted_nl += nl;
 		buffer->nl -= nl;
 		blk->nl -= nl;
 		blk->size -= count;
 		if (!blk->size && !only_block(blk))
-			delete_block(blk);
+			delete_block(buffer, blk);
+		else
+			block_tree_update(blk);
 
 		offset = 0;
 		pos += count;
@@ -308,14 +350,12 @@ char *do_delete(long len)
 		struct block *next = BLOCK(blk->node.next);
 		long size = blk->size + next->size;
 
-		if (size > blk->alloc) {
-			blk->alloc = ALLOC_ROUND(size);
-			xrenew(blk->data, blk->alloc);
-		}
+		block_grow(buffer, blk, size);
 		memcpy(blk->data + blk->size, next->data, next->size);
 		blk->size = size;
 		blk->nl += next->nl;
-		delete_block(next);
+		delete_block(buffer, next);
+		block_tree_update(blk);
 	}
 
 	sanity_check();
@@ -351,10 +391,7 @@ char *do_replace(long del, const char *buf, long ins)
 		}
 	}
 
-	if (new_size > blk->alloc) {
-		blk->alloc = ALLOC_ROUND(new_size);
-		xrenew(blk->data, blk->alloc);
-	}
+	block_grow(buffer, blk, new_size);
 
 	// modification is limited to one block
 	ptr = blk->data + offset;
@@ -370,6 +407,7 @@ char *do_replace(long del, const char *buf, long ins)
 	blk->nl += ins_nl;
 	buffer->nl += ins_nl;
 	blk->size = new_size;
+	block_tree_update(blk);
 
 	sanity_check();
 
@@ -390,3 +428,298 @@ slow:
 	do_insert(buf, ins);
 	return deleted;
 }
+
+static void put_varint(struct gbuf *buf, unsigned long v)
+{
+	while (v >= 0x80) {
+		gbuf_add_ch(buf, v | 0x80);
+		v >>= 7;
+	}
+	gbuf_add_ch(buf, v);
+}
+
+long get_varint(const unsigned char **pp)
+{
+	const unsigned char *p = *pp;
+	unsigned long v = 0;
+	int shift = 0;
+
+	while (*p & 0x80) {
+		v |= (unsigned long)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	v |= (unsigned long)*p++ << shift;
+	*pp = p;
+	return v;
+}
+
+// append hunk to list of hunks, see do_replace_hunks()
+void add_hunk(struct gbuf *hunks, long skip, long del, const char *ins, long ins_count)
+{
+	put_varint(hunks, skip);
+	put_varint(hunks, del);
+	put_varint(hunks, ins_count);
+	gbuf_add_buf(hunks, ins, ins_count);
+}
+
+/*
+ * Old blocks are read from src and replaced with new blocks of about
+ * BLOCK_COMPACT_SIZE bytes. dst is linked before src when it is full.
+ */
+struct rebuild {
+	struct block *src;
+	long pos;
+	struct block *dst;
+	// size of whole lines in dst
+	long lines;
+	// number of lines added
+	long nl;
+};
+
+static void rebuild_link(struct rebuild *r)
+{
+	block_tree_insert_before(r->dst, r->src);
+	list_add_before(&r->dst->node, &r->src->node);
+	r->nl += r->dst->nl;
+}
+
+static long rebuild_add(struct rebuild *r, const char *buf, long len)
+{
+	struct block *dst = r->dst;
+	long nl;
+
+	if (dst->size + len > dst->alloc) {
+		long size = dst->alloc * 2;
+
+		if (size < dst->size + len)
+			size = dst->size + len;
+		block_grow(buffer, dst, size);
+	}
+	nl = copy_count_nl(dst->data + dst->size, buf, len);
+	if (nl) {
+		long i = len;
+
+		while (buf[i - 1] != '\n')
+			i--;
+		r->lines = dst->size + i;
+	}
+	dst->size += len;
+	dst->nl += nl;
+
+	if (r->lines >= BLOCK_COMPACT_SIZE) {
+		// incomplete line is moved to next block
+		long tail = dst->size - r->lines;
+		struct block *new = block_new(buffer, BLOCK_COMPACT_SIZE + tail);
+
+		memcpy(new->data, dst->data + r->lines, tail);
+		new->size = tail;
+		dst->size = r->lines;
+		rebuild_link(r);
+		r->dst = new;
+		r->lines = 0;
+	}
+	return nl;
+}
+
+// make sure there is something to read in src
+static void rebuild_next(struct rebuild *r)
+{
+	struct block *src = r->src;
+
+	if (r->pos < src->size)
+		return;
+	BUG_ON(src->node.next == &buffer->blocks);
+	r->src = BLOCK(src->node.next);
+	r->pos = 0;
+	r->nl -= src->nl;
+	delete_block(buffer, src);
+}
+
+// copy len bytes from old blocks to new blocks
+static long rebuild_copy(struct rebuild *r, long len)
+{
+	long nl = 0;
+
+	while (len) {
+		long count;
+
+		rebuild_next(r);
+		count = r->src->size - r->pos;
+		if (count > len)
+			count = len;
+		nl += rebuild_add(r, (const char *)r->src->data + r->pos, count);
+		r->pos += count;
+		len -= count;
+	}
+	return nl;
+}
+
+// skip len bytes of old blocks, the bytes are added to buf
+static long rebuild_skip(struct rebuild *r, struct gbuf *buf, long len)
+{
+	long nl = 0;
+
+	while (len) {
+		const char *data;
+		long count;
+
+		rebuild_next(r);
+		data = (const char *)r->src->data + r->pos;
+		count = r->src->size - r->pos;
+		if (count > len)
+			count = len;
+		gbuf_add_buf(buf, data, count);
+		nl += count_nl(data, count);
+		r->pos += count;
+		len -= count;
+	}
+	return nl;
+}
+
+/*
+ * Apply many replacements at cursor in one pass. Hunks is a list of
+ * (skip, del, ins, inserted text) tuples built with add_hunk(). Blocks
+ * from the one containing cursor to the one containing end of the last
+ * hunk are replaced with new ones. Returns list of hunks that reverses
+ * the change. del and ins are set to size of the changed span before
+ * and after the change.
+ */
+char *do_replace_hunks(const char *hunks, long size, long *rsize, long *del, long *ins)
+{
+	const unsigned char *p = (const unsigned char *)hunks;
+	const unsigned char *end = p + size;
+	long offset, del_nl = 0, ins_nl = 0;
+	struct rebuild r;
+	GBUF(rev);
+
+	block_iter_normalize(&view->cursor);
+	offset = block_iter_get_offset(&view->cursor);
+	r.src = view->cursor.blk;
+	r.pos = 0;
+	r.dst = block_new(buffer, BLOCK_COMPACT_SIZE);
+	r.lines = 0;
+	r.nl = 0;
+	rebuild_copy(&r, view->cursor.offset);
+
+	*del = 0;
+	*ins = 0;
+	while (p < end) {
+		long skip = get_varint(&p);
+		long d = get_varint(&p);
+		long i = get_varint(&p);
+		long nl = rebuild_copy(&r, skip);
+
+		put_varint(&rev, skip);
+		put_varint(&rev, i);
+		put_varint(&rev, d);
+		del_nl += nl + rebuild_skip(&r, &rev, d);
+		ins_nl += nl + rebuild_add(&r, (const char *)p, i);
+		p += i;
+		*del += skip + d;
+		*ins += skip + i;
+	}
+
+	// rest of the last old block
+	rebuild_copy(&r, r.src->size - r.pos);
+	if (r.dst->size || only_block(r.src))
+		rebuild_link(&r);
+	else
+		block_free(buffer, r.dst);
+	r.nl -= r.src->nl;
+	delete_block(buffer, r.src);
+	buffer->nl += r.nl;
+
+	block_iter_goto_offset(&view->cursor, offset);
+	sanity_check();
+
+	view_update_cursor_y(view);
+	if (del_nl == ins_nl)
+		buffer_mark_lines_changed(view->buffer, view->cy, view->cy + del_nl);
+	else
+		buffer_mark_lines_changed(view->buffer, view->cy, INT_MAX);
+	if (buffer->syn) {
+		hl_delete(buffer, view->cy, del_nl);
+		hl_insert(buffer, view->cy, ins_nl);
+	}
+
+	*rsize = rev.len;
+	return gbuf_steal(&rev);
+}
+
+// move cursors from blk which is going to be appended to end of dst
+static void move_cursors(struct buffer *b, struct block *blk, struct block *dst)
+{
+	long i;
+
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		if (v->cursor.blk == blk) {
+			v->cursor.blk = dst;
+			v->cursor.offset += dst->size;
+		}
+	}
+}
+
+/*
+ * Merge runs of small blocks left by editing into blocks of at most
+ * BLOCK_COMPACT_SIZE bytes. Offsets and line numbers do not change so
+ * only cursors pointing to merged blocks need to be fixed. Mapped blocks
+ * are left alone.
+ */
+void compact_blocks(struct buffer *b)
+{
+	struct block *blk;
+
+	list_for_each_entry(blk, &b->blocks, node) {
+		struct block *last = blk;
+		long size = blk->size;
+
+		if (blk->mapped)
+			continue;
+
+		while (last->node.next != &b->blocks) {
+			struct block *next = BLOCK(last->node.next);
+
+			if (next->mapped || size + next->size > BLOCK_COMPACT_SIZE)
+				break;
+			size += next->size;
+			last = next;
+		}
+		if (last == blk)
+			continue;
+
+		block_grow(b, blk, size);
+		while (blk->size < size) {
+			struct block *next = BLOCK(blk->node.next);
+
+			move_cursors(b, next, blk);
+			memcpy(blk->data + blk->size, next->data, next->size);
+			blk->size += next->size;
+			blk->nl += next->nl;
+			block_tree_update(blk);
+			delete_block(b, next);
+		}
+	}
+	b->split_blocks = 0;
+}
+
+void get_block_stats(struct buffer *b, struct block_stats *s)
+{
+	struct block *blk;
+
+	clear(s);
+	list_for_each_entry(blk, &b->blocks, node) {
+		s->blocks++;
+		s->size += blk->size;
+		if (blk->mapped) {
+			s->mapped++;
+			continue;
+		}
+		s->unused += blk->alloc - blk->size;
+		if (blk->size <= BLOCK_EDIT_SIZE)
+			s->small++;
+	}
+	s->allocs = b->arena.nr_allocs;
+	s->mallocs = b->arena.nr_mallocs;
+}
@@ -1,9 +1,35 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
-struct block *block_new(long size);
+#include "iter.h"
+
+struct buffer;
+struct gbuf;
+
+struct block_stats {
+	long blocks;
+	long small;
+	long mapped;
+	long size;
+	// allocated but not used by blocks that are not mapped
+	long unused;
+	// see struct block_arena
+	long allocs;
+	long mallocs;
+};
+
+struct block *block_new(struct buffer *b, long size);
+struct block *block_new_mapped(struct buffer *b, unsigned char *data, long size, long nl);
+void block_free(struct buffer *b, struct block *blk);
+void block_grow(struct buffer *b, struct block *blk, long size);
+void block_add_tail(struct list_head *head, struct block *blk);
 void do_insert(const char *buf, long len);
 char *do_delete(long len);
 char *do_replace(long del, const char *buf, long ins);
+long get_varint(const unsigned char **pp);
+void add_hunk(struct gbuf *hunks, long skip, long del, const char *ins, long ins_count);
+char *do_replace_hunks(const char *hunks, long size, long *rsize, long *del, long *ins);
+void compact_blocks(struct buffer *b);
+void get_block_stats(struct buffer *b, struct block_stats *s);
 
 #endif
@@ -6,6 +6,7 @@
 #include "filetype.h"
 #include "state.h"
 #include "syntax.h"
+#include "load-save.h"
 #include "file-option.h"
 #include "lock.h"
 #include "selection.h"
@@ -13,6 +14,9 @@
 #include "unicode.h"
 #include "uchar.h"
 #include "detect.h"
+#include "journal.h"
+
+#include <sys/mman.h>
 
 struct buffer *buffer;
 PTR_ARRAY(buffers);
@@ -77,11 +81,9 @@ struct buffer *buffer_new(const char *encoding)
 struct buffer *open_empty_buffer(void)
 {
 	struct buffer *b = buffer_new(charset);
-	struct block *blk;
 
 	// at least one block required
-	blk = block_new(1);
-	list_add_before(&blk->node, &b->blocks);
+	block_add_tail(&b->blocks, block_new(b, 1));
 
 	set_display_filename(b, xstrdup("(No name)"));
 	return b;
@@ -89,24 +91,19 @@ struct buffer *open_empty_buffer(void)
 
 void free_buffer(struct buffer *b)
 {
-	struct list_head *item;
-
 	ptr_array_remove(&buffers, b);
+	cancel_loading(b);
+	finish_background_saves(b, true);
 
 	if (b->locked)
 		unlock_file(b->abs_filename);
 
-	item = b->blocks.next;
-	while (item != &b->blocks) {
-		struct list_head *next = item->next;
-		struct block *blk = BLOCK(item);
-
-		free(blk->data);
-		free(blk);
-		item = next;
-	}
-	free_changes(&b->change_head);
-	free(b->line_start_states.ptrs);
+	block_arena_release(&b->arena, &b->blocks);
+	if (b->map)
+		munmap(b->map, b->map_size);
+	journal_close(b);
+	free_changes(b);
+	line_states_free(&b->line_start_states);
 	free(b->views.ptrs);
 	free(b->display_filename);
 	free(b->abs_filename);
@@ -195,7 +192,8 @@ void buffer_update_syntax(struct buffer *b)
 {
 	struct syntax *syn = NULL;
 
-	if (b->options.syntax) {
+	// highlighting would have to scan whole file
+	if (b->options.syntax && !b->huge) {
 		/* even "none" can have syntax */
 		syn = find_syntax(b->options.filetype);
 		if (!syn)
@@ -207,18 +205,19 @@ void buffer_update_syntax(struct buffer *b)
 	b->syn = syn;
 	if (syn) {
 		// start state of first line is constant
-		struct ptr_array *s = &b->line_start_states;
-		if (!s->alloc) {
-			s->alloc = 64;
-			s->ptrs = xnew(void *, s->alloc);
-		}
-		s->ptrs[0] = syn->states.ptrs[0];
-		s->count = 1;
+		line_states_reset(&b->line_start_states, syn->states.ptrs[0]);
+		b->hl_pending = true;
 	}
 
 	mark_all_lines_changed(b);
 }
 
+// approximate heap usage, cheap enough for the status line
+long buffer_memory(struct buffer *b)
+{
+	return b->arena.heap_size + b->undo_size + b->line_start_states.nr_runs * sizeof(struct state_run);
+}
+
 void buffer_setup(struct buffer *b)
 {
 	b->setup = true;
@@ -2,35 +2,74 @@
 #define BUFFER_H
 
 #include "iter.h"
+#include "block-arena.h"
 #include "list.h"
+#include "line-states.h"
 #include "options.h"
 #include "common.h"
 #include "ptr-array.h"
 
 struct change {
 	struct change *next;
+	// newer changes, points to single_prev if there is only one
 	struct change **prev;
+	struct change *single_prev;
 	unsigned int nr_prev;
 
+	// number of the change in order changes were made, see journal.c
+	unsigned int id;
+
 	// move after inserted text when undoing delete?
 	bool move_after;
 
+	// buf is a list of hunks of del_count bytes, see do_replace_hunks()
+	bool hunks;
+
 	long offset;
 	long del_count;
 	long ins_count;
 
 	// deleted bytes (inserted bytes need not to be saved)
 	char *buf;
+
+	// size of buf if it has been compressed, otherwise 0
+	long zsize;
 };
 
 struct buffer {
 	struct list_head blocks;
+	struct block_arena arena;
+
+	// private read-only mapping of the file, see struct block
+	void *map;
+	size_t map_size;
+
+	// not NULL while rest of the file is being loaded, see load-save.c
+	struct file_loader *loader;
+
 	struct change change_head;
 	struct change *cur_change;
 
+	// change records are allocated from slabs, see alloc_change()
+	struct change_slab *change_slabs;
+	struct change *unused_changes;
+
+	// id of newest change
+	unsigned int change_id;
+
+	// not NULL if changes are recorded to undo journal, see journal.c
+	struct journal *journal;
+
+	// bytes of deleted text saved in changes, compressed size if
+	// compressed, limited by undo-size option
+	long undo_size;
+
 	// used to determine if buffer is modified
 	struct change *saved_change;
 
+	// state being written by background save, see save_buffer()
+	struct change *saving_change;
+
 	struct stat st;
 
 	// needed for identifying buffers whose filename is NULL
@@ -38,6 +77,9 @@ struct buffer {
 
 	long nl;
 
+	// blocks created by editing since last compact_blocks()
+	long split_blocks;
+
 	// views pointing to this buffer
 	struct ptr_array views;
 
@@ -48,6 +90,12 @@ struct buffer {
 	bool locked;
 	bool setup;
 
+	// read-only file too big to load into memory, see "open -H"
+	bool huge;
+
+	// file has been changed by another program, see watch.c
+	bool file_changed;
+
 	enum newline_sequence newline;
 
 	// Encoding of the file. Buffer always contains UTF-8.
@@ -56,9 +104,12 @@ struct buffer {
 	struct local_options options;
 
 	struct syntax *syn;
-	// Index 0 is always syn->states.ptrs[0].
-	// Lowest bit of an invalidated value is 1.
-	struct ptr_array line_start_states;
+	// Line 0 always starts in syn->states.ptrs[0].
+	struct line_states line_start_states;
+	// start states are highlighted when idle, see highlight_in_background()
+	bool hl_pending;
+	// some lines were drawn with guessed start states
+	bool hl_provisional;
 
 	int changed_line_min;
 	int changed_line_max;
@@ -99,6 +150,7 @@ void free_buffer(struct buffer *b);
 bool buffer_detect_filetype(struct buffer *b);
 void buffer_update_syntax(struct buffer *b);
 void buffer_setup(struct buffer *b);
+long buffer_memory(struct buffer *b);
 
 long buffer_get_char(struct block_iter *bi, unsigned int *up);
 long buffer_next_char(struct block_iter *bi, unsigned int *up);
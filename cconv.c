@@ -7,9 +7,49 @@
 // U+00BF
 static unsigned char replacement[2] = "\xc2\xbf";
 
+// characters of bytes 0x80-0x9f, 0 if undefined
+static const unsigned short cp1252_c1[32] = {
+	0x20ac, 0, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+	0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017d, 0,
+	0, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+	0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0, 0x017e, 0x0178,
+};
+
+/*
+ * Encodings converted without iconv. Conversion of the same input gives
+ * same output and number of errors as with iconv.
+ */
+struct charset {
+	const char *name;
+	const char *alias;
+
+	// code unit size in bytes
+	int unit;
+	bool big_endian;
+
+	// characters of 8-bit charset for bytes 0x80-0x9f, same as byte if NULL
+	const unsigned short *c1;
+};
+
+static const struct charset charsets[] = {
+	{ "UTF-16LE", NULL, 2, false, NULL },
+	{ "UTF-16BE", NULL, 2, true, NULL },
+	{ "UTF-32LE", NULL, 4, false, NULL },
+	{ "UTF-32BE", NULL, 4, true, NULL },
+	{ "ISO-8859-1", "LATIN1", 1, false, NULL },
+	{ "WINDOWS-1252", "CP1252", 1, false, cp1252_c1 },
+};
+
+// characters checked at once for ASCII
+#define ASCII_BLOCK 16
+
 struct cconv {
 	iconv_t cd;
 
+	// NULL if iconv is used
+	const struct charset *charset;
+	bool to_utf8;
+
 	char *obuf;
 	size_t osize;
 	size_t opos;
@@ -43,7 +83,7 @@ static int encoding_char_size(const char *encoding)
 	if (str_has_prefix(encoding, "UTF-16"))
 		return 2;
 	if (str_has_prefix(encoding, "UTF-32"))
-		return 2;
+		return 4;
 	return 1;
 }
 
@@ -78,6 +118,352 @@ static void add_replacement(struct cconv *c)
 	c->opos += c->rcount;
 }
 
+static void reserve_obuf(struct cconv *c, size_t count)
+{
+	while (c->osize - c->opos < count)
+		resize_obuf(c);
+}
+
+static const struct charset *find_charset(const char *encoding)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_COUNT(charsets); i++) {
+		const struct charset *cs = &charsets[i];
+
+		if (streq(encoding, cs->name) || (cs->alias && streq(encoding, cs->alias)))
+			return cs;
+	}
+	return NULL;
+}
+
+static inline unsigned int get_unit(const unsigned char *in, int unit, bool big_endian)
+{
+	if (unit == 2) {
+		if (big_endian)
+			return in[0] << 8 | in[1];
+		return in[1] << 8 | in[0];
+	}
+	if (big_endian)
+		return (unsigned int)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+	return (unsigned int)in[3] << 24 | in[2] << 16 | in[1] << 8 | in[0];
+}
+
+static inline int put_unit(unsigned char *out, unsigned int u, int unit, bool big_endian)
+{
+	int i;
+
+	for (i = 0; i < unit; i++) {
+		out[big_endian ? unit - 1 - i : i] = u & 0xff;
+		u >>= 8;
+	}
+	return unit;
+}
+
+// returns size of the encoded character
+static int put_char(const struct charset *cs, unsigned char *out, unsigned int u)
+{
+	if (cs->unit == 2 && u > 0xffff) {
+		u -= 0x10000;
+		put_unit(out, 0xd800 | u >> 10, 2, cs->big_endian);
+		return 2 + put_unit(out + 2, 0xdc00 | (u & 0x3ff), 2, cs->big_endian);
+	}
+	return put_unit(out, u, cs->unit, cs->big_endian);
+}
+
+// ASCII_BLOCK code units of ASCII? Has no early exit so it vectorizes.
+static inline bool ascii_units(const unsigned char *in, int unit, bool big_endian)
+{
+	int low = big_endian ? unit - 1 : 0;
+	unsigned int bits = 0;
+	int i;
+
+	for (i = 0; i < ASCII_BLOCK * unit; i++)
+		bits |= i % unit == low ? in[i] & 0x80 : in[i];
+	return bits == 0;
+}
+
+static void add_invalid(struct cconv *c, unsigned char *out, size_t *opos)
+{
+	c->errors++;
+	memcpy(out + *opos, c->rbuf, c->rcount);
+	*opos += c->rcount;
+}
+
+/*
+ * Decoders and encoders convert whole characters and return number of
+ * bytes consumed. Rest of the input is an incomplete character. Output
+ * buffer must have room for the worst case, see native_process().
+ */
+static size_t decode_utf16(struct cconv *c, const unsigned char *in, size_t len, bool big_endian)
+{
+	unsigned char *out = (unsigned char *)c->obuf;
+	size_t i = 0, o = c->opos;
+	int low = big_endian ? 1 : 0;
+
+	while (i + 2 <= len) {
+		unsigned int u;
+
+		if (i + ASCII_BLOCK * 2 <= len && ascii_units(in + i, 2, big_endian)) {
+			int k;
+
+			for (k = 0; k < ASCII_BLOCK; k++)
+				out[o + k] = in[i + k * 2 + low];
+			o += ASCII_BLOCK;
+			i += ASCII_BLOCK * 2;
+			continue;
+		}
+
+		u = get_unit(in + i, 2, big_endian);
+		if (u >= 0xd800 && u <= 0xdbff) {
+			unsigned int low_surrogate;
+
+			if (i + 4 > len)
+				break;
+			low_surrogate = get_unit(in + i + 2, 2, big_endian);
+			if (low_surrogate >= 0xdc00 && low_surrogate <= 0xdfff) {
+				long idx = o;
+
+				u = 0x10000 + ((u - 0xd800) << 10) + (low_surrogate - 0xdc00);
+				u_set_char_raw((char *)out, &idx, u);
+				o = idx;
+				i += 4;
+				continue;
+			}
+			add_invalid(c, out, &o);
+		} else if (u >= 0xdc00 && u <= 0xdfff) {
+			add_invalid(c, out, &o);
+		} else {
+			long idx = o;
+
+			u_set_char_raw((char *)out, &idx, u);
+			o = idx;
+		}
+		i += 2;
+	}
+	c->opos = o;
+	return i;
+}
+
+static size_t decode_utf32(struct cconv *c, const unsigned char *in, size_t len, bool big_endian)
+{
+	unsigned char *out = (unsigned char *)c->obuf;
+	size_t i = 0, o = c->opos;
+	int low = big_endian ? 3 : 0;
+
+	while (i + 4 <= len) {
+		unsigned int u;
+
+		if (i + ASCII_BLOCK * 4 <= len && ascii_units(in + i, 4, big_endian)) {
+			int k;
+
+			for (k = 0; k < ASCII_BLOCK; k++)
+				out[o + k] = in[i + k * 4 + low];
+			o += ASCII_BLOCK;
+			i += ASCII_BLOCK * 4;
+			continue;
+		}
+
+		u = get_unit(in + i, 4, big_endian);
+		if (u > 0x10ffff || (u >= 0xd800 && u <= 0xdfff)) {
+			add_invalid(c, out, &o);
+		} else {
+			long idx = o;
+
+			u_set_char_raw((char *)out, &idx, u);
+			o = idx;
+		}
+		i += 4;
+	}
+	c->opos = o;
+	return i;
+}
+
+static size_t decode_8bit(struct cconv *c, const unsigned char *in, size_t len)
+{
+	const unsigned short *c1 = c->charset->c1;
+	unsigned char *out = (unsigned char *)c->obuf;
+	size_t i = 0, o = c->opos;
+
+	while (i < len) {
+		unsigned int u = in[i];
+		long idx;
+
+		if (i + ASCII_BLOCK <= len && ascii_units(in + i, 1, false)) {
+			memcpy(out + o, in + i, ASCII_BLOCK);
+			o += ASCII_BLOCK;
+			i += ASCII_BLOCK;
+			continue;
+		}
+
+		i++;
+		if (c1 && u >= 0x80 && u <= 0x9f) {
+			u = c1[u - 0x80];
+			if (!u) {
+				add_invalid(c, out, &o);
+				continue;
+			}
+		}
+		idx = o;
+		u_set_char_raw((char *)out, &idx, u);
+		o = idx;
+	}
+	c->opos = o;
+	return i;
+}
+
+// incomplete but valid so far UTF-8 sequence at end of input?
+static bool incomplete_utf8(const unsigned char *in, size_t len)
+{
+	unsigned int first = in[0];
+	size_t need, i;
+
+	if (first >= 0xc2 && first <= 0xdf)
+		need = 2;
+	else if (first >= 0xe0 && first <= 0xef)
+		need = 3;
+	else if (first >= 0xf0 && first <= 0xf4)
+		need = 4;
+	else
+		return false;
+
+	if (len >= need)
+		return false;
+	for (i = 1; i < len; i++) {
+		if ((in[i] & 0xc0) != 0x80)
+			return false;
+	}
+	return true;
+}
+
+static bool can_encode(const struct charset *cs, unsigned int u)
+{
+	if (u > 0x10ffff || (u >= 0xd800 && u <= 0xdfff))
+		return false;
+	if (cs->unit > 1)
+		return true;
+	if (u >= 0x80 && u <= 0x9f)
+		return cs->c1 == NULL;
+	return u <= 0xff;
+}
+
+// character of 8-bit charset for byte 0x80-0x9f, or 0
+static unsigned int encode_c1(const struct charset *cs, unsigned int u)
+{
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (cs->c1[i] == u)
+			return 0x80 + i;
+	}
+	return 0;
+}
+
+static size_t encode(struct cconv *c, const unsigned char *in, size_t len)
+{
+	const struct charset *cs = c->charset;
+	unsigned char *out = (unsigned char *)c->obuf;
+	size_t i = 0, o = c->opos;
+	int low = cs->big_endian ? cs->unit - 1 : 0;
+
+	while (i < len) {
+		unsigned int u = in[i];
+		long idx;
+
+		if (i + ASCII_BLOCK <= len && ascii_units(in + i, 1, false)) {
+			int k;
+
+			if (cs->unit == 1) {
+				memcpy(out + o, in + i, ASCII_BLOCK);
+			} else {
+				memset(out + o, 0, ASCII_BLOCK * cs->unit);
+				for (k = 0; k < ASCII_BLOCK; k++)
+					out[o + k * cs->unit + low] = in[i + k];
+			}
+			o += ASCII_BLOCK * cs->unit;
+			i += ASCII_BLOCK;
+			continue;
+		}
+
+		if (u < 0x80) {
+			o += put_char(cs, out + o, u);
+			i++;
+			continue;
+		}
+		if (incomplete_utf8(in + i, len - i))
+			break;
+
+		idx = i;
+		u = u_get_nonascii(in, len, &idx);
+		i = idx;
+		if (can_encode(cs, u)) {
+			o += put_char(cs, out + o, u);
+			continue;
+		}
+		if (cs->c1 && u > 0xff) {
+			u = encode_c1(cs, u);
+			if (u) {
+				out[o++] = u;
+				continue;
+			}
+		}
+		add_invalid(c, out, &o);
+	}
+	c->opos = o;
+	return i;
+}
+
+static size_t native_convert(struct cconv *c, const unsigned char *in, size_t len)
+{
+	const struct charset *cs = c->charset;
+
+	if (!c->to_utf8)
+		return encode(c, in, len);
+	if (cs->unit == 2)
+		return decode_utf16(c, in, len, cs->big_endian);
+	if (cs->unit == 4)
+		return decode_utf32(c, in, len, cs->big_endian);
+	return decode_8bit(c, in, len);
+}
+
+static void native_process(struct cconv *c, const unsigned char *input, size_t len)
+{
+	const struct charset *cs = c->charset;
+	size_t consumed;
+
+	// worst case is 3 bytes of UTF-8 from 1 byte of CP1252 or 4 bytes
+	// of UTF-32 from 1 byte of UTF-8, replacement is not bigger
+	reserve_obuf(c, (len + sizeof(c->tbuf)) * (c->to_utf8 ? 4 - cs->unit / 2 : cs->unit));
+
+	// complete character left from previous call
+	while (c->tcount > 0 && len > 0) {
+		unsigned char tmp[2 * sizeof(c->tbuf)];
+		size_t count = len < sizeof(c->tbuf) ? len : sizeof(c->tbuf);
+		size_t total = c->tcount + count;
+
+		memcpy(tmp, c->tbuf, c->tcount);
+		memcpy(tmp + c->tcount, input, count);
+		consumed = native_convert(c, tmp, total);
+		if (consumed > c->tcount) {
+			input += consumed - c->tcount;
+			len -= consumed - c->tcount;
+			c->tcount = 0;
+		} else {
+			// still incomplete
+			memcpy(c->tbuf, tmp + consumed, total - consumed);
+			c->tcount = total - consumed;
+			input += count;
+			len -= count;
+		}
+	}
+
+	consumed = native_convert(c, input, len);
+	if (consumed < len) {
+		memcpy(c->tbuf, input + consumed, len - consumed);
+		c->tcount = len - consumed;
+	}
+}
+
 static size_t handle_invalid(struct cconv *c, const char *buf, size_t count)
 {
 	d_print("%d %zd\n", c->char_size, count);
@@ -178,6 +564,11 @@ void cconv_process(struct cconv *c, const char *input, size_t len)
 		c->consumed = 0;
 	}
 
+	if (c->charset) {
+		native_process(c, (const unsigned char *)input, len);
+		return;
+	}
+
 	if (c->tcount > 0) {
 		size_t ipos = convert_incomplete(c, input, len);
 		input += ipos;
@@ -210,7 +601,40 @@ void cconv_process(struct cconv *c, const char *input, size_t len)
 	}
 }
 
+static struct cconv *create_native(const struct charset *cs, bool to_utf8)
+{
+	struct cconv *c = create((iconv_t)-1);
+
+	c->charset = cs;
+	c->to_utf8 = to_utf8;
+	if (to_utf8) {
+		memcpy(c->rbuf, replacement, sizeof(replacement));
+		c->rcount = sizeof(replacement);
+	} else {
+		c->rcount = put_char(cs, (unsigned char *)c->rbuf, 0xbf);
+	}
+	return c;
+}
+
 struct cconv *cconv_to_utf8(const char *encoding)
+{
+	const struct charset *cs = find_charset(encoding);
+
+	if (cs)
+		return create_native(cs, true);
+	return iconv_to_utf8(encoding);
+}
+
+struct cconv *cconv_from_utf8(const char *encoding)
+{
+	const struct charset *cs = find_charset(encoding);
+
+	if (cs)
+		return create_native(cs, false);
+	return iconv_from_utf8(encoding);
+}
+
+struct cconv *iconv_to_utf8(const char *encoding)
 {
 	struct cconv *c;
 	iconv_t cd;
@@ -225,7 +649,7 @@ struct cconv *cconv_to_utf8(const char *encoding)
 	return c;
 }
 
-struct cconv *cconv_from_utf8(const char *encoding)
+struct cconv *iconv_from_utf8(const char *encoding)
 {
 	struct cconv *c;
 	iconv_t cd = (iconv_t)-1;
@@ -288,7 +712,8 @@ char *cconv_consume_all(struct cconv *c, size_t *len)
 
 void cconv_free(struct cconv *c)
 {
-	iconv_close(c->cd);
+	if (c->charset == NULL)
+		iconv_close(c->cd);
 	free(c->obuf);
 	free(c);
 }
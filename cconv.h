@@ -7,6 +7,8 @@ struct cconv;
 
 struct cconv *cconv_to_utf8(const char *encoding);
 struct cconv *cconv_from_utf8(const char *encoding);
+struct cconv *iconv_to_utf8(const char *encoding);
+struct cconv *iconv_from_utf8(const char *encoding);
 void cconv_process(struct cconv *c, const char *input, size_t len);
 void cconv_flush(struct cconv *c);
 int cconv_nr_errors(struct cconv *c);
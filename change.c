@@ -3,23 +3,93 @@
 #include "error.h"
 #include "block.h"
 #include "view.h"
+#include "load-save.h"
+#include "lz.h"
+#include "journal.h"
 
 static enum change_merge change_merge;
 static enum change_merge prev_change_merge;
 
-static struct change *alloc_change(void)
+#define CHANGE_SLAB_SIZE 1024
+
+struct change_slab {
+	struct change_slab *next;
+	long used;
+	struct change changes[CHANGE_SLAB_SIZE];
+};
+
+struct change *alloc_change(struct buffer *b)
 {
-	return xcalloc(sizeof(struct change));
+	struct change *change = b->unused_changes;
+
+	if (change) {
+		b->unused_changes = change->next;
+	} else {
+		struct change_slab *slab = b->change_slabs;
+
+		if (!slab || slab->used == CHANGE_SLAB_SIZE) {
+			slab = xnew(struct change_slab, 1);
+			slab->next = b->change_slabs;
+			slab->used = 0;
+			b->change_slabs = slab;
+		}
+		change = &slab->changes[slab->used++];
+	}
+	clear(change);
+	return change;
 }
 
-static void add_change(struct change *change)
+static void free_prev(struct change *change)
 {
-	struct change *head = buffer->cur_change;
+	if (change->prev != &change->single_prev)
+		free(change->prev);
+	change->prev = NULL;
+	change->nr_prev = 0;
+}
+
+// heap array is not needed if only one newer change is left
+static void shrink_prev(struct change *change)
+{
+	if (change->nr_prev == 1 && change->prev != &change->single_prev) {
+		change->single_prev = change->prev[0];
+		free(change->prev);
+		change->prev = &change->single_prev;
+	}
+}
 
-	change->next = head;
-	xrenew(head->prev, head->nr_prev + 1);
-	head->prev[head->nr_prev++] = change;
+static void release_change(struct buffer *b, struct change *change)
+{
+	free(change->buf);
+	change->buf = NULL;
+	free_prev(change);
+	change->next = b->unused_changes;
+	b->unused_changes = change;
+}
+
+// add change as newest of the changes made after parent
+void link_change(struct change *parent, struct change *change)
+{
+	unsigned int n = parent->nr_prev;
+
+	if (n == 0) {
+		parent->single_prev = change;
+		parent->prev = &parent->single_prev;
+	} else if (n == 1) {
+		struct change **prev = xnew(struct change *, 4);
+
+		prev[0] = parent->prev[0];
+		parent->prev = prev;
+	} else if (n >= 4 && !(n & (n - 1))) {
+		xrenew(parent->prev, n * 2);
+	}
+	parent->prev[parent->nr_prev++] = change;
+	change->next = parent;
+}
 
+static void add_change(struct change *change)
+{
+	change->id = ++buffer->change_id;
+	link_change(buffer->cur_change, change);
 	buffer->cur_change = change;
 }
 
@@ -46,10 +116,11 @@ static struct change *new_change(void)
 		 * We don't want to record empty changes ever.
 		 */
 		add_change(change_barrier);
+		journal_add_change(buffer, change_barrier, NULL, 0);
 		change_barrier = NULL;
 	}
 
-	change = alloc_change();
+	change = alloc_change(buffer);
 	add_change(change);
 	return change;
 }
@@ -59,6 +130,44 @@ static long buffer_offset(void)
 	return block_iter_get_offset(&view->cursor);
 }
 
+static bool huge_buffer(void)
+{
+	if (buffer->huge) {
+		error_msg("File is too big to be edited.");
+		return true;
+	}
+	return false;
+}
+
+static void uncompress_change(struct change *change)
+{
+	char *buf;
+
+	if (!change->zsize)
+		return;
+	buf = xnew(char, change->del_count);
+	lz_decompress((unsigned char *)change->buf, change->zsize, (unsigned char *)buf, change->del_count);
+	free(change->buf);
+	change->buf = buf;
+	buffer->undo_size += change->del_count - change->zsize;
+	change->zsize = 0;
+}
+
+// inserted text is at cursor
+static void journal_insert(struct change *change, bool merged, long len)
+{
+	char *ins;
+
+	if (!buffer->journal)
+		return;
+	ins = block_iter_get_bytes(&view->cursor, len);
+	if (merged)
+		journal_merge_change(buffer, change, 'I', buffer_offset() - change->offset, ins, len);
+	else
+		journal_add_change(buffer, change, ins, len);
+	free(ins);
+}
+
 static void record_insert(long len)
 {
 	struct change *change = buffer->cur_change;
@@ -67,12 +176,14 @@ static void record_insert(long len)
 	if (change_merge == prev_change_merge && change_merge == CHANGE_MERGE_INSERT) {
 		BUG_ON(change->del_count);
 		change->ins_count += len;
+		journal_insert(change, true, len);
 		return;
 	}
 
 	change = new_change();
 	change->offset = buffer_offset();
 	change->ins_count = len;
+	journal_insert(change, false, len);
 }
 
 static void record_delete(char *buf, long len, bool move_after)
@@ -82,10 +193,13 @@ static void record_delete(char *buf, long len, bool move_after)
 	BUG_ON(!len);
 	BUG_ON(!buf);
 	if (change_merge == prev_change_merge) {
+		uncompress_change(change);
 		if (change_merge == CHANGE_MERGE_DELETE) {
 			xrenew(change->buf, change->del_count + len);
 			memcpy(change->buf + change->del_count, buf, len);
 			change->del_count += len;
+			buffer->undo_size += len;
+			journal_merge_change(buffer, change, 'D', change->del_count - len, buf, len);
 			free(buf);
 			return;
 		}
@@ -93,9 +207,11 @@ static void record_delete(char *buf, long len, bool move_after)
 			xrenew(buf, len + change->del_count);
 			memcpy(buf + len, change->buf, change->del_count);
 			change->del_count += len;
+			buffer->undo_size += len;
 			free(change->buf);
 			change->buf = buf;
 			change->offset -= len;
+			journal_merge_change(buffer, change, 'E', 0, buf, len);
 			return;
 		}
 	}
@@ -105,6 +221,8 @@ static void record_delete(char *buf, long len, bool move_after)
 	change->del_count = len;
 	change->move_after = move_after;
 	change->buf = buf;
+	buffer->undo_size += len;
+	journal_add_change(buffer, change, NULL, 0);
 }
 
 static void record_replace(char *deleted, long del_count, long ins_count)
@@ -120,6 +238,8 @@ static void record_replace(char *deleted, long del_count, long ins_count)
 	change->ins_count = ins_count;
 	change->del_count = del_count;
 	change->buf = deleted;
+	buffer->undo_size += del_count;
+	journal_insert(change, false, ins_count);
 }
 
 void begin_change(enum change_merge m)
@@ -140,7 +260,7 @@ void begin_change_chain(void)
 	 * Allocate change chain barrier but add it to the change tree only if
 	 * there will be any real changes
 	 */
-	change_barrier = alloc_change();
+	change_barrier = alloc_change(buffer);
 	change_merge = CHANGE_MERGE_NONE;
 }
 
@@ -148,11 +268,14 @@ void end_change_chain(void)
 {
 	if (change_barrier) {
 		/* There were no changes in this change chain. */
-		free(change_barrier);
+		release_change(buffer, change_barrier);
 		change_barrier = NULL;
 	} else {
 		/* There were some changes. Add end of chain marker. */
-		add_change(alloc_change());
+		struct change *change = alloc_change(buffer);
+
+		add_change(change);
+		journal_add_change(buffer, change, NULL, 0);
 	}
 }
 
@@ -174,17 +297,40 @@ static void fix_cursors(long offset, long del, long ins)
 	}
 }
 
+static void reverse_hunks(struct change *change)
+{
+	long size, del, ins;
+	char *buf;
+
+	uncompress_change(change);
+	block_iter_goto_offset(&view->cursor, change->offset);
+	buf = do_replace_hunks(change->buf, change->del_count, &size, &del, &ins);
+	if (buffer->views.count > 1)
+		fix_cursors(change->offset, del, ins);
+
+	free(change->buf);
+	change->buf = buf;
+	buffer->undo_size += size - change->del_count;
+	change->del_count = size;
+}
+
 static void reverse_change(struct change *change)
 {
+	if (change->hunks) {
+		reverse_hunks(change);
+		return;
+	}
 	if (buffer->views.count > 1)
 		fix_cursors(change->offset, change->ins_count, change->del_count);
 
+	uncompress_change(change);
 	block_iter_goto_offset(&view->cursor, change->offset);
 	if (!change->ins_count) {
 		// convert delete to insert
 		do_insert(change->buf, change->del_count);
 		if (change->move_after)
 			block_iter_skip_bytes(&view->cursor, change->del_count);
+		buffer->undo_size -= change->del_count;
 		change->ins_count = change->del_count;
 		change->del_count = 0;
 		free(change->buf);
@@ -199,19 +345,24 @@ static void reverse_change(struct change *change)
 		change->buf = buf;
 		change->ins_count = ins_count;
 		change->del_count = del_count;
+		buffer->undo_size += del_count - ins_count;
 	} else {
 		// convert insert to delete
 		change->buf = do_delete(change->ins_count);
 		change->del_count = change->ins_count;
 		change->ins_count = 0;
+		buffer->undo_size += change->del_count;
 	}
 }
 
 bool undo(void)
 {
-	struct change *change = buffer->cur_change;
+	struct change *change;
 
 	view_reset_preferred_x(view);
+	// history read from undo journal is checked when loading finishes
+	finish_loading(buffer);
+	change = buffer->cur_change;
 	if (!change->next)
 		return false;
 
@@ -231,14 +382,17 @@ bool undo(void)
 		reverse_change(change);
 	}
 	buffer->cur_change = change->next;
+	journal_set_cur(buffer);
 	return true;
 }
 
 bool redo(unsigned int change_id)
 {
-	struct change *change = buffer->cur_change;
+	struct change *change;
 
 	view_reset_preferred_x(view);
+	finish_loading(buffer);
+	change = buffer->cur_change;
 	if (!change->prev) {
 		/* don't complain if change_id is 0 */
 		if (change_id)
@@ -275,28 +429,284 @@ bool redo(unsigned int change_id)
 		reverse_change(change);
 	}
 	buffer->cur_change = change;
+	journal_set_cur(buffer);
 	return true;
 }
 
-void free_changes(struct change *ch)
+static int change_depth(struct change *change)
 {
-top:
-	while (ch->nr_prev)
-		ch = ch->prev[ch->nr_prev - 1];
+	int depth = 0;
 
-	// ch is leaf now
-	while (ch->next) {
-		struct change *next = ch->next;
+	while (change->next) {
+		change = change->next;
+		depth++;
+	}
+	return depth;
+}
 
-		free(ch->buf);
-		free(ch);
+// undo and redo changes until target is the current change
+void goto_change(struct change *target)
+{
+	struct change *change = buffer->cur_change;
+	struct change *ancestor = target;
+	int depth = change_depth(change);
+	int target_depth = change_depth(target);
+	PTR_ARRAY(path);
+	int i;
 
+	// undo up to common ancestor and collect changes to redo
+	while (depth > target_depth) {
+		if (!is_change_chain_barrier(change))
+			reverse_change(change);
+		change = change->next;
+		depth--;
+	}
+	while (target_depth > depth) {
+		ptr_array_add(&path, ancestor);
+		ancestor = ancestor->next;
+		target_depth--;
+	}
+	while (change != ancestor) {
+		if (!is_change_chain_barrier(change))
+			reverse_change(change);
+		change = change->next;
+		ptr_array_add(&path, ancestor);
+		ancestor = ancestor->next;
+	}
+	for (i = path.count - 1; i >= 0; i--) {
+		change = path.ptrs[i];
+		if (!is_change_chain_barrier(change))
+			reverse_change(change);
+	}
+	free(path.ptrs);
+	buffer->cur_change = target;
+}
+
+// unused change records have no buf or prev array
+void free_changes(struct buffer *b)
+{
+	struct change_slab *slab = b->change_slabs;
+
+	while (slab) {
+		struct change_slab *next = slab->next;
+		long i;
+
+		for (i = 0; i < slab->used; i++) {
+			struct change *change = &slab->changes[i];
+
+			free(change->buf);
+			free_prev(change);
+		}
+		free(slab);
+		slab = next;
+	}
+	free_prev(&b->change_head);
+	b->change_slabs = NULL;
+	b->unused_changes = NULL;
+}
+
+static long saved_bytes(struct change *ch)
+{
+	if (!ch->buf)
+		return 0;
+	return ch->zsize ? ch->zsize : ch->del_count;
+}
+
+// memory used by whole change tree of b, false if undo_size is wrong
+bool get_undo_stats(struct buffer *b, long *changes, long *bytes)
+{
+	PTR_ARRAY(stack);
+	long saved = 0;
+
+	*changes = 0;
+	*bytes = 0;
+	ptr_array_add(&stack, &b->change_head);
+	while (stack.count) {
+		struct change *ch = stack.ptrs[--stack.count];
+		unsigned int i;
+
+		if (ch != &b->change_head) {
+			*changes += 1;
+			*bytes += sizeof(*ch);
+		}
+		if (ch->prev != &ch->single_prev)
+			*bytes += ch->nr_prev * sizeof(*ch->prev);
+		saved += saved_bytes(ch);
+		for (i = 0; i < ch->nr_prev; i++)
+			ptr_array_add(&stack, ch->prev[i]);
+	}
+	free(stack.ptrs);
+	*bytes += saved;
+	return saved == b->undo_size;
+}
+
+// compress deleted text of oldest changes until undo_size <= target
+static void compress_changes(long target)
+{
+	PTR_ARRAY(stack);
+
+	ptr_array_add(&stack, &buffer->change_head);
+	while (stack.count && buffer->undo_size > target) {
+		struct change *ch = stack.ptrs[--stack.count];
+		unsigned int i = ch->nr_prev;
+
+		// oldest branch first
+		while (i--)
+			ptr_array_add(&stack, ch->prev[i]);
+
+		if (ch->buf && !ch->zsize && ch->del_count >= 64 && ch != buffer->cur_change) {
+			unsigned char *z = xnew(unsigned char, ch->del_count);
+			long zsize = lz_compress((unsigned char *)ch->buf, ch->del_count, z, ch->del_count - 1);
+
+			if (zsize > 0) {
+				free(ch->buf);
+				ch->buf = xrealloc(z, zsize);
+				ch->zsize = zsize;
+				buffer->undo_size -= ch->del_count - zsize;
+			} else {
+				free(z);
+			}
+		}
+	}
+	free(stack.ptrs);
+}
+
+static void free_change(struct change *ch)
+{
+	buffer->undo_size -= saved_bytes(ch);
+	if (buffer->saved_change == ch)
+		buffer->saved_change = NULL;
+	if (buffer->saving_change == ch)
+		buffer->saving_change = NULL;
+	release_change(buffer, ch);
+}
+
+// forget oldest change or change chain if it isn't needed to reach cur_change
+static bool forget_oldest_change(void)
+{
+	struct change *head = &buffer->change_head;
+	struct change *first, *last, *ch;
+	unsigned int i;
+
+	if (head->nr_prev != 1)
+		return false;
+
+	first = last = head->prev[0];
+	if (is_change_chain_barrier(first)) {
+		// whole chain up to its end barrier
+		do {
+			if (last == buffer->cur_change || last->nr_prev != 1)
+				return false;
+			last = last->prev[0];
+		} while (!is_change_chain_barrier(last));
+	}
+	if (last == buffer->cur_change)
+		return false;
+
+	// state of head is lost and replaced with state of last
+	head->id = last->id;
+	if (buffer->saved_change == head)
+		buffer->saved_change = NULL;
+	else if (buffer->saved_change == last)
+		buffer->saved_change = head;
+	if (buffer->saving_change == head)
+		buffer->saving_change = NULL;
+	else if (buffer->saving_change == last)
+		buffer->saving_change = head;
+
+	free_prev(head);
+	if (last->prev == &last->single_prev) {
+		head->single_prev = last->single_prev;
+		head->prev = &head->single_prev;
+	} else {
+		head->prev = last->prev;
+	}
+	head->nr_prev = last->nr_prev;
+	shrink_prev(head);
+	last->prev = NULL;
+	last->nr_prev = 0;
+	for (i = 0; i < head->nr_prev; i++)
+		head->prev[i]->next = head;
+
+	ch = first;
+	while (ch != last) {
+		struct change *next = ch->prev[0];
+
+		free_change(ch);
 		ch = next;
-		if (--ch->nr_prev)
-			goto top;
+	}
+	free_change(last);
+	return true;
+}
+
+// child of ch leading to cur_change, NULL if there is none
+static struct change *path_child(struct change *ch)
+{
+	struct change *c = buffer->cur_change;
+
+	while (c->next && c->next != ch)
+		c = c->next;
+	return c->next ? c : NULL;
+}
+
+// forget oldest branch of the change tree not leading to cur_change
+static bool forget_oldest_branch(void)
+{
+	struct change *ch = &buffer->change_head;
+	struct change *child = NULL;
+	PTR_ARRAY(stack);
+	unsigned int i;
+
+	while (ch->nr_prev) {
+		if (ch == buffer->cur_change) {
+			child = ch->prev[0];
+			break;
+		}
+		if (ch->nr_prev > 1) {
+			struct change *c = path_child(ch);
+
+			child = ch->prev[c == ch->prev[0]];
+			break;
+		}
+		ch = ch->prev[0];
+	}
+	if (!child)
+		return false;
+
+	for (i = 0; ch->prev[i] != child; i++)
+		;
+	ch->nr_prev--;
+	memmove(ch->prev + i, ch->prev + i + 1, (ch->nr_prev - i) * sizeof(*ch->prev));
+	if (!ch->nr_prev)
+		free_prev(ch);
+	shrink_prev(ch);
+
+	ptr_array_add(&stack, child);
+	while (stack.count) {
+		struct change *c = stack.ptrs[--stack.count];
+
+		for (i = 0; i < c->nr_prev; i++)
+			ptr_array_add(&stack, c->prev[i]);
+		free_change(c);
+	}
+	free(stack.ptrs);
+	return true;
+}
+
+// keep deleted text saved for undo within undo-size option
+void trim_undo(void)
+{
+	long limit = (long)options.undo_size << 20;
+	long target = limit - limit / 4;
+
+	if (!limit || buffer->undo_size <= limit)
+		return;
 
-		// we have become leaf
-		free(ch->prev);
+	if (options.compress_undo)
+		compress_changes(target);
+	while (buffer->undo_size > target) {
+		if (!forget_oldest_change() && !forget_oldest_branch())
+			break;
 	}
 }
 
@@ -305,9 +715,13 @@ void buffer_insert_bytes(const char *buf, long len)
 	long rec_len = len;
 
 	view_reset_preferred_x(view);
-	if (len == 0)
+	if (len == 0 || huge_buffer())
 		return;
 
+	// EOF and undo offsets must not move after the edit
+	finish_loading(buffer);
+	journal_start(buffer);
+
 	if (buf[len - 1] != '\n' && block_iter_is_eof(&view->cursor)) {
 		// force newline at EOF
 		do_insert("\n", 1);
@@ -319,6 +733,7 @@ void buffer_insert_bytes(const char *buf, long len)
 
 	if (buffer->views.count > 1)
 		fix_cursors(block_iter_get_offset(&view->cursor), len, 0);
+	trim_undo();
 }
 
 static bool would_delete_last_bytes(long count)
@@ -344,9 +759,12 @@ static bool would_delete_last_bytes(long count)
 static void buffer_delete_bytes_internal(long len, bool move_after)
 {
 	view_reset_preferred_x(view);
-	if (len == 0)
+	if (len == 0 || huge_buffer())
 		return;
 
+	finish_loading(buffer);
+	journal_start(buffer);
+
 	// check if all newlines from EOF would be deleted
 	if (would_delete_last_bytes(len)) {
 		struct block_iter bi = view->cursor;
@@ -364,6 +782,7 @@ static void buffer_delete_bytes_internal(long len, bool move_after)
 
 	if (buffer->views.count > 1)
 		fix_cursors(block_iter_get_offset(&view->cursor), len, 0);
+	trim_undo();
 }
 
 void buffer_delete_bytes(long len)
@@ -389,6 +808,11 @@ void buffer_replace_bytes(long del_count, const char *inserted, long ins_count)
 		buffer_delete_bytes(del_count);
 		return;
 	}
+	if (huge_buffer())
+		return;
+
+	finish_loading(buffer);
+	journal_start(buffer);
 
 	// check if all newlines from EOF would be deleted
 	if (would_delete_last_bytes(del_count)) {
@@ -406,4 +830,34 @@ void buffer_replace_bytes(long del_count, const char *inserted, long ins_count)
 
 	if (buffer->views.count > 1)
 		fix_cursors(block_iter_get_offset(&view->cursor), del_count, ins_count);
+	trim_undo();
+}
+
+/*
+ * Make many replacements starting at cursor as one change. Only the
+ * replaced parts of the text are saved for undo. Hunks must not delete
+ * the last newline of the buffer.
+ */
+void buffer_replace_hunks(const char *hunks, long size)
+{
+	struct change *change;
+	long del, ins;
+
+	view_reset_preferred_x(view);
+	if (size == 0 || huge_buffer())
+		return;
+
+	finish_loading(buffer);
+	journal_start(buffer);
+
+	change = new_change();
+	change->offset = buffer_offset();
+	change->hunks = true;
+	change->buf = do_replace_hunks(hunks, size, &change->del_count, &del, &ins);
+	buffer->undo_size += change->del_count;
+	journal_add_change(buffer, change, hunks, size);
+
+	if (buffer->views.count > 1)
+		fix_cursors(change->offset, del, ins);
+	trim_undo();
 }
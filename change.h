@@ -11,6 +11,7 @@ enum change_merge {
 };
 
 struct change;
+struct buffer;
 
 void begin_change(enum change_merge m);
 void end_change(void);
@@ -18,10 +19,16 @@ void begin_change_chain(void);
 void end_change_chain(void);
 bool undo(void);
 bool redo(unsigned int change_id);
-void free_changes(struct change *head);
+void goto_change(struct change *target);
+struct change *alloc_change(struct buffer *b);
+void link_change(struct change *parent, struct change *change);
+void free_changes(struct buffer *b);
+bool get_undo_stats(struct buffer *b, long *changes, long *bytes);
+void trim_undo(void);
 void buffer_insert_bytes(const char *buf, long len);
 void buffer_delete_bytes(long len);
 void buffer_erase_bytes(long len);
 void buffer_replace_bytes(long del_count, const char *inserted, long ins_count);
+void buffer_replace_hunks(const char *hunks, long size);
 
 #endif
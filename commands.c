@@ -25,12 +25,15 @@
 #include "msg.h"
 #include "frame.h"
 #include "load-save.h"
+#include "block.h"
 #include "selection.h"
 #include "encoding.h"
 #include "path.h"
 #include "error.h"
 #include "input-special.h"
 #include "git-open.h"
+#include "hl.h"
+#include "journal.h"
 
 // go to compiler error saving position if file changed or cursor moved
 static void activate_current_message_save(void)
@@ -59,6 +62,18 @@ static void cmd_bind(const char *pf, char **args)
 		remove_binding(args[0]);
 }
 
+static void cmd_blocks(const char *pf, char **args)
+{
+	struct block_stats s;
+
+	if (*pf)
+		compact_blocks(buffer);
+
+	get_block_stats(buffer, &s);
+	info_msg("%ld blocks (%ld small, %ld mapped), %ld bytes, %ld unused bytes allocated, %ld allocations, %ld mallocs",
+		s.blocks, s.small, s.mapped, s.size, s.unused, s.allocs, s.mallocs);
+}
+
 static void cmd_bof(const char *pf, char **args)
 {
 	move_bof();
@@ -332,6 +347,8 @@ static void cmd_filter(const char *pf, char **args)
 	struct filter_data data;
 	struct block_iter save = view->cursor;
 
+	// whole file is filtered, not just the part loaded so far
+	finish_loading(buffer);
 	if (view->selection) {
 		data.in_len = prepare_selection(view);
 	} else {
@@ -530,9 +547,13 @@ static void cmd_open(const char *pf, char **args)
 {
 	const char *enc = NULL;
 	char *encoding = NULL;
+	bool huge = false;
 
 	while (*pf) {
 		switch (*pf) {
+		case 'H':
+			huge = true;
+			break;
 		case 'e':
 			enc = *args++;
 			break;
@@ -540,6 +561,18 @@ static void cmd_open(const char *pf, char **args)
 		pf++;
 	}
 
+	if (huge) {
+		int i;
+
+		if (!args[0]) {
+			error_msg("No filename.");
+			return;
+		}
+		for (i = 0; args[i]; i++)
+			window_open_huge_file(window, args[i]);
+		return;
+	}
+
 	if (enc) {
 		encoding = normalize_encoding(enc);
 		if (encoding == NULL) {
@@ -685,6 +718,7 @@ static void cmd_quit(const char *pf, char **args)
 		editor_status = EDITOR_EXITING;
 		return;
 	}
+	finish_background_saves(NULL, true);
 	for (i = 0; i < buffers.count; i++) {
 		struct buffer *b = buffers.ptrs[i];
 		if (buffer_modified(b)) {
@@ -803,13 +837,26 @@ static int stat_changed(const struct stat *a, const struct stat *b)
 static void cmd_save(const char *pf, char **args)
 {
 	char *absolute = buffer->abs_filename;
-	char *encoding = buffer->encoding;
+	char *encoding;
 	const char *enc = NULL;
 	bool force = false;
 	enum newline_sequence newline = buffer->newline;
 	mode_t old_mode = buffer->st.st_mode;
 	struct stat st;
 	bool new_locked = false;
+	int rc;
+
+	if (buffer->huge) {
+		error_msg("File is too big to be saved.");
+		return;
+	}
+
+	// previous save must finish first, it updates buffer->st
+	finish_background_saves(buffer, true);
+
+	// encoding is not known until whole file has been decoded
+	finish_loading(buffer);
+	encoding = buffer->encoding;
 
 	while (*pf) {
 		switch (*pf) {
@@ -933,10 +980,13 @@ static void cmd_save(const char *pf, char **args)
 		/* allow chmod 755 etc. */
 		buffer->st.st_mode = st.st_mode;
 	}
-	if (save_buffer(buffer, absolute, encoding, newline))
+	rc = save_buffer(buffer, absolute, encoding, newline);
+	if (rc < 0)
 		goto error;
 
-	buffer->saved_change = buffer->cur_change;
+	// background save updates saved_change when it finishes
+	if (rc == 0)
+		buffer->saved_change = buffer->cur_change;
 	buffer->ro = false;
 	buffer->newline = newline;
 	if (encoding != buffer->encoding) {
@@ -958,6 +1008,8 @@ static void cmd_save(const char *pf, char **args)
 		// filename change is not detected (only buffer_modified() change)
 		mark_buffer_tabbars_changed(buffer);
 	}
+	if (rc == 0)
+		journal_saved(buffer);
 	if (!old_mode && streq(buffer->options.filetype, "none")) {
 		/* new file and most likely user has not changed the filetype */
 		if (buffer_detect_filetype(buffer)) {
@@ -1191,6 +1243,42 @@ static void cmd_shift(const char *pf, char **args)
 	shift_lines(count);
 }
 
+static void cmd_stats(const char *pf, char **args)
+{
+	struct block_stats s;
+	long changes, undo;
+
+	if (*pf) {
+		struct buffer *max = NULL;
+		long total = 0, max_size = -1;
+		int i;
+
+		for (i = 0; i < buffers.count; i++) {
+			struct buffer *b = buffers.ptrs[i];
+			long size = buffer_memory(b);
+
+			total += size;
+			if (size > max_size) {
+				max = b;
+				max_size = size;
+			}
+		}
+		info_msg("%ld buffers use %ld bytes, biggest is %s with %ld bytes",
+			buffers.count, total, buffer_filename(max), max_size);
+		return;
+	}
+
+	get_block_stats(buffer, &s);
+	if (!get_undo_stats(buffer, &changes, &undo)) {
+		error_msg("undo_size %ld doesn't match text saved in %ld changes", buffer->undo_size, changes);
+		return;
+	}
+	info_msg("blocks %ld, text %ld, slack %ld, heap %ld, undo %ld (%ld changes), states %ld/%ld, hl %ld",
+		s.blocks, s.size, s.unused, buffer->arena.heap_size, undo, changes,
+		(long)line_states_count(&buffer->line_start_states), buffer->line_start_states.nr_runs,
+		hl_scratch_size());
+}
+
 static void cmd_suspend(const char *pf, char **args)
 {
 	suspend();
@@ -1489,6 +1577,7 @@ static void cmd_wswap(const char *pf, char **args)
 const struct command commands[] = {
 	{ "alias",		"",	2,  2, cmd_alias },
 	{ "bind",		"",	1,  2, cmd_bind },
+	{ "blocks",		"c",	0,  0, cmd_blocks },
 	{ "bof",		"",	0,  0, cmd_bof },
 	{ "bol",		"",	0,  0, cmd_bol },
 	{ "case",		"lu",	0,  0, cmd_case },
@@ -1526,7 +1615,7 @@ const struct command commands[] = {
 	{ "msg",		"np",	0,  0, cmd_msg },
 	{ "new-line",		"",	0,  0, cmd_new_line },
 	{ "next",		"",	0,  0, cmd_next },
-	{ "open",		"e=",	0, -1, cmd_open },
+	{ "open",		"He=",	0, -1, cmd_open },
 	{ "option",		"-r",	3, -1, cmd_option },
 	{ "pass-through",	"-ms",	1, -1, cmd_pass_through },
 	{ "paste",		"",	0,  0, cmd_paste },
@@ -1549,6 +1638,7 @@ const struct command commands[] = {
 	{ "set",		"gl",	1, -1, cmd_set },
 	{ "setenv",		"",	2,  2, cmd_setenv },
 	{ "shift",		"",	1,  1, cmd_shift },
+	{ "stats",		"a",	0,  0, cmd_stats },
 	{ "suspend",		"",	0,  0, cmd_suspend },
 	{ "tag",		"r",	0,  1, cmd_tag },
 	{ "toggle",		"glv",	1, -1, cmd_toggle },
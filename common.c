@@ -4,21 +4,6 @@
 const char hex_tab[16] = "0123456789abcdef";
 bool term_utf8;
 
-long count_nl(const char *buf, long size)
-{
-	const char *end = buf + size;
-	long nl = 0;
-
-	while (buf < end) {
-		buf = memchr(buf, '\n', end - buf);
-		if (!buf)
-			break;
-		buf++;
-		nl++;
-	}
-	return nl;
-}
-
 int count_strings(char **strings)
 {
 	int count;
@@ -168,6 +153,33 @@ ssize_t xwrite(int fd, const void *buf, size_t count)
 	return count_save;
 }
 
+// iov is modified if write is partial
+ssize_t xwritev(int fd, struct iovec *iov, int count)
+{
+	ssize_t total = 0;
+
+	while (count > 0) {
+		ssize_t rc = writev(fd, iov, count);
+
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += rc;
+		while (count > 0 && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return total;
+}
+
 // Returns size of file or -1 on error.
 // For empty file *bufp is NULL otherwise *bufp is NUL-terminated.
 ssize_t read_file(const char *filename, char **bufp)
@@ -217,6 +229,15 @@ char *buf_next_line(char *buf, ssize_t *posp, ssize_t size)
 	return line;
 }
 
+// monotonic clock in milliseconds
+long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 void bug(const char *function, const char *fmt, ...)
 {
 	va_list ap;
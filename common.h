@@ -63,7 +63,6 @@ static inline bool str_has_prefix(const char *str, const char *prefix)
 	return !strncmp(str, prefix, strlen(prefix));
 }
 
-long count_nl(const char *buf, long size);
 int count_strings(char **strings);
 void free_strings(char **strings);
 int number_width(long n);
@@ -75,9 +74,11 @@ char *xvsprintf(const char *format, va_list ap);
 char *xsprintf(const char *format, ...) FORMAT(1);
 ssize_t xread(int fd, void *buf, size_t count);
 ssize_t xwrite(int fd, const void *buf, size_t count);
+ssize_t xwritev(int fd, struct iovec *iov, int count);
 ssize_t read_file(const char *filename, char **bufp);
 long stat_read_file(const char *filename, char **bufp, struct stat *st);
 char *buf_next_line(char *buf, ssize_t *posp, ssize_t size);
+long now_ms(void);
 void bug(const char *function, const char *fmt, ...) FORMAT(2) NORETURN;
 void debug_print(const char *function, const char *fmt, ...) FORMAT(2);
 
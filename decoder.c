@@ -1,8 +1,38 @@
 #include "decoder.h"
 #include "editor.h"
-#include "uchar.h"
+#include "utf8.h"
 #include "common.h"
 #include "cconv.h"
+#include "newline.h"
+
+#include <pthread.h>
+
+// input is converted in chunks of whole lines of at least this size
+#define CHUNK_SIZE (256 * 1024)
+#define CHUNKS_PER_WORKER 4
+#define MAX_WORKERS 8
+
+// input validated at once when the encoding is detected, rest is validated
+// ahead of decoding, see file_decoder_validate()
+#define DETECT_SIZE (64 * 1024)
+
+struct decoded_chunk {
+	const unsigned char *in;
+	ssize_t in_size;
+
+	// reused for following chunks to keep its output buffer
+	struct cconv *cconv;
+	char *out;
+	size_t out_size;
+	size_t out_pos;
+	int errors;
+};
+
+struct chunk_queue {
+	pthread_mutex_t lock;
+	struct file_decoder *dec;
+	int next;
+};
 
 static bool fill(struct file_decoder *dec)
 {
@@ -15,6 +45,9 @@ static bool fill(struct file_decoder *dec)
 	if (dec->ipos == dec->isize)
 		return false;
 
+	// state of dec->cconv must be kept from now on
+	dec->newline_size = 0;
+
 	cconv_process(dec->cconv, dec->ibuf + dec->ipos, icount);
 	dec->ipos += icount;
 	if (dec->ipos == dec->isize) {
@@ -24,37 +57,164 @@ static bool fill(struct file_decoder *dec)
 	return true;
 }
 
-static int set_encoding(struct file_decoder *dec, const char *encoding);
+static int nr_workers(void)
+{
+	static int nr;
 
-static bool detect(struct file_decoder *dec, const unsigned char *line, ssize_t len)
+	if (!nr) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (n < 1)
+			n = 1;
+		if (n > MAX_WORKERS)
+			n = MAX_WORKERS;
+		nr = n;
+	}
+	return nr;
+}
+
+// every chunk but last is at least CHUNK_SIZE bytes
+static int max_chunks(void)
 {
-	ssize_t i = 0;
+	return nr_workers() * CHUNKS_PER_WORKER + 1;
+}
 
-	for (; i < len; i++) {
-		if (line[i] >= 0x80) {
-			long idx = i;
-			unsigned int u = u_get_nonascii(line, len, &idx);
-			const char *encoding;
+// offset after first newline ending at or after pos, or end of input
+static ssize_t line_boundary(struct file_decoder *dec, ssize_t pos)
+{
+	int n = dec->newline_size;
 
-			if (u_is_unicode(u)) {
-				encoding = "UTF-8";
-			} else if (streq(charset, "UTF-8")) {
-				// UTF-8 terminal, assuming latin1
-				encoding = "ISO-8859-1";
-			} else {
-				// assuming locale's encoding
-				encoding = charset;
-			}
-			if (set_encoding(dec, encoding)) {
-				// FIXME: error message?
-				set_encoding(dec, "UTF-8");
-			}
-			return true;
-		}
+	while (pos < dec->isize) {
+		const unsigned char *p = memchr(dec->ibuf + pos, '\n', dec->isize - pos);
+		ssize_t start;
+
+		if (p == NULL)
+			break;
+		// start of the code unit containing the byte
+		start = p - dec->ibuf;
+		start -= start % n;
+		if (start + n <= dec->isize && !memcmp(dec->ibuf + start, dec->newline, n))
+			return start + n;
+		pos = p - dec->ibuf + 1;
+	}
+	return dec->isize;
+}
+
+static void convert_chunk(const char *encoding, struct decoded_chunk *c)
+{
+	int errors;
+
+	if (c->cconv == NULL) {
+		c->cconv = cconv_to_utf8(encoding);
+		BUG_ON(c->cconv == NULL);
+	}
+	errors = cconv_nr_errors(c->cconv);
+	cconv_process(c->cconv, (const char *)c->in, c->in_size);
+	cconv_flush(c->cconv);
+	c->out = cconv_consume_all(c->cconv, &c->out_size);
+	c->out_pos = 0;
+	c->errors = cconv_nr_errors(c->cconv) - errors;
+}
+
+static void *convert_worker(void *data)
+{
+	struct chunk_queue *q = data;
+
+	while (1) {
+		struct decoded_chunk *c = NULL;
+
+		pthread_mutex_lock(&q->lock);
+		if (q->next < q->dec->nr_chunks)
+			c = &q->dec->chunks[q->next++];
+		pthread_mutex_unlock(&q->lock);
+
+		if (c == NULL)
+			return NULL;
+		convert_chunk(q->dec->encoding, c);
 	}
+}
+
+/*
+ * Split about max bytes of input to chunks after newlines and convert
+ * them in parallel. Converter state does not cross newlines in the
+ * encodings for which dec->newline_size is set, so every chunk can use a
+ * converter of its own. Worker threads exist only during the call and
+ * output of previous call must have been consumed.
+ */
+static void convert_chunks(struct file_decoder *dec, ssize_t max)
+{
+	ssize_t pos = dec->ipos;
+	ssize_t limit = (ssize_t)nr_workers() * CHUNKS_PER_WORKER * CHUNK_SIZE;
+	pthread_t threads[MAX_WORKERS];
+	struct chunk_queue q;
+	sigset_t set, old;
+	int i, nr_threads = 0;
+
+	if (max > limit)
+		max = limit;
+	if (max < CHUNK_SIZE)
+		max = CHUNK_SIZE;
+
+	if (dec->chunks == NULL)
+		dec->chunks = xnew0(struct decoded_chunk, max_chunks());
+	dec->nr_chunks = 0;
+	dec->chunk_idx = 0;
+	do {
+		struct decoded_chunk *c = &dec->chunks[dec->nr_chunks++];
+		ssize_t end = line_boundary(dec, pos + CHUNK_SIZE);
+
+		c->in = dec->ibuf + pos;
+		c->in_size = end - pos;
+		pos = end;
+	} while (pos < dec->ipos + max && pos < dec->isize);
+
+	pthread_mutex_init(&q.lock, NULL);
+	q.dec = dec;
+	q.next = 0;
+
+	// signals are handled by the main thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	for (i = 1; i < nr_workers() && i < dec->nr_chunks; i++) {
+		if (pthread_create(&threads[nr_threads], NULL, convert_worker, &q))
+			break;
+		nr_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	convert_worker(&q);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&q.lock);
+}
 
-	// ASCII
-	return false;
+static void consume_chunk(struct file_decoder *dec, struct decoded_chunk *c, size_t count)
+{
+	c->out_pos += count;
+	if (c->out_pos < c->out_size)
+		return;
+
+	dec->ipos += c->in_size;
+	dec->errors += c->errors;
+	dec->chunk_idx++;
+}
+
+// chunk with output left, NULL at end of input
+static struct decoded_chunk *decoded_chunk(struct file_decoder *dec, ssize_t max)
+{
+	while (1) {
+		if (dec->chunk_idx < dec->nr_chunks) {
+			struct decoded_chunk *c = &dec->chunks[dec->chunk_idx];
+
+			if (c->out_pos < c->out_size)
+				return c;
+			consume_chunk(dec, c, 0);
+			continue;
+		}
+		if (dec->ipos == dec->isize)
+			return NULL;
+		convert_chunks(dec, max);
+	}
 }
 
 static bool decode_and_read_line(struct file_decoder *dec, char **linep, ssize_t *lenp)
@@ -62,6 +222,21 @@ static bool decode_and_read_line(struct file_decoder *dec, char **linep, ssize_t
 	char *line;
 	ssize_t len;
 
+	if (dec->newline_size) {
+		struct decoded_chunk *c = decoded_chunk(dec, dec->isize - dec->ipos);
+		char *nl;
+
+		if (c == NULL)
+			return false;
+		line = c->out + c->out_pos;
+		nl = memchr(line, '\n', c->out_size - c->out_pos);
+		len = nl ? nl - line : c->out_size - c->out_pos;
+		consume_chunk(dec, c, nl ? len + 1 : len);
+		*linep = line;
+		*lenp = len;
+		return true;
+	}
+
 	while (1) {
 		line = cconv_consume_line(dec->cconv, &len);
 		if (line)
@@ -106,32 +281,38 @@ static bool read_utf8_line(struct file_decoder *dec, char **linep, ssize_t *lenp
 	return true;
 }
 
-static bool detect_and_read_line(struct file_decoder *dec, char **linep, ssize_t *lenp)
+/*
+ * Newline is a single code unit in these encodings and converter state
+ * does not depend on anything before it.
+ */
+static void set_newline_unit(struct file_decoder *dec, const char *encoding)
 {
-	char *line = (char *)dec->ibuf + dec->ipos;
-	const char *nl = memchr(line, '\n', dec->isize - dec->ipos);
-	ssize_t len;
+	static const char *const single_byte[] = {
+		"ISO-8859-", "WINDOWS-125", "CP125", "KOI8-",
+	};
+	int i;
 
-	if (nl) {
-		len = nl - line;
+	if (streq(encoding, "UTF-16LE")) {
+		memcpy(dec->newline, "\n\0", 2);
+		dec->newline_size = 2;
+	} else if (streq(encoding, "UTF-16BE")) {
+		memcpy(dec->newline, "\0\n", 2);
+		dec->newline_size = 2;
+	} else if (streq(encoding, "UTF-32LE")) {
+		memcpy(dec->newline, "\n\0\0\0", 4);
+		dec->newline_size = 4;
+	} else if (streq(encoding, "UTF-32BE")) {
+		memcpy(dec->newline, "\0\0\0\n", 4);
+		dec->newline_size = 4;
 	} else {
-		len = dec->isize - dec->ipos;
-		if (len == 0)
-			return false;
-	}
-
-	if (detect(dec, line, len)) {
-		// encoding detected
-		return dec->read_line(dec, linep, lenp);
+		for (i = 0; i < ARRAY_COUNT(single_byte); i++) {
+			if (str_has_prefix(encoding, single_byte[i])) {
+				dec->newline[0] = '\n';
+				dec->newline_size = 1;
+				break;
+			}
+		}
 	}
-
-	// only ASCII so far
-	dec->ipos += len;
-	if (nl)
-		dec->ipos++;
-	*linep = line;
-	*lenp = len;
-	return true;
 }
 
 static int set_encoding(struct file_decoder *dec, const char *encoding)
@@ -144,30 +325,101 @@ static int set_encoding(struct file_decoder *dec, const char *encoding)
 			return -1;
 		}
 		dec->read_line = decode_and_read_line;
+		set_newline_unit(dec, encoding);
 	}
 	dec->encoding = xstrdup(encoding);
 	return 0;
 }
 
+// encoding of input that is not valid UTF-8
+static const char *fallback_encoding(void)
+{
+	if (streq(charset, "UTF-8")) {
+		// UTF-8 terminal, assuming latin1
+		return "ISO-8859-1";
+	}
+	// assuming locale's encoding
+	return charset;
+}
+
+/*
+ * Input is read as UTF-8 until invalid UTF-8 is found. Pure ASCII leaves
+ * encoding undecided so that locale's charset is used.
+ */
+static void detect(struct file_decoder *dec)
+{
+	dec->read_line = read_utf8_line;
+	dec->checked = 0;
+	file_decoder_validate(dec, DETECT_SIZE);
+}
+
+/*
+ * Validate input up to the end of the line at end unless it has been done
+ * already. Returns false if invalid UTF-8 was found. Decoding then starts
+ * over from the beginning of the input with fallback encoding.
+ */
+bool file_decoder_validate(struct file_decoder *dec, ssize_t end)
+{
+	const unsigned char *nl;
+
+	if (end >= dec->isize) {
+		end = dec->isize;
+	} else {
+		nl = memchr(dec->ibuf + end, '\n', dec->isize - end);
+		end = nl ? nl + 1 - dec->ibuf : dec->isize;
+	}
+	if (end <= dec->checked)
+		return true;
+
+	switch (classify_utf8(dec->ibuf + dec->checked, end - dec->checked)) {
+	case UTF8_ASCII:
+		break;
+	case UTF8_VALID:
+		if (dec->encoding == NULL)
+			dec->encoding = xstrdup("UTF-8");
+		break;
+	default:
+		free(dec->encoding);
+		dec->encoding = NULL;
+		dec->ipos = 0;
+		dec->checked = dec->isize;
+		if (set_encoding(dec, fallback_encoding())) {
+			// FIXME: error message?
+			set_encoding(dec, "UTF-8");
+		}
+		return false;
+	}
+	dec->checked = end;
+	return true;
+}
+
 struct file_decoder *new_file_decoder(const char *encoding, const unsigned char *buf, ssize_t size)
 {
 	struct file_decoder *dec = xnew0(struct file_decoder, 1);
 
 	dec->ibuf = buf;
 	dec->isize = size;
-	dec->read_line = detect_and_read_line;
 
-	if (encoding) {
-		if (set_encoding(dec, encoding)) {
-			free_file_decoder(dec);
-			return NULL;
-		}
+	if (encoding == NULL) {
+		detect(dec);
+	} else if (set_encoding(dec, encoding)) {
+		free_file_decoder(dec);
+		return NULL;
+	} else {
+		dec->checked = size;
 	}
 	return dec;
 }
 
 void free_file_decoder(struct file_decoder *dec)
 {
+	int i;
+
+	for (i = 0; dec->chunks && i < max_chunks(); i++) {
+		if (dec->chunks[i].cconv != NULL)
+			cconv_free(dec->chunks[i].cconv);
+	}
+	free(dec->chunks);
 	if (dec->cconv != NULL)
 		cconv_free(dec->cconv);
 	free(dec->encoding);
@@ -178,3 +430,59 @@ bool file_decoder_read_line(struct file_decoder *dec, char **linep, ssize_t *len
 {
 	return dec->read_line(dec, linep, lenp);
 }
+
+/*
+ * Consume input that needs no conversion at once instead of line by line.
+ * Only whole lines of about max bytes are consumed if there is more input.
+ */
+bool file_decoder_read_utf8(struct file_decoder *dec, ssize_t max, const unsigned char **bufp, ssize_t *sizep)
+{
+	const unsigned char *buf = dec->ibuf + dec->ipos;
+	ssize_t size = dec->isize - dec->ipos;
+
+	if (dec->read_line != read_utf8_line)
+		return false;
+	if (size == 0)
+		return false;
+	if (size > max) {
+		ssize_t count = whole_lines(buf, size, max);
+
+		// incomplete last line
+		if (count)
+			size = count;
+	}
+
+	*bufp = buf;
+	*sizep = size;
+	dec->ipos += size;
+	return true;
+}
+
+/*
+ * Consume converted output of whole lines at once instead of line by line
+ * if the input can be converted in chunks. About max bytes of input are
+ * converted at once when there is no output left.
+ */
+bool file_decoder_read_decoded(struct file_decoder *dec, ssize_t max, char **bufp, ssize_t *sizep)
+{
+	struct decoded_chunk *c;
+
+	if (dec->read_line != decode_and_read_line || !dec->newline_size)
+		return false;
+	c = decoded_chunk(dec, max);
+	if (c == NULL)
+		return false;
+	*bufp = c->out + c->out_pos;
+	*sizep = c->out_size - c->out_pos;
+	consume_chunk(dec, c, *sizep);
+	return true;
+}
+
+int file_decoder_nr_errors(struct file_decoder *dec)
+{
+	int errors = dec->errors;
+
+	if (dec->cconv)
+		errors += cconv_nr_errors(dec->cconv);
+	return errors;
+}
@@ -3,17 +3,40 @@
 
 #include "libc.h"
 
+struct decoded_chunk;
+
 struct file_decoder {
 	char *encoding;
 	const unsigned char *ibuf;
 	ssize_t ipos, isize;
+
+	// input before this is known to be valid UTF-8 if the encoding is
+	// being detected, otherwise isize
+	ssize_t checked;
 	struct cconv *cconv;
 
+	// code unit of newline if the input can be split to chunks after
+	// any newline and converted separately, otherwise newline_size is 0
+	unsigned char newline[4];
+	int newline_size;
+
+	// chunks converted ahead of ipos, see file_decoder_read_decoded()
+	struct decoded_chunk *chunks;
+	int nr_chunks;
+	int chunk_idx;
+
+	// conversion errors in chunks that have been consumed
+	int errors;
+
 	bool (*read_line)(struct file_decoder *dec, char **linep, ssize_t *lenp);
 };
 
 struct file_decoder *new_file_decoder(const char *encoding, const unsigned char *buf, ssize_t size);
 void free_file_decoder(struct file_decoder *dec);
+bool file_decoder_validate(struct file_decoder *dec, ssize_t end);
 bool file_decoder_read_line(struct file_decoder *dec, char **line, ssize_t *len);
+bool file_decoder_read_utf8(struct file_decoder *dec, ssize_t max, const unsigned char **bufp, ssize_t *sizep);
+bool file_decoder_read_decoded(struct file_decoder *dec, ssize_t max, char **bufp, ssize_t *sizep);
+int file_decoder_nr_errors(struct file_decoder *dec);
 
 #endif
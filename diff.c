@@ -0,0 +1,195 @@
+#include "diff.h"
+#include "common.h"
+
+#include <inttypes.h>
+
+// files with more differences are replaced with one big hunk
+#define MAX_EDITS 1000
+
+static unsigned long hash_line(const char *buf, long len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	long i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, buf + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+		h = (h ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+// newline is part of the line, last line of buf may not have one
+void diff_lines_add(struct diff_lines *lines, const char *buf, long size)
+{
+	while (size > 0) {
+		const char *nl = memchr(buf, '\n', size);
+		long len = nl ? nl - buf + 1 : size;
+		struct diff_line *line;
+
+		if (lines->count == lines->alloc) {
+			lines->alloc = lines->alloc * 3 / 2 + 64;
+			xrenew(lines->ptr, lines->alloc);
+		}
+		line = &lines->ptr[lines->count++];
+		line->text = buf;
+		line->len = len;
+		line->hash = hash_line(buf, len);
+		buf += len;
+		size -= len;
+	}
+}
+
+void diff_lines_free(struct diff_lines *lines)
+{
+	free(lines->ptr);
+	lines->ptr = NULL;
+	lines->count = 0;
+	lines->alloc = 0;
+}
+
+static bool same_line(const struct diff_line *a, const struct diff_line *b)
+{
+	return a->hash == b->hash && a->len == b->len && !memcmp(a->text, b->text, a->len);
+}
+
+/*
+ * Returns number of edits in the shortest edit script or -1 if there
+ * are more than max. Furthest reaching x of diagonal k after d edits is
+ * saved to trace[d * d + d + k].
+ */
+static long shortest_edit(const struct diff_line *a, long n, const struct diff_line *b, long m, long max, long **tracep)
+{
+	long *v = xnew(long, 2 * max + 3) + max + 1;
+	long *trace = NULL;
+	long d, k;
+
+	for (d = 0; d <= max; d++) {
+		xrenew(trace, (d + 1) * (d + 1));
+		for (k = -d; k <= d; k += 2) {
+			long x, y;
+
+			if (d == 0)
+				x = 0;
+			else if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+				x = v[k + 1];
+			else
+				x = v[k - 1] + 1;
+			y = x - k;
+			while (x < n && y < m && same_line(&a[x], &b[y])) {
+				x++;
+				y++;
+			}
+			v[k] = x;
+			trace[d * d + d + k] = x;
+			if (x >= n && y >= m) {
+				free(v - max - 1);
+				*tracep = trace;
+				return d;
+			}
+		}
+	}
+	free(v - max - 1);
+	free(trace);
+	return -1;
+}
+
+/*
+ * Returns number of hunks needed to change lines of a to lines of b.
+ * Hunks are in order and there is at least one equal line between
+ * them.
+ */
+long diff(const struct diff_lines *da, const struct diff_lines *db, struct diff_hunk **hunksp)
+{
+	const struct diff_line *a = da->ptr;
+	const struct diff_line *b = db->ptr;
+	long n = da->count, m = db->count, start = 0;
+	long edits, nr = 0, x, y, d, i;
+	struct diff_hunk *hunks;
+	long *trace;
+
+	// common prefix and suffix are often most of the file
+	while (start < n && start < m && same_line(&a[start], &b[start]))
+		start++;
+	while (n > start && m > start && same_line(&a[n - 1], &b[m - 1])) {
+		n--;
+		m--;
+	}
+	if (n == start && m == start) {
+		*hunksp = NULL;
+		return 0;
+	}
+
+	a += start;
+	b += start;
+	n -= start;
+	m -= start;
+	if (n == 0 || m == 0)
+		edits = -1;
+	else
+		edits = shortest_edit(a, n, b, m, MAX_EDITS, &trace);
+	if (edits < 0) {
+		hunks = xnew(struct diff_hunk, 1);
+		hunks[0].old_start = start;
+		hunks[0].old_end = start + n;
+		hunks[0].new_start = start;
+		hunks[0].new_end = start + m;
+		*hunksp = hunks;
+		return 1;
+	}
+
+	// walk the edits backwards, joining adjacent ones to hunks
+	hunks = xnew(struct diff_hunk, edits);
+	x = n;
+	y = m;
+	for (d = edits; d > 0; d--) {
+		const long *prev = trace + (d - 1) * (d - 1) + d - 1;
+		long k = x - y, px, py, qx, qy;
+
+		if (k == -d || (k != d && prev[k - 1] < prev[k + 1])) {
+			// insert b[py]
+			px = prev[k + 1];
+			py = px - k - 1;
+			qx = px;
+			qy = py + 1;
+		} else {
+			// delete a[px]
+			px = prev[k - 1];
+			py = px - k + 1;
+			qx = px + 1;
+			qy = py;
+		}
+		if (nr && hunks[nr - 1].old_start == qx && hunks[nr - 1].new_start == qy) {
+			hunks[nr - 1].old_start = px;
+			hunks[nr - 1].new_start = py;
+		} else {
+			hunks[nr].old_start = px;
+			hunks[nr].old_end = qx;
+			hunks[nr].new_start = py;
+			hunks[nr].new_end = qy;
+			nr++;
+		}
+		x = px;
+		y = py;
+	}
+	free(trace);
+
+	for (i = 0; i < nr / 2; i++) {
+		struct diff_hunk tmp = hunks[i];
+
+		hunks[i] = hunks[nr - 1 - i];
+		hunks[nr - 1 - i] = tmp;
+	}
+	for (i = 0; i < nr; i++) {
+		hunks[i].old_start += start;
+		hunks[i].old_end += start;
+		hunks[i].new_start += start;
+		hunks[i].new_end += start;
+	}
+	*hunksp = hunks;
+	return nr;
+}
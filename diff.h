@@ -0,0 +1,33 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+/*
+ * Line diff using Myers' O(ND) algorithm. Lines point to text owned by
+ * the caller, for example to blocks of a buffer.
+ */
+
+struct diff_line {
+	const char *text;
+	long len;
+	unsigned long hash;
+};
+
+struct diff_lines {
+	struct diff_line *ptr;
+	long count;
+	long alloc;
+};
+
+// old lines old_start..old_end-1 are replaced by new_start..new_end-1
+struct diff_hunk {
+	long old_start;
+	long old_end;
+	long new_start;
+	long new_end;
+};
+
+void diff_lines_add(struct diff_lines *lines, const char *buf, long size);
+void diff_lines_free(struct diff_lines *lines);
+long diff(const struct diff_lines *a, const struct diff_lines *b, struct diff_hunk **hunksp);
+
+#endif
@@ -11,6 +11,13 @@
 #include "command.h"
 #include "modes.h"
 #include "error.h"
+#include "load-save.h"
+#include "block.h"
+#include "change.h"
+#include "journal.h"
+#include "watch.h"
+#include "event.h"
+#include "hl.h"
 
 enum editor_status editor_status;
 enum input_mode input_mode;
@@ -25,10 +32,13 @@ static void sanity_check(void)
 {
 	struct view *v = window->view;
 	struct block *blk;
+	long changes, bytes;
 
 	if (!DEBUG)
 		return;
 
+	if (DEBUG > 2)
+		BUG_ON(!get_undo_stats(v->buffer, &changes, &bytes));
 	list_for_each_entry(blk, &v->buffer->blocks, node) {
 		if (blk == v->cursor.blk) {
 			BUG_ON(v->cursor.offset > v->cursor.blk->size);
@@ -170,7 +180,9 @@ static void update_window(struct window *w)
 	if (y2 > v->vy + w->edit_h - 1)
 		y2 = v->vy + w->edit_h - 1;
 
-	update_range(v, y1, y2 + 1);
+	// lines added below the view while loading are not visible
+	if (y1 <= y2)
+		update_range(v, y1, y2 + 1);
 	update_status_line(w);
 }
 
@@ -399,6 +411,134 @@ void set_signal_handler(int signum, void (*handler)(int))
 	sigaction(signum, &act, NULL);
 }
 
+static struct buffer *find_loading_buffer(void)
+{
+	int i;
+
+	// current buffer first
+	if (buffer->loader)
+		return buffer;
+	for (i = 0; i < buffers.count; i++) {
+		struct buffer *b = buffers.ptrs[i];
+		if (b->loader)
+			return b;
+	}
+	return NULL;
+}
+
+// returns false if there was nothing to do
+static bool load_in_background(void)
+{
+	struct buffer *b = find_loading_buffer();
+	struct view *v = window->view;
+	long nl;
+
+	if (b == NULL || term_input_pending())
+		return false;
+
+	nl = b->nl;
+	continue_loading(b);
+	if (b != v->buffer) {
+		// buffer might be visible in other window
+		if (!b->loader)
+			modes[input_mode]->update();
+		return true;
+	}
+	if (input_mode == INPUT_GIT_OPEN)
+		return true;
+
+	// update new lines and progress in status line
+	view_update_cursor_x(v);
+	view_update_cursor_y(v);
+	view_update(v);
+	buffer_mark_lines_changed(b, nl, INT_MAX);
+
+	start_update();
+	update_buffer_windows(b);
+	end_update();
+	return true;
+}
+
+// merge small blocks left by editing
+static void compact_in_background(void)
+{
+	int i;
+
+	for (i = 0; i < buffers.count; i++) {
+		struct buffer *b = buffers.ptrs[i];
+
+		if (b->split_blocks >= 1024 && !term_input_pending())
+			compact_blocks(b);
+	}
+}
+
+static void sync_timer(void *data)
+{
+	sync_journals();
+}
+
+// sync undo journals when they are due
+static void sync_in_background(void)
+{
+	long delay = journal_sync_delay();
+
+	if (delay == 0)
+		sync_journals();
+	else if (delay > 0)
+		add_timer(delay, sync_timer, NULL);
+}
+
+// report background saves that have finished
+static void report_background_saves(void)
+{
+	if (finish_background_saves(NULL, false)) {
+		mark_everything_changed();
+		modes[input_mode]->update();
+	}
+}
+
+// reload files changed by other programs
+static void reload_in_background(void)
+{
+	update_watches();
+	if (reload_changed_files()) {
+		mark_everything_changed();
+		modes[input_mode]->update();
+	}
+}
+
+/*
+ * Highlight start states of lines in visible buffers in short slices.
+ * Lines drawn with guessed colors are redrawn when the states of the
+ * visible lines are known. Returns false if there was nothing to do.
+ */
+static bool highlight_in_background(void)
+{
+	bool did_work = false;
+	int i;
+
+	for (i = 0; i < windows.count; i++) {
+		struct window *w = windows.ptrs[i];
+		struct view *v = w->view;
+		struct buffer *b = v->buffer;
+		int bottom = v->vy + w->edit_h;
+
+		if (!b->hl_pending || b->loader || term_input_pending())
+			continue;
+		did_work = true;
+		if (b->hl_provisional) {
+			if (!hl_fill_start_states(b, bottom < b->nl ? bottom : b->nl, 10))
+				continue;
+			b->hl_provisional = false;
+			mark_all_lines_changed(b);
+			modes[input_mode]->update();
+		} else if (hl_fill_start_states(b, b->nl, 10)) {
+			b->hl_pending = false;
+		}
+	}
+	return did_work;
+}
+
 void main_loop(void)
 {
 	while (editor_status == EDITOR_RUNNING) {
@@ -407,6 +547,16 @@ void main_loop(void)
 
 		if (resized)
 			resize();
+		if (load_in_background())
+			continue;
+		compact_in_background();
+		sync_in_background();
+		report_background_saves();
+		reload_in_background();
+		if (highlight_in_background())
+			continue;
+		if (!term_input_pending() && !run_events(-1))
+			continue;
 		if (!term_read_key(&key, &type))
 			continue;
 
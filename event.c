@@ -0,0 +1,241 @@
+#include "event.h"
+#include "common.h"
+#include "fork.h"
+
+struct fd_handler {
+	int fd;
+	short events;
+	void (*fn)(int fd, short revents, void *data);
+	void *data;
+};
+
+struct timer {
+	long expires;
+	// timers added while timers are being run wait for the next round
+	unsigned long id;
+	void (*fn)(void *data);
+	void *data;
+};
+
+static struct fd_handler *handlers;
+static long nr_handlers;
+
+static struct timer *timers;
+static long nr_timers;
+static unsigned long timer_id;
+
+// signal handlers write to this to wake up poll()
+static int wake_pipe[2] = { -1, -1 };
+
+// terminal, wake_pipe and handlers, rebuilt when handlers change
+static struct pollfd *fds;
+static long nr_fds;
+static bool fds_changed = true;
+// revents of fds are overwritten if a handler polls again
+static unsigned long poll_count;
+
+static struct fd_handler *find_fd_handler(int fd)
+{
+	long i;
+
+	for (i = 0; i < nr_handlers; i++) {
+		if (handlers[i].fd == fd)
+			return &handlers[i];
+	}
+	return NULL;
+}
+
+// replaces old handler of fd
+void add_fd_handler(int fd, short events, void (*fn)(int fd, short revents, void *data), void *data)
+{
+	struct fd_handler *h = find_fd_handler(fd);
+
+	if (h == NULL) {
+		xrenew(handlers, nr_handlers + 1);
+		h = &handlers[nr_handlers++];
+	}
+	h->fd = fd;
+	h->events = events;
+	h->fn = fn;
+	h->data = data;
+	fds_changed = true;
+}
+
+void remove_fd_handler(int fd)
+{
+	struct fd_handler *h = find_fd_handler(fd);
+
+	if (h) {
+		*h = handlers[--nr_handlers];
+		fds_changed = true;
+	}
+}
+
+// run fn once after ms milliseconds, replaces old timer with same fn and data
+void add_timer(long ms, void (*fn)(void *data), void *data)
+{
+	struct timer *t;
+
+	remove_timer(fn, data);
+	xrenew(timers, nr_timers + 1);
+	t = &timers[nr_timers++];
+	t->expires = now_ms() + ms;
+	t->id = ++timer_id;
+	t->fn = fn;
+	t->data = data;
+}
+
+void remove_timer(void (*fn)(void *data), void *data)
+{
+	long i;
+
+	for (i = 0; i < nr_timers; i++) {
+		if (timers[i].fn == fn && timers[i].data == data) {
+			timers[i] = timers[--nr_timers];
+			return;
+		}
+	}
+}
+
+static void run_timers(void)
+{
+	unsigned long last = timer_id;
+	long now = now_ms();
+
+	while (1) {
+		struct timer t;
+		long i;
+
+		for (i = 0; i < nr_timers; i++) {
+			if (timers[i].expires <= now && timers[i].id <= last)
+				break;
+		}
+		if (i == nr_timers)
+			break;
+		t = timers[i];
+		timers[i] = timers[--nr_timers];
+		t.fn(t.data);
+	}
+}
+
+static int poll_timeout(long ms)
+{
+	long now = now_ms(), i;
+
+	for (i = 0; i < nr_timers; i++) {
+		long d = timers[i].expires - now;
+
+		if (d < 0)
+			d = 0;
+		if (ms < 0 || d < ms)
+			ms = d;
+	}
+	return ms > INT_MAX ? INT_MAX : ms;
+}
+
+void init_events(void)
+{
+	if (pipe_close_on_exec(wake_pipe))
+		return;
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+	fds_changed = true;
+}
+
+// safe to call from a signal handler
+void wake_up_events(void)
+{
+	int saved_errno = errno;
+
+	if (wake_pipe[1] >= 0) {
+		// fails only if the pipe is full
+		ssize_t rc = write(wake_pipe[1], "", 1);
+		(void)rc;
+	}
+	errno = saved_errno;
+}
+
+// poll() one file descriptor
+int poll_fd(int fd, short events, long ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	return poll(&pfd, 1, ms);
+}
+
+static void add_pollfd(int fd, short events)
+{
+	fds[nr_fds].fd = fd;
+	fds[nr_fds].events = events;
+	fds[nr_fds++].revents = 0;
+}
+
+static void update_fds(void)
+{
+	long i;
+
+	if (!fds_changed)
+		return;
+	xrenew(fds, nr_handlers + 2);
+	nr_fds = 0;
+	// terminal is always first and skipped if it isn't polled
+	add_pollfd(0, POLLIN);
+	if (wake_pipe[0] >= 0)
+		add_pollfd(wake_pipe[0], POLLIN);
+	for (i = 0; i < nr_handlers; i++)
+		add_pollfd(handlers[i].fd, handlers[i].events);
+	fds_changed = false;
+}
+
+// returns true if terminal has input
+static bool poll_events(bool term, long ms)
+{
+	unsigned long count = ++poll_count;
+	bool input = false;
+	long i = term ? 0 : 1;
+
+	update_fds();
+	if (poll(fds + i, nr_fds - i, poll_timeout(ms)) > 0) {
+		// stop if a handler polled again, the rest is seen next time
+		for (; i < nr_fds && count == poll_count; i++) {
+			struct fd_handler *h;
+
+			if (!fds[i].revents)
+				continue;
+			if (i == 0) {
+				input = true;
+			} else if (fds[i].fd == wake_pipe[0]) {
+				char buf[64];
+
+				while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+					;
+			} else {
+				// earlier handler might have removed this one
+				h = find_fd_handler(fds[i].fd);
+				if (h)
+					h->fn(h->fd, fds[i].revents, h->data);
+			}
+		}
+	}
+	run_timers();
+	return input;
+}
+
+/*
+ * Wait at most ms milliseconds (forever if negative) for terminal input,
+ * running handlers and timers meanwhile. Returns true if there is
+ * input, false if something else happened or a signal was caught.
+ */
+bool run_events(long ms)
+{
+	return poll_events(true, ms);
+}
+
+// wait for and run handlers and timers, terminal input is left alone
+void run_other_events(void)
+{
+	poll_events(false, -1);
+}
@@ -0,0 +1,26 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "libc.h"
+
+#include <poll.h>
+
+/*
+ * The main loop waits for terminal input in run_events(). While it
+ * waits, handlers of other file descriptors and timers that are due are
+ * run. Handlers run one at a time in the main thread so they can use
+ * editor state freely, but they must not block.
+ */
+
+void add_fd_handler(int fd, short events, void (*fn)(int fd, short revents, void *data), void *data);
+void remove_fd_handler(int fd);
+void add_timer(long ms, void (*fn)(void *data), void *data);
+void remove_timer(void (*fn)(void *data), void *data);
+
+void init_events(void);
+void wake_up_events(void);
+int poll_fd(int fd, short events, long ms);
+bool run_events(long ms);
+void run_other_events(void);
+
+#endif
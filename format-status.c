@@ -2,6 +2,7 @@
 #include "window.h"
 #include "view.h"
 #include "uchar.h"
+#include "load-save.h"
 
 static void add_ch(struct formatter *f, char ch)
 {
@@ -39,6 +40,14 @@ static void add_status_format(struct formatter *f, const char *format, ...)
 	add_status_str(f, buf);
 }
 
+static void add_status_size(struct formatter *f, long size)
+{
+	if (size < 10 * 1024 * 1024)
+		add_status_format(f, "%ldK", (size + 1023) / 1024);
+	else
+		add_status_format(f, "%ldM", (size + 1024 * 1024 - 1) / (1024 * 1024));
+}
+
 static void add_status_pos(struct formatter *f)
 {
 	long lines = f->win->view->buffer->nl;
@@ -97,6 +106,13 @@ void sf_format(struct formatter *f, char *buf, long size, const char *format)
 				if (v->buffer->ro)
 					add_status_str(f, "RO");
 				break;
+			case 'L':
+				if (v->buffer->loader)
+					add_status_format(f, "Loading %d%%", loading_progress(v->buffer));
+				break;
+			case 'B':
+				add_status_size(f, buffer_memory(v->buffer));
+				break;
 			case 'y':
 				add_status_format(f, "%d", v->cy + 1);
 				break;
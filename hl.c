@@ -4,28 +4,15 @@
 
 #include <inttypes.h>
 
-static bool state_is_valid(const struct state *st)
+static struct state *valid_state(const struct state *st)
 {
-	return ((uintptr_t)st & 1) == 0;
+	return (struct state *)((uintptr_t)st & ~(uintptr_t)1);
 }
 
-static void mark_state_invalid(void **ptrs, int idx)
+static void mark_state_invalid(struct line_states *s, int idx)
 {
-	struct state *st = ptrs[idx];
-	ptrs[idx] = (struct state *)((uintptr_t)st | 1);
-}
-
-static bool states_equal(void **ptrs, int idx, const struct state *b)
-{
-	struct state *a = (struct state *)((uintptr_t)ptrs[idx] & ~(uintptr_t)1);
-	return a == b;
-}
-
-static int bitmap_get(const unsigned char *bitmap, unsigned int idx)
-{
-	unsigned int byte = idx / 8;
-	unsigned int bit = idx & 7;
-	return bitmap[byte] & 1 << bit;
+	struct state *st = line_states_get(s, idx);
+	line_states_set(s, idx, (struct state *)((uintptr_t)st | 1));
 }
 
 static bool is_buffered(const struct condition *cond, const char *str, int len)
@@ -38,27 +25,6 @@ static bool is_buffered(const struct condition *cond, const char *str, int len)
 	return !memcmp(cond->u.cond_bufis.str, str, len);
 }
 
-static bool in_hash(struct string_list *list, const char *str, int len)
-{
-	unsigned int hash = buf_hash(str, len);
-	struct hash_str *h = list->hash[hash % ARRAY_COUNT(list->hash)];
-
-	if (list->icase) {
-		while (h) {
-			if (len == h->len && !strncasecmp(str, h->str, len))
-				return true;
-			h = h->next;
-		}
-	} else {
-		while (h) {
-			if (len == h->len && !memcmp(str, h->str, len))
-				return true;
-			h = h->next;
-		}
-	}
-	return false;
-}
-
 static struct state *handle_heredoc(struct syntax *syn, struct state *state, const char *delim, int len)
 {
 	struct heredoc_state *s;
@@ -84,61 +50,101 @@ static struct state *handle_heredoc(struct syntax *syn, struct state *state, con
 	return s->state;
 }
 
-// line should be terminated with \n unless it's the last line
-static struct hl_color **highlight_line(struct syntax *syn, struct state *state, const char *line, int len, struct state **ret)
+// shared by all buffers
+static struct hl_span *line_spans;
+static int nr_line_spans;
+static int line_spans_alloc;
+
+static void new_span(struct hl_color *color, int len)
 {
-	static struct hl_color **colors;
-	static int alloc;
-	int i = 0, sidx = -1;
+	struct hl_span *s;
+	int start = 0;
 
-	if (len > alloc) {
-		alloc = ROUND_UP(len, 128);
-		xrenew(colors, alloc);
+	if (nr_line_spans) {
+		s = &line_spans[nr_line_spans - 1];
+		start = s->start + s->len;
 	}
+	if (nr_line_spans == line_spans_alloc) {
+		line_spans_alloc = line_spans_alloc * 3 / 2 + 64;
+		xrenew(line_spans, line_spans_alloc);
+	}
+	s = &line_spans[nr_line_spans++];
+	s->start = start;
+	s->len = len;
+	s->color = color;
+}
+
+// color next len bytes
+static inline void add_span(struct hl_color *color, int len)
+{
+	if (nr_line_spans && line_spans[nr_line_spans - 1].color == color)
+		line_spans[nr_line_spans - 1].len += len;
+	else
+		new_span(color, len);
+}
+
+// color again bytes from start to end of the spans
+static void recolor(struct hl_color *color, int start, int end)
+{
+	if (start >= end)
+		return;
+	while (nr_line_spans && line_spans[nr_line_spans - 1].start >= start)
+		nr_line_spans--;
+	if (nr_line_spans) {
+		struct hl_span *s = &line_spans[nr_line_spans - 1];
+		s->len = start - s->start;
+	}
+	add_span(color, end - start);
+}
+
+/*
+ * Line should be terminated with \n unless it's the last line. Spans
+ * cover the whole line and consecutive spans have different colors.
+ */
+static struct hl_span *highlight_line(struct syntax *syn, struct state *state, const char *line, int len, struct state **ret, int *nr_spans)
+{
+	int i = 0, sidx = -1;
+
+	nr_line_spans = 0;
 
 	while (1) {
+		struct condition **conds;
 		const struct condition *cond;
 		const struct action *a;
 		unsigned char ch;
-		int ci;
 	top:
 		if (i == len)
 			break;
 		ch = line[i];
-		for (ci = 0; ci < state->conds.count; ci++) {
-			cond = state->conds.ptrs[ci];
+		// only conditions that can match ch, see compile_state()
+		for (conds = state->cond_lists[state->dispatch[ch]]; *conds; conds++) {
+			cond = *conds;
 			a = &cond->a;
 			switch (cond->type) {
 			case COND_CHAR_BUFFER:
-				if (!bitmap_get(cond->u.cond_char.bitmap, ch))
-					break;
 				if (sidx < 0)
 					sidx = i;
-				colors[i++] = a->emit_color;
+				add_span(a->emit_color, 1);
+				i++;
 				state = a->destination;
 				goto top;
 			case COND_BUFIS:
 				if (sidx >= 0 && is_buffered(cond, line + sidx, i - sidx)) {
-					int idx;
-					for (idx = sidx; idx < i; idx++)
-						colors[idx] = a->emit_color;
+					recolor(a->emit_color, sidx, i);
 					sidx = -1;
 					state = a->destination;
 					goto top;
 				}
 				break;
 			case COND_CHAR:
-				if (!bitmap_get(cond->u.cond_char.bitmap, ch))
-					break;
-				colors[i++] = a->emit_color;
+				add_span(a->emit_color, 1);
+				i++;
 				sidx = -1;
 				state = a->destination;
 				goto top;
 			case COND_INLIST:
-				if (sidx >= 0 && in_hash(cond->u.cond_inlist.list, line + sidx, i - sidx)) {
-					int idx;
-					for (idx = sidx; idx < i; idx++)
-						colors[idx] = a->emit_color;
+				if (sidx >= 0 && in_string_list(cond->u.cond_inlist.list, line + sidx, i - sidx)) {
+					recolor(a->emit_color, sidx, i);
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -148,13 +154,11 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				int idx = i - cond->u.cond_recolor.len;
 				if (idx < 0)
 					idx = 0;
-				while (idx < i)
-					colors[idx++] = a->emit_color;
+				recolor(a->emit_color, idx, i);
 				} break;
 			case COND_RECOLOR_BUFFER:
 				if (sidx >= 0) {
-					while (sidx < i)
-						colors[sidx++] = a->emit_color;
+					recolor(a->emit_color, sidx, i);
 					sidx = -1;
 				}
 				break;
@@ -162,8 +166,8 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				int slen = cond->u.cond_str.len;
 				int end = i + slen;
 				if (len >= end && !memcmp(cond->u.cond_str.str, line + i, slen)) {
-					while (i < end)
-						colors[i++] = a->emit_color;
+					add_span(a->emit_color, slen);
+					i = end;
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -173,8 +177,8 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				int slen = cond->u.cond_str.len;
 				int end = i + slen;
 				if (len >= end && !strncasecmp(cond->u.cond_str.str, line + i, slen)) {
-					while (i < end)
-						colors[i++] = a->emit_color;
+					add_span(a->emit_color, slen);
+					i = end;
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -182,10 +186,10 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				} break;
 			case COND_STR2:
 				// optimized COND_STR (length 2, case sensitive)
-				if (ch == cond->u.cond_str.str[0] && len - i > 1 &&
+				if (len - i > 1 &&
 						line[i + 1] == cond->u.cond_str.str[1]) {
-					colors[i++] = a->emit_color;
-					colors[i++] = a->emit_color;
+					add_span(a->emit_color, 2);
+					i += 2;
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -195,8 +199,8 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				int slen = cond->u.cond_heredocend.len;
 				int end = i + slen;
 				if (len >= end && !memcmp(cond->u.cond_heredocend.str, line + i, slen)) {
-					while (i < end)
-						colors[i++] = a->emit_color;
+					add_span(a->emit_color, slen);
+					i = end;
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -207,7 +211,8 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 
 		switch (state->type) {
 		case STATE_EAT:
-			colors[i++] = state->a.emit_color;
+			add_span(state->a.emit_color, 1);
+			i++;
 			// fallthrough
 		case STATE_NOEAT:
 			sidx = -1;
@@ -226,193 +231,220 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 
 	if (ret)
 		*ret = state;
-	return colors;
+	if (nr_spans)
+		*nr_spans = nr_line_spans;
+	return line_spans;
 }
 
-static void resize_line_states(struct ptr_array *s, unsigned int count)
+long hl_scratch_size(void)
 {
-	if (s->alloc < count) {
-		s->alloc = ROUND_UP(count, 64);
-		xrenew(s->ptrs, s->alloc);
-	}
+	return line_spans_alloc * sizeof(*line_spans);
 }
 
-static void move_line_states(struct ptr_array *s, int to, int from, int count)
+// checking time after every line would be too expensive
+static bool time_is_up(int lines, long end)
 {
-	memmove(s->ptrs + to, s->ptrs + from, count * sizeof(*s->ptrs));
+	return lines % 16 == 0 && now_ms() >= end;
 }
 
-static void block_iter_move_down(struct block_iter *bi, int count)
+static int fill_hole(struct buffer *b, struct block_iter *bi, int sidx, int eidx, long end)
 {
-	while (count--)
-		block_iter_eat_line(bi);
-}
-
-static int fill_hole(struct buffer *b, struct block_iter *bi, int sidx, int eidx)
-{
-	void **ptrs = b->line_start_states.ptrs;
+	struct line_states *s = &b->line_start_states;
+	int count = line_states_count(s);
+	struct state *st = line_states_get(s, sidx);
 	int idx = sidx;
 
 	while (idx < eidx) {
 		struct lineref lr;
-		struct state *st;
+		struct state *old;
 
 		fill_line_nl_ref(bi, &lr);
 		block_iter_eat_line(bi);
-		highlight_line(b->syn, ptrs[idx++], lr.line, lr.size, &st);
+		highlight_line(b->syn, st, lr.line, lr.size, &st, NULL);
+		old = line_states_get(s, ++idx);
 
-		if (ptrs[idx] == st) {
+		if (old == st) {
 			// was not invalidated and didn't change
 			break;
 		}
 
-		if (states_equal(ptrs, idx, st)) {
-			// was invalidated and didn't change
-			ptrs[idx] = st;
-		} else {
-			// invalidated or not but changed anyway
-			ptrs[idx] = st;
-			if (idx == eidx)
-				mark_state_invalid(ptrs, idx + 1);
+		// invalidated or changed
+		line_states_set(s, idx, st);
+		if (valid_state(old) != st && idx == eidx && idx + 1 < count)
+			mark_state_invalid(s, idx + 1);
+		if (idx < eidx && time_is_up(idx - sidx, end)) {
+			// next state might be wrong because this one changed
+			mark_state_invalid(s, idx + 1);
+			break;
 		}
 	}
 	return idx - sidx;
 }
 
-void hl_fill_start_states(struct buffer *b, int line_nr)
+/*
+ * Make start states of lines up to line_nr valid. Gives up after ms
+ * milliseconds unless ms is negative. Returns true if finished.
+ */
+bool hl_fill_start_states(struct buffer *b, int line_nr, long ms)
 {
 	BLOCK_ITER(bi, &b->blocks);
-	struct ptr_array *s = &b->line_start_states;
-	struct state **states;
+	struct line_states *s = &b->line_start_states;
+	struct state *st;
 	int current_line = 0;
+	long end = ms < 0 ? LONG_MAX : now_ms() + ms;
 	int idx = 0;
-	int last;
+	int last, count;
 
 	if (b->syn == NULL)
-		return;
-
-	// NOTE: "+ 2" so that you don't have to worry about overflow in fill_hole()
-	resize_line_states(s, line_nr + 2);
-	states = (struct state **)s->ptrs;
+		return true;
 
 	// update invalid
+	count = line_states_count(s);
 	last = line_nr;
-	if (last >= s->count)
-		last = s->count - 1;
+	if (last >= count)
+		last = count - 1;
 	while (1) {
-		int count;
+		int filled;
 
-		while (idx <= last && state_is_valid(states[idx]))
-			idx++;
+		idx = line_states_find_invalid(s, idx);
 		if (idx > last)
 			break;
 
 		// go to line before first hole
 		idx--;
-		block_iter_move_down(&bi, idx - current_line);
+		block_iter_goto_line(&bi, idx);
 		current_line = idx;
 
 		// NOTE: might not fill entire hole which is ok
-		count = fill_hole(b, &bi, idx, last);
-		idx += count;
-		current_line += count;
+		filled = fill_hole(b, &bi, idx, last, end);
+		idx += filled;
+		current_line += filled;
+		if (now_ms() >= end && (line_states_find_invalid(s, idx) <= last || count - 1 < line_nr))
+			return false;
 	}
 
 	// add new
-	block_iter_move_down(&bi, s->count - 1 - current_line);
-	while (s->count - 1 < line_nr) {
+	if (current_line != count - 1)
+		block_iter_goto_line(&bi, count - 1);
+	st = line_states_get(s, count - 1);
+	while (count - 1 < line_nr) {
 		struct lineref lr;
 
 		fill_line_nl_ref(&bi, &lr);
-		highlight_line(b->syn, states[s->count - 1], lr.line, lr.size, &states[s->count]);
-		s->count++;
+		highlight_line(b->syn, st, lr.line, lr.size, &st, NULL);
+		line_states_set(s, count++, st);
 		block_iter_eat_line(&bi);
+		if (count - 1 < line_nr && time_is_up(count, end))
+			return false;
 	}
+	return true;
+}
+
+// start state of line_nr if it is known, otherwise a guess
+struct state *hl_guess_start_state(struct buffer *b, int line_nr)
+{
+	struct line_states *s = &b->line_start_states;
+
+	if (line_nr < line_states_count(s))
+		return valid_state(line_states_get(s, line_nr));
+	return b->syn->states.ptrs[0];
 }
 
-struct hl_color **hl_line(struct buffer *b, const char *line, int len, int line_nr, int *next_changed)
+// like hl_line() but start states of lines are not saved
+struct hl_span *hl_guess_line(struct buffer *b, const char *line, int len, struct state **state, int *nr_spans)
 {
-	struct ptr_array *s = &b->line_start_states;
-	struct hl_color **colors;
-	struct state *next;
+	*nr_spans = 0;
+	if (b->syn == NULL)
+		return NULL;
+	return highlight_line(b->syn, *state, line, len, state, nr_spans);
+}
 
+struct hl_span *hl_line(struct buffer *b, const char *line, int len, int line_nr, int *nr_spans, int *next_changed)
+{
+	struct line_states *s = &b->line_start_states;
+	struct hl_span *spans;
+	struct state *next, *old;
+	int count;
+
+	*nr_spans = 0;
 	*next_changed = 0;
 	if (b->syn == NULL)
 		return NULL;
 
-	BUG_ON(line_nr >= s->count);
-	colors = highlight_line(b->syn, s->ptrs[line_nr++], line, len, &next);
+	count = line_states_count(s);
+	BUG_ON(line_nr >= count);
+	spans = highlight_line(b->syn, line_states_get(s, line_nr++), line, len, &next, nr_spans);
 
-	if (line_nr == s->count) {
-		resize_line_states(s, s->count + 1);
-		s->ptrs[s->count++] = next;
+	if (line_nr == count) {
+		line_states_set(s, line_nr, next);
 		*next_changed = 1;
-	} else if (s->ptrs[line_nr] == next) {
+		return spans;
+	}
+	old = line_states_get(s, line_nr);
+	if (old == next) {
 		// was not invalidated and didn't change
-	} else if (states_equal(s->ptrs, line_nr, next)) {
+	} else if (valid_state(old) == next) {
 		// was invalidated and didn't change
-		s->ptrs[line_nr] = next;
+		line_states_set(s, line_nr, next);
 		//*next_changed = 1;
 	} else {
 		// invalidated or not but changed anyway
-		s->ptrs[line_nr] = next;
+		line_states_set(s, line_nr, next);
 		*next_changed = 1;
-		if (line_nr + 1 < s->count)
-			mark_state_invalid(s->ptrs, line_nr + 1);
+		if (line_nr + 1 < count)
+			mark_state_invalid(s, line_nr + 1);
 	}
-	return colors;
+	return spans;
 }
 
 // called after text have been inserted to rehighlight changed lines
 void hl_insert(struct buffer *b, int first, int lines)
 {
-	struct ptr_array *s = &b->line_start_states;
-	int i, last = first + lines;
+	struct line_states *s = &b->line_start_states;
+	int count = line_states_count(s);
+	int last = first + lines;
 
-	if (first >= s->count) {
+	b->hl_pending = true;
+	if (first >= count) {
 		// nothing to rehighlight
 		return;
 	}
 
-	if (last + 1 >= s->count) {
+	if (last + 1 >= count) {
 		// last already highlighted lines changed
 		// there's nothing to gain, throw them away
-		s->count = first + 1;
+		line_states_truncate(s, first + 1);
 		return;
 	}
 
-	// add room for new line states
+	// invalidate start states of new and changed lines
 	if (lines) {
-		int to = last + 1;
-		int from = first + 1;
-		resize_line_states(s, s->count + lines);
-		move_line_states(s, to, from, s->count - from);
-		s->count += lines;
+		struct state *st = line_states_get(s, first + 1);
+		line_states_insert(s, first + 1, lines, (struct state *)((uintptr_t)st | 1));
 	}
-
-	// invalidate start states of new and changed lines
-	for (i = first + 1; i <= last + 1; i++)
-		mark_state_invalid(s->ptrs, i);
+	mark_state_invalid(s, last + 1);
 }
 
 // called after text have been deleted to rehighlight changed lines
 void hl_delete(struct buffer *b, int first, int deleted_nl)
 {
-	struct ptr_array *s = &b->line_start_states;
+	struct line_states *s = &b->line_start_states;
+	int count = line_states_count(s);
 	int last = first + deleted_nl;
 
-	if (s->count == 1)
+	b->hl_pending = true;
+	if (count == 1)
 		return;
 
-	if (first >= s->count) {
+	if (first >= count) {
 		// nothing to highlight
 		return;
 	}
 
-	if (last + 1 >= s->count) {
+	if (last + 1 >= count) {
 		// last already highlighted lines changed
 		// there's nothing to gain, throw them away
-		s->count = first + 1;
+		line_states_truncate(s, first + 1);
 		return;
 	}
 
@@ -420,13 +452,9 @@ void hl_delete(struct buffer *b, int first, int deleted_nl)
 	// try to save the work.
 
 	// remove deleted lines (states)
-	if (deleted_nl) {
-		int to = first + 1;
-		int from = last + 1;
-		move_line_states(s, to, from, s->count - from);
-		s->count -= deleted_nl;
-	}
+	if (deleted_nl)
+		line_states_delete(s, first + 1, deleted_nl);
 
 	// invalidate line start state after the changed line
-	mark_state_invalid(s->ptrs, first + 1);
+	mark_state_invalid(s, first + 1);
 }
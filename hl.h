@@ -3,9 +3,19 @@
 
 #include "buffer.h"
 
-struct hl_color **hl_line(struct buffer *b, const char *line, int len, int line_nr, int *next_changed);
-void hl_fill_start_states(struct buffer *b, int line_nr);
+// consecutive bytes of a line that have the same color
+struct hl_span {
+	int start;
+	int len;
+	struct hl_color *color;
+};
+
+struct hl_span *hl_line(struct buffer *b, const char *line, int len, int line_nr, int *nr_spans, int *next_changed);
+bool hl_fill_start_states(struct buffer *b, int line_nr, long ms);
+struct state *hl_guess_start_state(struct buffer *b, int line_nr);
+struct hl_span *hl_guess_line(struct buffer *b, const char *line, int len, struct state **state, int *nr_spans);
 void hl_insert(struct buffer *b, int first, int lines);
 void hl_delete(struct buffer *b, int first, int lines);
+long hl_scratch_size(void);
 
 #endif
@@ -1,4 +1,6 @@
 #include "iter.h"
+#include "block-tree.h"
+#include "newline.h"
 #include "common.h"
 
 void block_iter_normalize(struct block_iter *bi)
@@ -36,6 +38,28 @@ long block_iter_eat_line(struct block_iter *bi)
 	return bi->offset - offset;
 }
 
+/*
+ * Like calling block_iter_eat_line() count times but faster.
+ */
+void block_iter_eat_lines(struct block_iter *bi, long count)
+{
+	while (count > 0) {
+		struct block *blk;
+		const unsigned char *nl;
+
+		block_iter_normalize(bi);
+		blk = bi->blk;
+		nl = find_nth_nl(blk->data + bi->offset, blk->size - bi->offset, &count);
+		if (nl) {
+			bi->offset = nl + 1 - blk->data;
+			return;
+		}
+		bi->offset = blk->size;
+		if (blk->node.next == bi->head)
+			return;
+	}
+}
+
 /*
  * Move to beginning of next line.
  * If there is no next line iterator is not advanced.
@@ -165,48 +189,25 @@ void block_iter_skip_bytes(struct block_iter *bi, long count)
 
 void block_iter_goto_offset(struct block_iter *bi, long offset)
 {
-	struct block *blk;
+	// bi->blk may be stale, first block is always valid
+	struct block *blk = block_tree_find_offset(BLOCK(bi->head->next), &offset);
 
-	list_for_each_entry(blk, bi->head, node) {
-		if (offset <= blk->size) {
-			bi->blk = blk;
-			bi->offset = offset;
-			return;
-		}
-		offset -= blk->size;
+	if (blk) {
+		bi->blk = blk;
+		bi->offset = offset;
 	}
 }
 
 void block_iter_goto_line(struct block_iter *bi, long line)
 {
-	struct block *blk = BLOCK(bi->head->next);
-	long nl = 0;
-
-	while (blk->node.next != bi->head && nl + blk->nl < line) {
-		nl += blk->nl;
-		blk = BLOCK(blk->node.next);
-	}
-
-	bi->blk = blk;
+	bi->blk = block_tree_find_line(BLOCK(bi->head->next), &line);
 	bi->offset = 0;
-	while (nl < line) {
-		if (!block_iter_eat_line(bi))
-			break;
-		nl++;
-	}
+	block_iter_eat_lines(bi, line);
 }
 
 long block_iter_get_offset(const struct block_iter *bi)
 {
-	struct block *blk;
-	long offset = 0;
-
-	list_for_each_entry(blk, bi->head, node) {
-		if (blk == bi->blk)
-			break;
-		offset += blk->size;
-	}
-	return offset + bi->offset;
+	return block_tree_offset(bi->blk) + bi->offset;
 }
 
 bool block_iter_is_bol(const struct block_iter *bi)
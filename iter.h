@@ -9,6 +9,9 @@
  *
  * There's one zero-sized block when the file is empty. Otherwise
  * zero-sized blocks are forbidden.
+ *
+ * Data of a mapped block points to the file mapping of the buffer and is
+ * read-only. It is copied to heap by block_grow() before it is modified.
  */
 struct block {
 	struct list_head node;
@@ -16,6 +19,13 @@ struct block {
 	long size;
 	long alloc;
 	long nl;
+	bool mapped;
+
+	// see block-tree.h
+	struct block *parent, *left, *right;
+	unsigned int prio;
+	long tree_size;
+	long tree_nl;
 };
 
 static inline struct block *BLOCK(struct list_head *item)
@@ -50,6 +60,7 @@ static inline void block_iter_eof(struct block_iter *bi)
 
 void block_iter_normalize(struct block_iter *bi);
 long block_iter_eat_line(struct block_iter *bi);
+void block_iter_eat_lines(struct block_iter *bi, long count);
 long block_iter_next_line(struct block_iter *bi);
 long block_iter_prev_line(struct block_iter *bi);
 long block_iter_bol(struct block_iter *bi);
@@ -0,0 +1,759 @@
+#include "journal.h"
+#include "buffer.h"
+#include "change.h"
+#include "block.h"
+#include "view.h"
+#include "editor.h"
+#include "load-save.h"
+#include "error.h"
+#include "common.h"
+
+#include <inttypes.h>
+
+/*
+ * File starts with JOURNAL_MAGIC followed by records:
+ *
+ *     'N' id parent flags offset del_count ins_count deleted inserted
+ *                          change was made and became the current change
+ *                          flags: 1 move_after, 2 hunks (deleted is the
+ *                          list of hunks to undo, inserted to redo)
+ *     'I' id pos len text  text was added to inserted text of change at pos
+ *     'D' id pos len text  text was added to deleted text of change at pos
+ *     'E' id pos len text  same as 'D' but offset of change moved back
+ *     'C' id               change became current by undo or redo
+ *     'S' id hash          buffer was saved, hash of its contents
+ *
+ * Numbers are in native byte order. Changes are numbered from 1 in the
+ * order they were made, 0 is the state of the file when the journal was
+ * started. Incomplete record at end of the file is ignored.
+ *
+ * Journal is rewritten from the change tree when it has grown to twice
+ * its size after the previous rewrite and old changes have been
+ * forgotten. Then 0 is the oldest state that is still remembered.
+ */
+#define JOURNAL_MAGIC "DEXUNDO1"
+
+// records are written and synced at most this many ms after they are made
+#define SYNC_DELAY 1000
+
+struct journal {
+	int fd;
+	char *filename;
+
+	// records not written yet
+	char *buf;
+	long size;
+	long alloc;
+
+	// written but not synced
+	bool dirty;
+	// when oldest record that isn't synced was made
+	long since;
+
+	// size of the file and its size after it was last rewritten
+	long written;
+	long compacted;
+
+	// history was read before the file was loaded, hash of the file
+	// must be checked when loading finishes
+	bool unchecked;
+	uint64_t hash;
+};
+
+#define NODE_MOVE_AFTER 1
+#define NODE_HUNKS 2
+
+struct journal_node {
+	unsigned int parent;
+	unsigned char flags;
+	long offset;
+	long del_count;
+	long ins_count;
+	char *del;
+	char *ins;
+};
+
+struct hash_state {
+	uint64_t h;
+	uint64_t w;
+	int n;
+};
+
+static void hash_word(struct hash_state *s, uint64_t w)
+{
+	s->h = (s->h ^ w) * 0x9e3779b97f4a7c15ULL;
+	s->h ^= s->h >> 29;
+}
+
+// result does not depend on how the data is split into calls
+static void hash_update(struct hash_state *s, const unsigned char *p, long size)
+{
+	while (size && s->n) {
+		s->w |= (uint64_t)*p++ << (s->n * 8);
+		size--;
+		if (++s->n == 8) {
+			hash_word(s, s->w);
+			s->w = 0;
+			s->n = 0;
+		}
+	}
+	while (size >= 8) {
+		uint64_t w;
+
+		memcpy(&w, p, 8);
+		hash_word(s, w);
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		s->w |= (uint64_t)*p++ << (s->n++ * 8);
+}
+
+// hash of buffer contents recorded when it is saved
+uint64_t journal_hash(struct buffer *b)
+{
+	struct hash_state s = { 0xcbf29ce484222325ULL, 0, 0 };
+	struct block *blk;
+	long size = 0;
+
+	list_for_each_entry(blk, &b->blocks, node) {
+		hash_update(&s, blk->data, blk->size);
+		size += blk->size;
+	}
+	hash_word(&s, s.w);
+	hash_word(&s, size);
+	return s.h;
+}
+
+static char *journal_filename(const char *abs_filename)
+{
+	struct hash_state s = { 0xcbf29ce484222325ULL, 0, 0 };
+	char name[64];
+
+	hash_update(&s, (const unsigned char *)abs_filename, strlen(abs_filename));
+	hash_word(&s, s.w);
+	snprintf(name, sizeof(name), "undo/%016" PRIx64, s.h);
+	return editor_file(name);
+}
+
+static bool can_journal(struct buffer *b)
+{
+	return options.undo_journal && !b->huge && b->abs_filename;
+}
+
+static void put(struct journal *j, const void *data, long len)
+{
+	if (!j->size && !j->dirty)
+		j->since = now_ms();
+	if (j->size + len > j->alloc) {
+		j->alloc = ROUND_UP(j->size + len, 64 * 1024);
+		xrenew(j->buf, j->alloc);
+	}
+	memcpy(j->buf + j->size, data, len);
+	j->size += len;
+}
+
+static void put_u32(struct journal *j, unsigned int v)
+{
+	uint32_t u = v;
+	put(j, &u, sizeof(u));
+}
+
+static void put_long(struct journal *j, long v)
+{
+	int64_t i = v;
+	put(j, &i, sizeof(i));
+}
+
+static void put_saved(struct journal *j, unsigned int id, uint64_t hash)
+{
+	put(j, "S", 1);
+	put_u32(j, id);
+	put(j, &hash, sizeof(hash));
+}
+
+static bool write_journal(struct journal *j)
+{
+	bool ok = true;
+
+	if (j->size) {
+		if (xwrite(j->fd, j->buf, j->size) < 0) {
+			error_msg("Error writing %s: %s", j->filename, strerror(errno));
+			ok = false;
+		} else {
+			j->written += j->size;
+		}
+		j->size = 0;
+		j->dirty = true;
+	}
+	return ok;
+}
+
+static void sync_journal(struct journal *j)
+{
+	write_journal(j);
+	if (j->dirty) {
+		fdatasync(j->fd);
+		j->dirty = false;
+	}
+}
+
+static struct journal *open_journal(char *filename, int flags)
+{
+	struct journal *j;
+	int fd = open(filename, O_WRONLY | O_CREAT | flags, 0600);
+
+	if (fd < 0) {
+		error_msg("Error creating %s: %s", filename, strerror(errno));
+		free(filename);
+		return NULL;
+	}
+	j = xnew0(struct journal, 1);
+	j->fd = fd;
+	j->filename = filename;
+	return j;
+}
+
+// called before first edit of b
+void journal_start(struct buffer *b)
+{
+	char *dir;
+
+	// history made before the journal was started can't be recorded
+	if (b->journal || b->change_id || !can_journal(b))
+		return;
+
+	dir = editor_file("undo");
+	mkdir(dir, 0700);
+	free(dir);
+
+	b->journal = open_journal(journal_filename(b->abs_filename), O_TRUNC);
+	if (b->journal) {
+		put(b->journal, JOURNAL_MAGIC, 8);
+		put_saved(b->journal, b->cur_change->id, journal_hash(b));
+	}
+}
+
+void journal_add_change(struct buffer *b, const struct change *c, const char *ins, long ins_count)
+{
+	struct journal *j = b->journal;
+	unsigned char flags = 0;
+
+	if (!j)
+		return;
+	if (c->move_after)
+		flags |= NODE_MOVE_AFTER;
+	if (c->hunks)
+		flags |= NODE_HUNKS;
+	put(j, "N", 1);
+	put_u32(j, c->id);
+	put_u32(j, c->next->id);
+	put(j, &flags, 1);
+	put_long(j, c->offset);
+	put_long(j, c->del_count);
+	put_long(j, ins_count);
+	put(j, c->buf, c->del_count);
+	put(j, ins, ins_count);
+}
+
+void journal_merge_change(struct buffer *b, const struct change *c, char type, long pos, const char *buf, long len)
+{
+	struct journal *j = b->journal;
+
+	if (!j)
+		return;
+	put(j, &type, 1);
+	put_u32(j, c->id);
+	put_long(j, pos);
+	put_long(j, len);
+	put(j, buf, len);
+}
+
+void journal_set_cur(struct buffer *b)
+{
+	if (!b->journal)
+		return;
+	put(b->journal, "C", 1);
+	put_u32(b->journal, b->cur_change->id);
+}
+
+void journal_close(struct buffer *b)
+{
+	struct journal *j = b->journal;
+
+	if (!j)
+		return;
+	sync_journal(j);
+	close(j->fd);
+	free(j->filename);
+	free(j->buf);
+	free(j);
+	b->journal = NULL;
+}
+
+static bool get(const char *buf, long size, long *pos, void *data, long len)
+{
+	if (len < 0 || size - *pos < len)
+		return false;
+	memcpy(data, buf + *pos, len);
+	*pos += len;
+	return true;
+}
+
+static bool get_u32(const char *buf, long size, long *pos, unsigned int *v)
+{
+	uint32_t u;
+
+	if (!get(buf, size, pos, &u, sizeof(u)))
+		return false;
+	*v = u;
+	return true;
+}
+
+static bool get_long(const char *buf, long size, long *pos, long *v)
+{
+	int64_t i;
+
+	if (!get(buf, size, pos, &i, sizeof(i)) || i < 0)
+		return false;
+	*v = i;
+	return true;
+}
+
+static char *get_text(const char *buf, long size, long *pos, long len)
+{
+	char *text;
+
+	if (!len || size - *pos < len)
+		return NULL;
+	text = xmemdup(buf + *pos, len);
+	*pos += len;
+	return text;
+}
+
+static void insert_text(char **text, long *count, long pos, const char *buf, long len)
+{
+	xrenew(*text, *count + len);
+	memmove(*text + pos + len, *text + pos, *count - pos);
+	memcpy(*text + pos, buf, len);
+	*count += len;
+}
+
+static bool parse_record(const char *buf, long size, long *pos, struct journal_node **nodes, unsigned int *nr_nodes, unsigned int *cur, unsigned int *saved, uint64_t *hash)
+{
+	struct journal_node node, *n;
+	unsigned int id;
+	long offset, len;
+	char type;
+
+	if (!get(buf, size, pos, &type, 1) || !get_u32(buf, size, pos, &id))
+		return false;
+
+	switch (type) {
+	case 'N':
+		clear(&node);
+		if (id != *nr_nodes || !get_u32(buf, size, pos, &node.parent) || node.parent >= id)
+			return false;
+		if (!get(buf, size, pos, &node.flags, 1) ||
+				!get_long(buf, size, pos, &node.offset) ||
+				!get_long(buf, size, pos, &node.del_count) ||
+				!get_long(buf, size, pos, &node.ins_count) ||
+				size - *pos < node.del_count + node.ins_count)
+			return false;
+		node.del = get_text(buf, size, pos, node.del_count);
+		node.ins = get_text(buf, size, pos, node.ins_count);
+		xrenew(*nodes, id + 1);
+		(*nodes)[id] = node;
+		*nr_nodes = id + 1;
+		// new change is always the current change
+		*cur = id;
+		return true;
+	case 'I':
+	case 'D':
+	case 'E':
+		if (!id || id >= *nr_nodes || !get_long(buf, size, pos, &offset) ||
+				!get_long(buf, size, pos, &len) || !len || size - *pos < len)
+			return false;
+		n = &(*nodes)[id];
+		if (type == 'I') {
+			if (offset > n->ins_count)
+				return false;
+			insert_text(&n->ins, &n->ins_count, offset, buf + *pos, len);
+		} else {
+			if (offset > n->del_count)
+				return false;
+			insert_text(&n->del, &n->del_count, offset, buf + *pos, len);
+			if (type == 'E')
+				n->offset -= len;
+		}
+		*pos += len;
+		return true;
+	case 'C':
+		if (id >= *nr_nodes)
+			return false;
+		*cur = id;
+		return true;
+	case 'S':
+		if (id >= *nr_nodes || !get(buf, size, pos, hash, sizeof(*hash)))
+			return false;
+		*saved = id;
+		return true;
+	}
+	return false;
+}
+
+// build change tree of b from nodes, state of b is state of saved node
+static struct change *build_changes(struct buffer *b, struct journal_node *nodes, unsigned int nr_nodes, unsigned int saved, unsigned int cur)
+{
+	struct change *cur_change;
+	struct change **changes = xnew(struct change *, nr_nodes);
+	bool *applied = xnew0(bool, nr_nodes);
+	unsigned int i;
+
+	for (i = saved; i; i = nodes[i].parent)
+		applied[i] = true;
+
+	changes[0] = &b->change_head;
+	for (i = 1; i < nr_nodes; i++) {
+		struct journal_node *n = &nodes[i];
+		struct change *c = alloc_change(b);
+
+		c->id = i;
+		c->move_after = n->flags & NODE_MOVE_AFTER;
+		c->hunks = n->flags & NODE_HUNKS;
+		c->offset = n->offset;
+		if (applied[i]) {
+			c->del_count = n->del_count;
+			c->ins_count = n->ins_count;
+			c->buf = n->del;
+			free(n->ins);
+		} else {
+			// undone, text must be inserted to redo it
+			c->del_count = n->ins_count;
+			c->ins_count = n->del_count;
+			c->buf = n->ins;
+			free(n->del);
+		}
+		if (c->hunks)
+			c->ins_count = 0;
+		if (c->buf)
+			b->undo_size += c->del_count;
+
+		link_change(changes[n->parent], c);
+		changes[i] = c;
+	}
+	b->change_id = nr_nodes - 1;
+	b->cur_change = changes[saved];
+	b->saved_change = changes[saved];
+	cur_change = changes[cur];
+	free(applied);
+	free(changes);
+	return cur_change;
+}
+
+static void free_nodes(struct journal_node *nodes, unsigned int nr_nodes)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_nodes; i++) {
+		free(nodes[i].del);
+		free(nodes[i].ins);
+	}
+	free(nodes);
+}
+
+// changes of b indexed by id, NULL for forgotten ones
+static struct change **tree_changes(struct buffer *b, unsigned int nr_nodes)
+{
+	struct change **changes = xnew0(struct change *, nr_nodes);
+	PTR_ARRAY(stack);
+
+	ptr_array_add(&stack, &b->change_head);
+	while (stack.count) {
+		struct change *c = stack.ptrs[--stack.count];
+		unsigned int i;
+
+		if (c->id >= nr_nodes) {
+			// not in the journal
+			free(stack.ptrs);
+			free(changes);
+			return NULL;
+		}
+		if (c != &b->change_head)
+			changes[c->id] = c;
+		for (i = 0; i < c->nr_prev; i++)
+			ptr_array_add(&stack, c->prev[i]);
+	}
+	free(stack.ptrs);
+	return changes;
+}
+
+/*
+ * Rewrite journal of b with only the changes that are still in the tree
+ * and number them again. Changes in the tree have only deleted or only
+ * inserted text so the records are read back from the journal.
+ */
+static void compact_journal(struct buffer *b)
+{
+	struct journal *j = b->journal, *nj = NULL;
+	struct journal_node *nodes = xnew0(struct journal_node, 1);
+	unsigned int nr_nodes = 1, cur = 0, saved = 0, nr = 1, i;
+	unsigned int *map = NULL;
+	struct change **changes = NULL;
+	uint64_t hash = 0;
+	long size, pos = 8, end = 8;
+	char *buf;
+
+	// saved state is needed to check the file when the journal is loaded
+	if (!b->saved_change || !write_journal(j)) {
+		free(nodes);
+		return;
+	}
+	size = read_file(j->filename, &buf);
+	if (size < 8) {
+		free(buf);
+		free(nodes);
+		return;
+	}
+	while (parse_record(buf, size, &pos, &nodes, &nr_nodes, &cur, &saved, &hash))
+		end = pos;
+	free(buf);
+	if (end != size)
+		goto out;
+	changes = tree_changes(b, nr_nodes);
+	if (!changes)
+		goto out;
+
+	// forgotten changes are merged to change_head which becomes 0
+	map = xnew0(unsigned int, nr_nodes);
+	for (i = 1; i < nr_nodes; i++) {
+		if (changes[i])
+			map[i] = nr++;
+	}
+
+	nj = open_journal(xsprintf("%s.new", j->filename), O_TRUNC | O_APPEND);
+	if (!nj)
+		goto out;
+	put(nj, JOURNAL_MAGIC, 8);
+	for (i = 1; i < nr_nodes; i++) {
+		struct journal_node *n = &nodes[i];
+
+		if (!changes[i])
+			continue;
+		put(nj, "N", 1);
+		put_u32(nj, map[i]);
+		put_u32(nj, map[n->parent]);
+		put(nj, &n->flags, 1);
+		put_long(nj, n->offset);
+		put_long(nj, n->del_count);
+		put_long(nj, n->ins_count);
+		put(nj, n->del, n->del_count);
+		put(nj, n->ins, n->ins_count);
+	}
+	put(nj, "C", 1);
+	put_u32(nj, map[b->cur_change->id]);
+	put_saved(nj, map[b->saved_change->id], hash);
+	if (!write_journal(nj) || fdatasync(nj->fd) || rename(nj->filename, j->filename)) {
+		unlink(nj->filename);
+		goto out;
+	}
+
+	for (i = 1; i < nr_nodes; i++) {
+		if (changes[i])
+			changes[i]->id = map[i];
+	}
+	b->change_head.id = 0;
+	b->change_id = nr - 1;
+	close(j->fd);
+	j->fd = nj->fd;
+	nj->fd = -1;
+	j->written = j->compacted = nj->written;
+	j->dirty = false;
+out:
+	if (nj) {
+		if (nj->fd >= 0)
+			close(nj->fd);
+		free(nj->filename);
+		free(nj->buf);
+		free(nj);
+	}
+	free(map);
+	free(changes);
+	free_nodes(nodes, nr_nodes);
+}
+
+// rewrite after old changes have been forgotten and the journal has grown
+static void maybe_compact_journal(struct buffer *b)
+{
+	struct journal *j = b->journal;
+
+	if (b->change_head.id && j->written + j->size > 2 * j->compacted)
+		compact_journal(b);
+}
+
+// hash is of the contents that were written to the file
+void journal_saved_hash(struct buffer *b, uint64_t hash)
+{
+	struct journal *j = b->journal;
+	char *filename;
+
+	if (!j)
+		return;
+
+	// saved to another file, history now belongs to it
+	filename = journal_filename(b->abs_filename);
+	if (!streq(filename, j->filename)) {
+		write_journal(j);
+		rename(j->filename, filename);
+		free(j->filename);
+		j->filename = filename;
+	} else {
+		free(filename);
+	}
+
+	put_saved(j, b->saved_change->id, hash);
+	maybe_compact_journal(b);
+	sync_journal(j);
+}
+
+void journal_saved(struct buffer *b)
+{
+	if (b->journal)
+		journal_saved_hash(b, journal_hash(b));
+}
+
+/*
+ * Restore history and unsaved changes of b if its journal matches the
+ * file. If there are no unsaved changes the file need not be loaded
+ * first, it is checked by journal_loaded() when loading finishes.
+ */
+void load_journal(struct buffer *b)
+{
+	struct journal_node *nodes = xnew0(struct journal_node, 1);
+	unsigned int nr_nodes = 1, cur = 0, saved = 0;
+	struct view *saved_view = view;
+	struct buffer *saved_buffer = buffer;
+	struct change *cur_change;
+	char *filename, *buf;
+	uint64_t hash = 0;
+	long size, pos = 8, end;
+	struct view v;
+
+	if (!can_journal(b)) {
+		free(nodes);
+		return;
+	}
+	filename = journal_filename(b->abs_filename);
+	size = read_file(filename, &buf);
+	if (size < 8 || memcmp(buf, JOURNAL_MAGIC, 8)) {
+		free(buf);
+		free(filename);
+		free(nodes);
+		return;
+	}
+
+	end = pos;
+	while (parse_record(buf, size, &pos, &nodes, &nr_nodes, &cur, &saved, &hash))
+		end = pos;
+	free(buf);
+
+	// unsaved changes are made to the whole file
+	if (cur != saved)
+		finish_loading(b);
+	if (!b->loader && hash != journal_hash(b)) {
+		// file has been changed by someone else
+		free_nodes(nodes, nr_nodes);
+		unlink(filename);
+		free(filename);
+		return;
+	}
+	cur_change = build_changes(b, nodes, nr_nodes, saved, cur);
+	free(nodes);
+
+	clear(&v);
+	v.buffer = b;
+	v.cursor.head = &b->blocks;
+	v.cursor.blk = BLOCK(b->blocks.next);
+	view = &v;
+	buffer = b;
+	goto_change(cur_change);
+	trim_undo();
+	view = saved_view;
+	buffer = saved_buffer;
+
+	// continue after last complete record
+	if (truncate(filename, end)) {
+		free(filename);
+		return;
+	}
+	b->journal = open_journal(filename, O_APPEND);
+	if (!b->journal)
+		return;
+	b->journal->written = b->journal->compacted = end;
+	if (b->loader) {
+		b->journal->unchecked = true;
+		b->journal->hash = hash;
+	}
+	if (b->change_head.id)
+		compact_journal(b);
+	if (buffer_modified(b))
+		info_msg("Recovered unsaved changes of %s.", buffer_filename(b));
+}
+
+// called when loading of b has finished
+void journal_loaded(struct buffer *b)
+{
+	struct journal *j = b->journal;
+
+	if (!j || !j->unchecked)
+		return;
+	j->unchecked = false;
+	if (j->hash == journal_hash(b))
+		return;
+
+	// file has been changed by someone else, history is not for it
+	unlink(j->filename);
+	journal_close(b);
+	free_changes(b);
+	clear(&b->change_head);
+	b->cur_change = &b->change_head;
+	b->saved_change = &b->change_head;
+	b->saving_change = NULL;
+	b->change_id = 0;
+	b->undo_size = 0;
+}
+
+// ms until pending records must be synced, -1 if there are none
+long journal_sync_delay(void)
+{
+	long delay = -1, now = now_ms();
+	int i;
+
+	for (i = 0; i < buffers.count; i++) {
+		struct journal *j = ((struct buffer *)buffers.ptrs[i])->journal;
+		long d;
+
+		if (!j || (!j->size && !j->dirty))
+			continue;
+		d = j->since + SYNC_DELAY - now;
+		if (d < 0)
+			d = 0;
+		if (delay < 0 || d < delay)
+			delay = d;
+	}
+	return delay;
+}
+
+void sync_journals(void)
+{
+	int i;
+
+	for (i = 0; i < buffers.count; i++) {
+		struct journal *j = ((struct buffer *)buffers.ptrs[i])->journal;
+
+		if (j) {
+			maybe_compact_journal(buffers.ptrs[i]);
+			sync_journal(j);
+		}
+	}
+}
@@ -0,0 +1,31 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "libc.h"
+
+#include <inttypes.h>
+
+struct buffer;
+struct change;
+
+/*
+ * Append-only log of the change tree of a buffer, see undo-journal
+ * option. Every change is recorded in its original direction with both
+ * deleted and inserted text so that the tree can be rebuilt directly
+ * when the file is opened again.
+ */
+
+void journal_start(struct buffer *b);
+void journal_add_change(struct buffer *b, const struct change *c, const char *ins, long ins_count);
+void journal_merge_change(struct buffer *b, const struct change *c, char type, long pos, const char *buf, long len);
+void journal_set_cur(struct buffer *b);
+void journal_saved(struct buffer *b);
+void journal_saved_hash(struct buffer *b, uint64_t hash);
+uint64_t journal_hash(struct buffer *b);
+void journal_close(struct buffer *b);
+void load_journal(struct buffer *b);
+void journal_loaded(struct buffer *b);
+long journal_sync_delay(void);
+void sync_journals(void);
+
+#endif
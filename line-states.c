@@ -0,0 +1,322 @@
+#include "line-states.h"
+#include "common.h"
+
+#include <inttypes.h>
+
+static unsigned int next_prio(void)
+{
+	// xorshift32, priorities need not be good random numbers
+	static unsigned int x = 2463534242U;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static inline int is_invalid(const struct state *st)
+{
+	return (uintptr_t)st & 1;
+}
+
+static inline int subtree_lines(const struct state_run *n)
+{
+	return n ? n->tree_lines : 0;
+}
+
+static inline int subtree_invalid(const struct state_run *n)
+{
+	return n ? n->tree_invalid : 0;
+}
+
+static void pull(struct state_run *n)
+{
+	n->tree_lines = n->lines + subtree_lines(n->left) + subtree_lines(n->right);
+	n->tree_invalid = is_invalid(n->state) + subtree_invalid(n->left) + subtree_invalid(n->right);
+}
+
+static struct state_run *new_run(struct line_states *s, int lines, struct state *st)
+{
+	struct state_run *n = xnew(struct state_run, 1);
+
+	n->left = NULL;
+	n->right = NULL;
+	n->prio = next_prio();
+	n->lines = lines;
+	n->state = st;
+	pull(n);
+	s->nr_runs++;
+	return n;
+}
+
+static void free_runs(struct line_states *s, struct state_run *n)
+{
+	if (n == NULL)
+		return;
+	free_runs(s, n->left);
+	free_runs(s, n->right);
+	free(n);
+	s->nr_runs--;
+}
+
+static struct state_run *merge(struct state_run *a, struct state_run *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = merge(a->right, b);
+		pull(a);
+		return a;
+	}
+	b->left = merge(a, b->left);
+	pull(b);
+	return b;
+}
+
+static void split_runs(struct state_run *n, int line, struct state_run **a, struct state_run **b)
+{
+	int left;
+
+	if (n == NULL) {
+		*a = NULL;
+		*b = NULL;
+		return;
+	}
+	left = subtree_lines(n->left);
+	if (line <= left) {
+		split_runs(n->left, line, a, &n->left);
+		pull(n);
+		*b = n;
+	} else {
+		split_runs(n->right, line - left - n->lines, &n->right, b);
+		pull(n);
+		*a = n;
+	}
+}
+
+// shorten run that continues past line, returns number of lines cut off
+static int cut_run(struct state_run *n, int line, struct state **st)
+{
+	int left, cut = 0;
+
+	if (n == NULL)
+		return 0;
+	left = subtree_lines(n->left);
+	if (line < left) {
+		cut = cut_run(n->left, line, st);
+	} else if (line >= left + n->lines) {
+		cut = cut_run(n->right, line - left - n->lines, st);
+	} else if (line > left) {
+		cut = left + n->lines - line;
+		n->lines -= cut;
+		*st = n->state;
+	}
+	if (cut)
+		pull(n);
+	return cut;
+}
+
+/*
+ * First line lines of n go to *a and the rest to *b. A run that crosses
+ * line is cut in two and the second half becomes a new run.
+ */
+static void split(struct line_states *s, struct state_run *n, int line, struct state_run **a, struct state_run **b)
+{
+	struct state *st = NULL;
+	int cut = cut_run(n, line, &st);
+
+	split_runs(n, line, a, b);
+	if (cut)
+		*b = merge(new_run(s, cut, st), *b);
+}
+
+static struct state_run *first_run(struct state_run *n)
+{
+	while (n->left)
+		n = n->left;
+	return n;
+}
+
+static struct state_run *last_run(struct state_run *n)
+{
+	while (n->right)
+		n = n->right;
+	return n;
+}
+
+static void grow_last_run(struct state_run *n, int lines)
+{
+	while (1) {
+		n->tree_lines += lines;
+		if (n->right == NULL)
+			break;
+		n = n->right;
+	}
+	n->lines += lines;
+}
+
+static struct state_run *remove_first_run(struct line_states *s, struct state_run *n)
+{
+	struct state_run *right;
+
+	if (n->left) {
+		n->left = remove_first_run(s, n->left);
+		pull(n);
+		return n;
+	}
+	right = n->right;
+	free(n);
+	s->nr_runs--;
+	return right;
+}
+
+// runs on both sides of the seam are joined if they have the same state
+static struct state_run *join(struct line_states *s, struct state_run *a, struct state_run *b)
+{
+	if (a && b && last_run(a)->state == first_run(b)->state) {
+		int lines = first_run(b)->lines;
+
+		b = remove_first_run(s, b);
+		grow_last_run(a, lines);
+	}
+	return merge(a, b);
+}
+
+// start state of the first line is always known
+void line_states_reset(struct line_states *s, struct state *st)
+{
+	line_states_free(s);
+	s->root = new_run(s, 1, st);
+}
+
+void line_states_free(struct line_states *s)
+{
+	free_runs(s, s->root);
+	s->root = NULL;
+}
+
+struct state *line_states_get(const struct line_states *s, int line)
+{
+	const struct state_run *n = s->root;
+
+	while (1) {
+		int left;
+
+		BUG_ON(n == NULL);
+		left = subtree_lines(n->left);
+		if (line < left) {
+			n = n->left;
+		} else if (line < left + n->lines) {
+			return n->state;
+		} else {
+			line -= left + n->lines;
+			n = n->right;
+		}
+	}
+}
+
+// line can be one past the last line
+void line_states_set(struct line_states *s, int line, struct state *st)
+{
+	struct state_run *a, *b, *c;
+
+	if (line == line_states_count(s)) {
+		if (s->root && last_run(s->root)->state == st)
+			grow_last_run(s->root, 1);
+		else
+			s->root = merge(s->root, new_run(s, 1, st));
+		return;
+	}
+	if (line_states_get(s, line) == st)
+		return;
+
+	split(s, s->root, line, &a, &b);
+	split(s, b, 1, &b, &c);
+	b->state = st;
+	pull(b);
+	s->root = join(s, join(s, a, b), c);
+}
+
+// insert count lines with state st before line
+void line_states_insert(struct line_states *s, int line, int count, struct state *st)
+{
+	struct state_run *a, *b;
+
+	split(s, s->root, line, &a, &b);
+	s->root = join(s, join(s, a, new_run(s, count, st)), b);
+}
+
+void line_states_delete(struct line_states *s, int line, int count)
+{
+	struct state_run *a, *b, *c;
+
+	split(s, s->root, line, &a, &b);
+	split(s, b, count, &b, &c);
+	free_runs(s, b);
+	s->root = join(s, a, c);
+}
+
+// forget states of lines after the first count
+void line_states_truncate(struct line_states *s, int count)
+{
+	struct state_run *a, *b;
+
+	split(s, s->root, count, &a, &b);
+	free_runs(s, b);
+	s->root = a;
+}
+
+static int find_invalid(const struct state_run *n, int line)
+{
+	int left, end, found;
+
+	if (n == NULL || n->tree_invalid == 0)
+		return -1;
+	left = subtree_lines(n->left);
+	end = left + n->lines;
+	if (line < left) {
+		found = find_invalid(n->left, line);
+		if (found >= 0)
+			return found;
+	}
+	if (is_invalid(n->state) && line < end)
+		return line > left ? line : left;
+	found = find_invalid(n->right, line > end ? line - end : 0);
+	return found < 0 ? -1 : found + end;
+}
+
+// first invalidated line at or after line, number of lines if none
+int line_states_find_invalid(const struct line_states *s, int line)
+{
+	int found = find_invalid(s->root, line);
+
+	return found < 0 ? line_states_count(s) : found;
+}
+
+static void check_runs(const struct state_run *n, const struct state_run **prev)
+{
+	if (n->left) {
+		BUG_ON(n->left->prio > n->prio);
+		check_runs(n->left, prev);
+	}
+	BUG_ON(n->lines <= 0);
+	BUG_ON(*prev && (*prev)->state == n->state);
+	*prev = n;
+	if (n->right) {
+		BUG_ON(n->right->prio > n->prio);
+		check_runs(n->right, prev);
+	}
+	BUG_ON(n->tree_lines != n->lines + subtree_lines(n->left) + subtree_lines(n->right));
+	BUG_ON(n->tree_invalid != is_invalid(n->state) + subtree_invalid(n->left) + subtree_invalid(n->right));
+}
+
+// expensive, adjacent runs must have different states
+void line_states_sanity_check(const struct line_states *s)
+{
+	const struct state_run *prev = NULL;
+
+	if (s->root)
+		check_runs(s->root, &prev);
+}
@@ -0,0 +1,48 @@
+#ifndef LINE_STATES_H
+#define LINE_STATES_H
+
+#include "libc.h"
+
+struct state;
+
+/*
+ * Highlighter start states of lines stored as runs of consecutive lines
+ * that start in the same state. Most lines start in the same state as
+ * the line before them so there are far fewer runs than lines.
+ *
+ * Runs are kept in a treap ordered by line number. Every node knows the
+ * line count of its subtree and how many invalidated runs it contains,
+ * which makes all operations O(log n). Lowest bit of an invalidated
+ * state is 1.
+ */
+struct state_run {
+	struct state_run *left;
+	struct state_run *right;
+	unsigned int prio;
+	int lines;
+	struct state *state;
+	int tree_lines;
+	int tree_invalid;
+};
+
+struct line_states {
+	struct state_run *root;
+	long nr_runs;
+};
+
+static inline int line_states_count(const struct line_states *s)
+{
+	return s->root ? s->root->tree_lines : 0;
+}
+
+void line_states_reset(struct line_states *s, struct state *st);
+void line_states_free(struct line_states *s);
+struct state *line_states_get(const struct line_states *s, int line);
+void line_states_set(struct line_states *s, int line, struct state *st);
+void line_states_insert(struct line_states *s, int line, int count, struct state *st);
+void line_states_delete(struct line_states *s, int line, int count);
+void line_states_truncate(struct line_states *s, int count);
+int line_states_find_invalid(const struct line_states *s, int line);
+void line_states_sanity_check(const struct line_states *s);
+
+#endif
@@ -2,19 +2,37 @@
 #include "editor.h"
 #include "buffer.h"
 #include "block.h"
+#include "block-tree.h"
+#include "view.h"
+#include "syntax.h"
 #include "wbuf.h"
 #include "decoder.h"
 #include "encoder.h"
 #include "encoding.h"
 #include "error.h"
 #include "cconv.h"
+#include "newline.h"
+#include "journal.h"
+#include "fork.h"
+#include "ptr-array.h"
 
 #include <sys/mman.h>
 
+#define MAPPED_BLOCK_SIZE (64 * 1024)
+#define LOAD_STEP_SIZE (4 * 1024 * 1024)
+
+// huge files are indexed in bigger steps and blocks
+#define HUGE_STEP_SIZE (64 * 1024 * 1024)
+#define HUGE_BLOCK_SIZE (1024 * 1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 static void add_block(struct buffer *b, struct block *blk)
 {
 	b->nl += blk->nl;
-	list_add_before(&blk->node, &b->blocks);
+	block_add_tail(&b->blocks, blk);
 }
 
 static struct block *add_utf8_line(struct buffer *b, struct block *blk, const unsigned char *line, size_t len)
@@ -22,7 +40,7 @@ static struct block *add_utf8_line(struct buffer *b, struct block *blk, const un
 	size_t size = len + 1;
 
 	if (blk) {
-		size_t avail = blk->alloc - blk->size;
+		size_t avail = blk->mapped ? 0 : blk->alloc - blk->size;
 		if (size <= avail)
 			goto copy;
 
@@ -31,7 +49,7 @@ static struct block *add_utf8_line(struct buffer *b, struct block *blk, const un
 
 	if (size < 8192)
 		size = 8192;
-	blk = block_new(size);
+	blk = block_new(b, size);
 copy:
 	memcpy(blk->data + blk->size, line, len);
 	blk->size += len;
@@ -40,12 +58,109 @@ copy:
 	return blk;
 }
 
-static int decode_and_add_blocks(struct buffer *b, const unsigned char *buf, size_t size)
+// line must be followed by newline in the file mapping
+static struct block *add_mapped_line(struct buffer *b, struct block *blk, const unsigned char *line, size_t len)
 {
-	const char *e = detect_encoding_from_bom(buf, size);
+	size_t size = len + 1;
+
+	if (blk) {
+		if (blk->mapped && blk->data + blk->size == line && blk->size + size <= MAPPED_BLOCK_SIZE) {
+			blk->size += size;
+			blk->alloc = blk->size;
+			blk->nl++;
+			return blk;
+		}
+		add_block(b, blk);
+	}
+	return block_new_mapped(b, (unsigned char *)line, size, 1);
+}
+
+static bool can_map_line(struct buffer *b, const char *line, size_t len)
+{
+	const char *map = b->map;
+
+	// not converted and newline not stripped
+	return line >= map && line + len < map + b->map_size && line[len] == '\n';
+}
+
+static struct block *add_line(struct buffer *b, struct block *blk, const char *line, size_t len)
+{
+	if (b->map && can_map_line(b, line, len))
+		return add_mapped_line(b, blk, line, len);
+	return add_utf8_line(b, blk, line, len);
+}
+
+static struct block *add_mapped_lines(struct buffer *b, struct block *blk, const unsigned char *buf, size_t size)
+{
+	while (size > 0) {
+		size_t count = whole_lines(buf, size, MAPPED_BLOCK_SIZE);
+
+		if (!count) {
+			// incomplete last line
+			return add_utf8_line(b, blk, buf, size);
+		}
+		if (blk)
+			add_block(b, blk);
+		blk = block_new_mapped(b, (unsigned char *)buf, count, count_nl(buf, count));
+		buf += count;
+		size -= count;
+	}
+	return blk;
+}
+
+static struct block *add_utf8_lines(struct buffer *b, struct block *blk, const unsigned char *buf, size_t size)
+{
+	while (size > 0) {
+		size_t count = 0;
+
+		if (blk && !blk->mapped && blk->alloc > blk->size) {
+			// fill current block
+			count = whole_lines(buf, size, blk->alloc - blk->size);
+			if (count > blk->alloc - blk->size)
+				count = 0;
+		}
+		if (!count) {
+			count = whole_lines(buf, size, 8192);
+			if (!count) {
+				// incomplete last line
+				return add_utf8_line(b, blk, buf, size);
+			}
+			if (blk)
+				add_block(b, blk);
+			blk = block_new(b, count < 8192 ? 8192 : count);
+		}
+		blk->nl += copy_count_nl(blk->data + blk->size, buf, count);
+		blk->size += count;
+		buf += count;
+		size -= count;
+	}
+	return blk;
+}
+
+/*
+ * Decoding state of a file which is loaded incrementally, see
+ * continue_loading(). Lines are added to the buffer in steps so that the
+ * file can be displayed and browsed before all of it has been decoded.
+ */
+struct file_loader {
+	// NULL if the buffer is huge
 	struct file_decoder *dec;
-	char *line;
-	ssize_t len;
+
+	// how much of a huge file has been indexed
+	size_t pos;
+
+	// contents of the file
+	unsigned char *buf;
+	size_t size;
+	bool mapped;
+
+	// b->encoding can change until whole file has been validated
+	bool detect_encoding;
+};
+
+static struct file_decoder *new_decoder(struct buffer *b, const unsigned char *buf, size_t size)
+{
+	const char *e = detect_encoding_from_bom(buf, size);
 
 	if (b->encoding == NULL) {
 		if (e) {
@@ -85,35 +200,305 @@ static int decode_and_add_blocks(struct buffer *b, const unsigned char *buf, siz
 		size -= bom_len;
 	}
 
-	dec = new_file_decoder(b->encoding, buf, size);
-	if (dec == NULL)
-		return -1;
+	return new_file_decoder(b->encoding, buf, size);
+}
 
-	if (file_decoder_read_line(dec, &line, &len)) {
-		struct block *blk = NULL;
+// output of a converter, may contain CRLF line endings
+static struct block *add_decoded_lines(struct buffer *b, struct block *blk, const char *buf, ssize_t size)
+{
+	if (blk == NULL && list_empty(&b->blocks)) {
+		const char *nl = memchr(buf, '\n', size);
+		ssize_t len = nl ? nl - buf : size;
 
+		if (len && buf[len - 1] == '\r')
+			b->newline = NEWLINE_DOS;
+	}
+	if (b->newline == NEWLINE_UNIX)
+		return add_utf8_lines(b, blk, (const unsigned char *)buf, size);
+
+	while (size > 0) {
+		const char *nl = memchr(buf, '\n', size);
+		ssize_t len = nl ? nl - buf : size;
+		ssize_t count = nl ? len + 1 : len;
+
+		if (len && buf[len - 1] == '\r')
+			len--;
+		blk = add_line(b, blk, buf, len);
+		buf += count;
+		size -= count;
+	}
+	return blk;
+}
+
+/*
+ * Add lines decoded from about max bytes of input. Returns false if end of
+ * input was reached.
+ */
+static bool decode_and_add_blocks(struct buffer *b, struct file_decoder *dec, ssize_t max)
+{
+	ssize_t stop = dec->ipos + max;
+	struct block *blk = NULL;
+	bool more = true;
+	char *line;
+	ssize_t len;
+
+	if (list_empty(&b->blocks) && file_decoder_read_decoded(dec, max, &line, &len)) {
+		blk = add_decoded_lines(b, blk, line, len);
+	} else if (list_empty(&b->blocks)) {
+		if (!file_decoder_read_line(dec, &line, &len))
+			return false;
 		if (len && line[len - 1] == '\r') {
 			b->newline = NEWLINE_DOS;
 			len--;
 		}
-		blk = add_utf8_line(b, blk, line, len);
+		blk = add_line(b, blk, line, len);
+	}
 
-		while (file_decoder_read_line(dec, &line, &len)) {
-			if (b->newline == NEWLINE_DOS && len && line[len - 1] == '\r')
-				len--;
-			blk = add_utf8_line(b, blk, line, len);
+	// decoder may have buffered lines after all input has been read
+	while (dec->ipos < stop || dec->ipos == dec->isize) {
+		const unsigned char *rest;
+		ssize_t rest_size;
+
+		if (b->newline == NEWLINE_UNIX && file_decoder_read_utf8(dec, stop - dec->ipos, &rest, &rest_size)) {
+			// no conversion needed, add lines in large chunks
+			if (b->map)
+				blk = add_mapped_lines(b, blk, rest, rest_size);
+			else
+				blk = add_utf8_lines(b, blk, rest, rest_size);
+			continue;
 		}
-		if (blk)
-			add_block(b, blk);
+		if (file_decoder_read_decoded(dec, stop - dec->ipos, &line, &len)) {
+			// converted in parallel chunks
+			blk = add_decoded_lines(b, blk, line, len);
+			continue;
+		}
+		if (!file_decoder_read_line(dec, &line, &len)) {
+			more = false;
+			break;
+		}
+		if (b->newline == NEWLINE_DOS && len && line[len - 1] == '\r')
+			len--;
+		blk = add_line(b, blk, line, len);
 	}
-	if (b->encoding == NULL) {
-		e = dec->encoding;
-		if (e == NULL)
-			e = charset;
-		b->encoding = xstrdup(e);
+	if (blk)
+		add_block(b, blk);
+	return more;
+}
+
+/*
+ * Index lines of a huge file. Every block is a checkpoint pointing to
+ * about HUGE_BLOCK_SIZE bytes of whole lines in the mapping. Contents are
+ * not decoded or copied and pages that were read only to count newlines
+ * are given back, so the file is read again on demand when displayed.
+ */
+static bool add_huge_blocks(struct buffer *b, struct file_loader *l, size_t max)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t stop = l->pos + max;
+
+	while (l->pos < l->size && l->pos < stop) {
+		unsigned char *buf = l->buf + l->pos;
+		size_t size = l->size - l->pos;
+		size_t count = whole_lines(buf, size, HUGE_BLOCK_SIZE);
+		size_t start = l->pos - l->pos % page_size;
+
+		if (!count) {
+			// incomplete last line
+			add_block(b, add_utf8_line(b, NULL, buf, size));
+			l->pos = l->size;
+			break;
+		}
+		add_block(b, block_new_mapped(b, buf, count, count_nl(buf, count)));
+		l->pos += count;
+		madvise(l->buf + start, l->pos - start, MADV_DONTNEED);
+	}
+	return l->pos < l->size;
+}
+
+/*
+ * Text loaded so far was decoded as UTF-8 but rest of the file is not
+ * UTF-8. Loading starts over with the encoding the decoder fell back to.
+ * Buffer can't have been edited because editing finishes loading first.
+ * History read from undo journal is not applied until loading finishes.
+ */
+static void restart_loading(struct buffer *b)
+{
+	long i;
+
+	BUG_ON(buffer_modified(b));
+	while (!list_empty(&b->blocks)) {
+		struct block *blk = BLOCK(b->blocks.next);
+
+		list_del(&blk->node);
+		block_free(b, blk);
+	}
+	b->nl = 0;
+	b->newline = NEWLINE_UNIX;
+	if (b->syn) {
+		line_states_reset(&b->line_start_states, b->syn->states.ptrs[0]);
+		b->hl_pending = true;
+	}
+	mark_all_lines_changed(b);
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		v->selection = SELECT_NONE;
 	}
-	free_file_decoder(dec);
-	return 0;
+}
+
+// cursors stay on the same line if it has been loaded again
+static void reset_cursors(struct buffer *b)
+{
+	long i;
+
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		v->cursor.head = &b->blocks;
+		v->cursor.blk = BLOCK(b->blocks.next);
+		v->cursor.offset = 0;
+		block_iter_goto_line(&v->cursor, v->cy);
+		if (!v->restore_cursor)
+			v->saved_cursor_offset = block_iter_get_offset(&v->cursor);
+	}
+}
+
+static bool load_step(struct buffer *b, struct file_loader *l, size_t max)
+{
+	struct file_decoder *dec = l->dec;
+	bool restarted = false;
+	bool more;
+
+	if (b->huge)
+		return add_huge_blocks(b, l, max);
+	if (l->detect_encoding) {
+		if (!file_decoder_validate(dec, dec->ipos + max)) {
+			restart_loading(b);
+			restarted = true;
+		}
+		if (dec->encoding && !streq(dec->encoding, b->encoding)) {
+			free(b->encoding);
+			b->encoding = xstrdup(dec->encoding);
+		}
+		if (dec->checked == dec->isize)
+			l->detect_encoding = false;
+	}
+	more = decode_and_add_blocks(b, dec, max);
+	if (restarted)
+		reset_cursors(b);
+	return more;
+}
+
+static bool buffer_has_mapped_blocks(struct buffer *b)
+{
+	struct block *blk;
+
+	list_for_each_entry(blk, &b->blocks, node) {
+		if (blk->mapped)
+			return true;
+	}
+	return false;
+}
+
+// copy mapped blocks to heap, needed before the file is truncated
+static void unmap_blocks(struct buffer *b)
+{
+	struct block *blk;
+
+	if (!b->map)
+		return;
+
+	list_for_each_entry(blk, &b->blocks, node) {
+		if (blk->mapped)
+			block_grow(b, blk, blk->size);
+	}
+	munmap(b->map, b->map_size);
+	b->map = NULL;
+}
+
+static void free_loader(struct buffer *b, struct file_loader *l)
+{
+	if (l->dec)
+		free_file_decoder(l->dec);
+	if (l->buf == b->map) {
+		// freed in free_buffer()
+	} else if (l->mapped) {
+		munmap(l->buf, l->size);
+	} else {
+		free(l->buf);
+	}
+	free(l);
+}
+
+static void end_loading(struct buffer *b)
+{
+	struct file_loader *l = b->loader;
+
+	if (b->map && !buffer_has_mapped_blocks(b))
+		b->map = NULL;
+	free_loader(b, l);
+	b->loader = NULL;
+
+	if (list_empty(&b->blocks)) {
+		block_add_tail(&b->blocks, block_new(b, 1));
+	} else {
+		// Incomplete lines are not allowed because they are
+		// special cases and cause lots of trouble.
+		struct block *blk = BLOCK(b->blocks.prev);
+		if (blk->size && blk->data[blk->size - 1] != '\n') {
+			block_grow(b, blk, blk->size + 1);
+			blk->data[blk->size++] = '\n';
+			blk->nl++;
+			b->nl++;
+			block_tree_update(blk);
+		}
+	}
+	journal_loaded(b);
+}
+
+void continue_loading(struct buffer *b)
+{
+	struct file_loader *l = b->loader;
+
+	if (l == NULL)
+		return;
+	if (!load_step(b, l, b->huge ? HUGE_STEP_SIZE : LOAD_STEP_SIZE))
+		end_loading(b);
+}
+
+void finish_loading(struct buffer *b)
+{
+	struct file_loader *l = b->loader;
+
+	if (l == NULL)
+		return;
+	load_step(b, l, l->size);
+	end_loading(b);
+}
+
+// load at least nr lines if the file has that many
+void load_lines(struct buffer *b, long nr)
+{
+	while (b->loader && b->nl < nr)
+		continue_loading(b);
+}
+
+// called from free_buffer()
+void cancel_loading(struct buffer *b)
+{
+	if (b->loader) {
+		free_loader(b, b->loader);
+		b->loader = NULL;
+	}
+}
+
+int loading_progress(struct buffer *b)
+{
+	struct file_loader *l = b->loader;
+
+	if (l->dec == NULL)
+		return l->pos * 100 / l->size;
+	return l->dec->ipos * 100 / l->dec->isize;
 }
 
 static int read_blocks(struct buffer *b, int fd)
@@ -122,11 +507,13 @@ static int read_blocks(struct buffer *b, int fd)
 	unsigned long map_size = 64 * 1024;
 	unsigned char *buf = NULL;
 	bool mapped = false;
+	struct file_loader *l;
+	const char *e;
 	ssize_t rc;
 
 	// st_size is zero for some files in /proc.
 	// Can't mmap files in /proc and /sys.
-	if (size >= map_size) {
+	if (size >= map_size || (b->huge && size)) {
 		// NOTE: size must be greater than 0
 		buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
 		if (buf == MAP_FAILED) {
@@ -135,6 +522,27 @@ static int read_blocks(struct buffer *b, int fd)
 			mapped = true;
 		}
 	}
+	if (mapped && (options.map_files || b->huge)) {
+		// blocks can point to the mapping
+		b->map = buf;
+		b->map_size = size;
+	}
+	if (b->huge && mapped) {
+		// contents are shown as is
+		l = xnew0(struct file_loader, 1);
+		l->buf = buf;
+		l->size = size;
+		l->mapped = true;
+		b->loader = l;
+		b->ro = true;
+		free(b->encoding);
+		b->encoding = xstrdup("UTF-8");
+		continue_loading(b);
+		return 0;
+	}
+	// small or special file, load normally
+	b->huge = false;
+
 	if (!mapped) {
 		ssize_t alloc = map_size;
 		ssize_t pos = 0;
@@ -156,13 +564,30 @@ static int read_blocks(struct buffer *b, int fd)
 		}
 		size = pos;
 	}
-	rc = decode_and_add_blocks(b, buf, size);
-	if (mapped) {
-		munmap(buf, size);
-	} else {
-		free(buf);
+
+	l = xnew0(struct file_loader, 1);
+	l->buf = buf;
+	l->size = size;
+	l->mapped = mapped;
+	l->dec = new_decoder(b, buf, size);
+	if (l->dec == NULL) {
+		free_loader(b, l);
+		return -1;
+	}
+	if (b->encoding == NULL) {
+		// only beginning of the file was validated, see detect() in decoder.c
+		e = l->dec->encoding;
+		b->encoding = xstrdup(e ? e : charset);
+		l->detect_encoding = l->dec->checked < l->dec->isize;
 	}
-	return rc;
+	b->loader = l;
+
+	// rest of a big file is loaded while waiting for input
+	if (options.incremental_load && size >= options.incremental_load * 1024L * 1024 && editor_status == EDITOR_RUNNING)
+		continue_loading(b);
+	else
+		finish_loading(b);
+	return 0;
 }
 
 int load_buffer(struct buffer *b, bool must_exist, const char *filename)
@@ -178,6 +603,7 @@ int load_buffer(struct buffer *b, bool must_exist, const char *filename)
 			error_msg("File %s does not exist.", filename);
 			return -1;
 		}
+		block_add_tail(&b->blocks, block_new(b, 1));
 	} else {
 		fstat(fd, &b->st);
 		if (!S_ISREG(b->st.st_mode)) {
@@ -193,23 +619,6 @@ int load_buffer(struct buffer *b, bool must_exist, const char *filename)
 		}
 		close(fd);
 	}
-	if (list_empty(&b->blocks)) {
-		struct block *blk = block_new(1);
-		list_add_before(&blk->node, &b->blocks);
-	} else {
-		// Incomplete lines are not allowed because they are
-		// special cases and cause lots of trouble.
-		struct block *blk = BLOCK(b->blocks.prev);
-		if (blk->size && blk->data[blk->size - 1] != '\n') {
-			if (blk->size == blk->alloc) {
-				blk->alloc = ROUND_UP(blk->size + 1, 64);
-				xrenew(blk->data, blk->alloc);
-			}
-			blk->data[blk->size++] = '\n';
-			blk->nl++;
-			b->nl++;
-		}
-	}
 
 	if (b->encoding == NULL)
 		b->encoding = xstrdup(charset);
@@ -240,6 +649,31 @@ static mode_t get_umask(void)
 	return old;
 }
 
+// write blocks that need no conversion straight from their data
+static ssize_t write_blocks(struct buffer *b, int fd)
+{
+	struct iovec iov[IOV_MAX];
+	ssize_t size = 0;
+	struct block *blk;
+	int n = 0;
+
+	list_for_each_entry(blk, &b->blocks, node) {
+		if (!blk->size)
+			continue;
+		iov[n].iov_base = blk->data;
+		iov[n].iov_len = blk->size;
+		size += blk->size;
+		if (++n == IOV_MAX) {
+			if (xwritev(fd, iov, n) < 0)
+				return -1;
+			n = 0;
+		}
+	}
+	if (n && xwritev(fd, iov, n) < 0)
+		return -1;
+	return size;
+}
+
 static int write_buffer(struct buffer *b, struct file_encoder *enc, const struct byte_order_mark *bom)
 {
 	ssize_t size = 0;
@@ -250,12 +684,20 @@ static int write_buffer(struct buffer *b, struct file_encoder *enc, const struct
 		if (xwrite(enc->fd, bom->bytes, size) < 0)
 			goto write_error;
 	}
-	list_for_each_entry(blk, &b->blocks, node) {
-		ssize_t rc = file_encoder_write(enc, blk->data, blk->size);
+	if (enc->cconv == NULL && enc->nls == NEWLINE_UNIX) {
+		ssize_t rc = write_blocks(b, enc->fd);
 
 		if (rc < 0)
 			goto write_error;
 		size += rc;
+	} else {
+		list_for_each_entry(blk, &b->blocks, node) {
+			ssize_t rc = file_encoder_write(enc, blk->data, blk->size);
+
+			if (rc < 0)
+				goto write_error;
+			size += rc;
+		}
 	}
 	if (enc->cconv != NULL && cconv_nr_errors(enc->cconv)) {
 		// any real error hides this message
@@ -273,11 +715,179 @@ write_error:
 	return -1;
 }
 
+// write b to fd and rename tmp to filename, fd is closed
+static int write_file(struct buffer *b, int fd, const char *tmp, const char *filename, const char *encoding, enum newline_sequence newline)
+{
+	struct file_encoder *enc = new_file_encoder(encoding, newline, fd);
+
+	if (enc == NULL) {
+		// this should never happen because encoding is validated early
+		error_msg("iconv_open: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (write_buffer(b, enc, get_bom_for_encoding(encoding))) {
+		close(fd);
+		goto error;
+	}
+	if (options.sync_save && fdatasync(fd)) {
+		error_msg("fdatasync failed: %s", strerror(errno));
+		close(fd);
+		goto error;
+	}
+	if (close(fd)) {
+		error_msg("Close failed: %s", strerror(errno));
+		goto error;
+	}
+	if (tmp != NULL && rename(tmp, filename)) {
+		error_msg("Rename failed: %s", strerror(errno));
+		goto error;
+	}
+	free_file_encoder(enc);
+	return 0;
+error:
+	free_file_encoder(enc);
+	return -1;
+}
+
+/*
+ * Child process writes a snapshot of the buffer made by fork() while
+ * the editor continues. Hash of the snapshot for the undo journal and
+ * error message of the child are read from a pipe.
+ */
+struct background_save {
+	struct buffer *b;
+	pid_t pid;
+	int fd;
+	char *tmp;
+	char *filename;
+};
+
+static PTR_ARRAY(background_saves);
+
+static bool start_background_save(struct buffer *b, int fd, char *tmp, const char *filename, const char *encoding, enum newline_sequence newline)
+{
+	struct background_save *s;
+	int p[2];
+	pid_t pid;
+
+	if (pipe_close_on_exec(p))
+		return false;
+	pid = fork();
+	if (pid < 0) {
+		close(p[0]);
+		close(p[1]);
+		return false;
+	}
+	if (pid == 0) {
+		// buffer may be edited before the save is finished
+		uint64_t hash = journal_hash(b);
+		int rc;
+
+		close(p[0]);
+		clear_error();
+		rc = write_file(b, fd, tmp, filename, encoding, newline);
+		// conversion warning is written even if saving succeeded
+		if (xwrite(p[1], &hash, sizeof(hash)) < 0 || xwrite(p[1], error_buf, strlen(error_buf)) < 0)
+			rc = -1;
+		_exit(rc ? 1 : 0);
+	}
+	close(p[1]);
+	close(fd);
+
+	s = xnew(struct background_save, 1);
+	s->b = b;
+	s->pid = pid;
+	s->fd = p[0];
+	s->tmp = tmp;
+	s->filename = xstrdup(filename);
+	ptr_array_add(&background_saves, s);
+	b->saving_change = b->cur_change;
+	return true;
+}
+
+static void end_background_save(struct background_save *s, int status)
+{
+	struct buffer *b = s->b;
+	char msg[sizeof(error_buf)];
+	uint64_t hash = 0;
+	ssize_t len = xread(s->fd, &hash, sizeof(hash));
+
+	if (len == sizeof(hash))
+		len = xread(s->fd, msg, sizeof(msg) - 1);
+	else
+		len = 0;
+	if (len < 0)
+		len = 0;
+	msg[len] = 0;
+	close(s->fd);
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		stat(s->filename, &b->st);
+		// saved state is lost if the change has been forgotten
+		if (b->saving_change) {
+			b->saved_change = b->saving_change;
+			journal_saved_hash(b, hash);
+		}
+		if (len)
+			error_msg("%s", msg);
+		else
+			info_msg("Saved %s.", buffer_filename(b));
+	} else {
+		unlink(s->tmp);
+		if (len)
+			error_msg("Saving %s failed: %s", s->filename, msg);
+		else
+			error_msg("Saving %s failed.", s->filename);
+	}
+	b->saving_change = NULL;
+	free(s->tmp);
+	free(s->filename);
+	free(s);
+}
+
+/*
+ * Report finished background saves of b, or of all buffers if b is
+ * NULL. Returns true if any save finished.
+ */
+bool finish_background_saves(struct buffer *b, bool wait)
+{
+	bool finished = false;
+	long i = 0;
+
+	while (i < background_saves.count) {
+		struct background_save *s = background_saves.ptrs[i];
+		int status = 0;
+		pid_t rc;
+
+		if (b && s->b != b) {
+			i++;
+			continue;
+		}
+		do {
+			rc = waitpid(s->pid, &status, wait ? 0 : WNOHANG);
+		} while (rc < 0 && errno == EINTR);
+		if (rc == 0) {
+			i++;
+			continue;
+		}
+		if (rc < 0)
+			status = 1;
+		ptr_array_remove_idx(&background_saves, i);
+		end_background_save(s, status);
+		finished = true;
+	}
+	return finished;
+}
+
+/*
+ * Returns 1 if the buffer is being saved in background, see
+ * finish_background_saves().
+ */
 int save_buffer(struct buffer *b, const char *filename, const char *encoding, enum newline_sequence newline)
 {
 	// try to use temporary file first, safer
 	char *tmp = tmp_filename(filename);
-	struct file_encoder *enc;
 	int fd;
 
 	if (tmp != NULL) {
@@ -306,6 +916,9 @@ int save_buffer(struct buffer *b, const char *filename, const char *encoding, en
 		// Overwrite the original file (if exists) directly.
 		// Ownership is preserved automatically if the file exists.
 		mode_t mode = b->st.st_mode;
+
+		// file is going to be truncated
+		unmap_blocks(b);
 		if (mode == 0) {
 			// New file.
 			mode = 0666 & ~get_umask();
@@ -315,34 +928,19 @@ int save_buffer(struct buffer *b, const char *filename, const char *encoding, en
 			error_msg("Error opening file: %s", strerror(errno));
 			return -1;
 		}
+	} else if (options.background_save) {
+		// parent would see mapped blocks change if the file was
+		// overwritten in place so only temporary file is used here
+		if (start_background_save(b, fd, tmp, filename, encoding, newline))
+			return 1;
 	}
 
-	enc = new_file_encoder(encoding, newline, fd);
-	if (enc == NULL) {
-		// this should never happen because encoding is validated early
-		error_msg("iconv_open: %s", strerror(errno));
-		close(fd);
-		goto error;
-	}
-	if (write_buffer(b, enc, get_bom_for_encoding(encoding))) {
-		close(fd);
-		goto error;
-	}
-	if (close(fd)) {
-		error_msg("Close failed: %s", strerror(errno));
-		goto error;
-	}
-	if (tmp != NULL && rename(tmp, filename)) {
-		error_msg("Rename failed: %s", strerror(errno));
+	if (write_file(b, fd, tmp, filename, encoding, newline))
 		goto error;
-	}
-	free_file_encoder(enc);
 	free(tmp);
 	stat(filename, &b->st);
 	return 0;
 error:
-	if (enc != NULL)
-		free_file_encoder(enc);
 	if (tmp != NULL) {
 		unlink(tmp);
 		free(tmp);
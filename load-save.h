@@ -4,6 +4,12 @@
 #include "buffer.h"
 
 int load_buffer(struct buffer *b, bool must_exist, const char *filename);
+void continue_loading(struct buffer *b);
+void finish_loading(struct buffer *b);
+void load_lines(struct buffer *b, long nr);
+void cancel_loading(struct buffer *b);
+int loading_progress(struct buffer *b);
 int save_buffer(struct buffer *b, const char *filename, const char *encoding, enum newline_sequence newline);
+bool finish_background_saves(struct buffer *b, bool wait);
 
 #endif
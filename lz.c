@@ -0,0 +1,151 @@
+#include "lz.h"
+#include "common.h"
+
+#include <inttypes.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static unsigned int hash4(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, long len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *lit, long lit_len, long offset, long match_len)
+{
+	unsigned char *token = op++;
+
+	if (lit_len >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, lit_len - 15);
+	} else {
+		*token = lit_len << 4;
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (!match_len)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	match_len -= MIN_MATCH;
+	if (match_len >= 15) {
+		*token |= 15;
+		op = put_length(op, match_len - 15);
+	} else {
+		*token |= match_len;
+	}
+	return op;
+}
+
+// worst case output size of a sequence
+static long sequence_size(long lit_len, long match_len)
+{
+	return 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+}
+
+/*
+ * Returns size of compressed data or -1 if it would not fit in max
+ * bytes.
+ */
+long lz_compress(const unsigned char *src, long size, unsigned char *dst, long max)
+{
+	const unsigned char *end = src + size;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	unsigned char *op = dst;
+	long table[1 << HASH_BITS];
+	int i;
+
+	for (i = 0; i < ARRAY_COUNT(table); i++)
+		table[i] = -1;
+
+	while (ip + MIN_MATCH <= end) {
+		unsigned int h = hash4(ip);
+		long ref = table[h];
+		const unsigned char *match;
+		long len;
+
+		table[h] = ip - src;
+		// src + ref is not a valid pointer if ref is -1
+		if (ref < 0 || ip - src - ref > MAX_OFFSET || memcmp(src + ref, ip, MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+		match = src + ref;
+
+		len = MIN_MATCH;
+		while (ip + len < end && match[len] == ip[len])
+			len++;
+
+		if (op - dst + sequence_size(ip - anchor, len) > max)
+			return -1;
+		op = put_sequence(op, anchor, ip - anchor, ip - match, len);
+		ip += len;
+		anchor = ip;
+	}
+
+	if (op - dst + sequence_size(end - anchor, 0) > max)
+		return -1;
+	op = put_sequence(op, anchor, end - anchor, 0, 0);
+	return op - dst;
+}
+
+static long get_length(const unsigned char **ipp, long len)
+{
+	const unsigned char *ip = *ipp;
+
+	if (len == 15) {
+		unsigned char b;
+
+		do {
+			b = *ip++;
+			len += b;
+		} while (b == 255);
+	}
+	*ipp = ip;
+	return len;
+}
+
+// size must be size of the original data
+void lz_decompress(const unsigned char *src, long zsize, unsigned char *dst, long size)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + zsize;
+	unsigned char *op = dst;
+
+	while (1) {
+		unsigned char token = *ip++;
+		long len = get_length(&ip, token >> 4);
+		const unsigned char *match;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break;
+
+		match = op - (ip[0] | ip[1] << 8);
+		ip += 2;
+		len = get_length(&ip, token & 15) + MIN_MATCH;
+
+		// match can overlap with output
+		while (len--)
+			*op++ = *match++;
+	}
+	BUG_ON(op != dst + size);
+}
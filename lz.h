@@ -0,0 +1,14 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+ * Small LZ77 codec for data that is rarely needed, like old undo
+ * history. Output is a series of sequences: a token byte with literal
+ * and match lengths, literals and a 16-bit offset of the match. Last
+ * sequence has only literals.
+ */
+
+long lz_compress(const unsigned char *src, long size, unsigned char *dst, long max);
+void lz_decompress(const unsigned char *src, long zsize, unsigned char *dst, long size);
+
+#endif
@@ -11,6 +11,11 @@
 #include "file-history.h"
 #include "search.h"
 #include "error.h"
+#include "newline.h"
+#include "utf8.h"
+#include "journal.h"
+#include "load-save.h"
+#include "event.h"
 
 #include <locale.h>
 #include <langinfo.h>
@@ -36,7 +41,7 @@ static const char *builtin_rc =
 // initialize builtin colors
 "hi\n"
 // must initialize string options
-"set statusline-left \" %f%s%m%r%s%M\"\n"
+"set statusline-left \" %f%s%m%r%s%L%s%M\"\n"
 "set statusline-right \" %y,%X   %u   %E %n %t   %p \"\n";
 
 static void handle_sigtstp(int signum)
@@ -55,6 +60,13 @@ static void handle_sigcont(int signum)
 static void handle_sigwinch(int signum)
 {
 	resized = true;
+	wake_up_events();
+}
+
+static void handle_sigchld(int signum)
+{
+	// finished background save is reported immediately
+	wake_up_events();
 }
 
 static void record_file_history(void)
@@ -146,6 +158,9 @@ int main(int argc, char *argv[])
 	mkdir(editor_dir, 0755);
 	free(editor_dir);
 
+	select_newline_kernel();
+	select_utf8_kernel();
+
 	setlocale(LC_CTYPE, "");
 	charset = nl_langinfo(CODESET);
 	if (streq(charset, "UTF-8"))
@@ -189,8 +204,10 @@ int main(int argc, char *argv[])
 	 */
 	set_signal_handler(SIGTSTP, handle_sigtstp);
 
+	init_events();
 	set_signal_handler(SIGCONT, handle_sigcont);
 	set_signal_handler(SIGWINCH, handle_sigwinch);
+	set_signal_handler(SIGCHLD, handle_sigchld);
 
 	load_file_history();
 	command_history_filename = editor_file("command-history");
@@ -231,6 +248,8 @@ int main(int argc, char *argv[])
 	resize();
 	main_loop();
 	ui_end();
+	finish_background_saves(NULL, true);
+	sync_journals();
 	history_save(&command_history, command_history_filename);
 	history_save(&search_history, search_history_filename);
 	free(command_history_filename);
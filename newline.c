@@ -0,0 +1,333 @@
+#include "newline.h"
+#include "common.h"
+
+#include <inttypes.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+static inline unsigned int count_nl_word(uint64_t w)
+{
+	const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t x = w ^ 0x0a0a0a0a0a0a0a0aULL;
+
+	// high bit of a byte is set if the byte was '\n'
+	x = ~(((x & lo7) + lo7) | x | lo7);
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x >>= 7;
+	return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+// counts 8 bytes at a time
+static long scalar_count(const char *buf, long size)
+{
+	long i = 0, nl = 0;
+
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, buf + i, 8);
+		nl += count_nl_word(w);
+	}
+	for (; i < size; i++) {
+		if (buf[i] == '\n')
+			nl++;
+	}
+	return nl;
+}
+
+static long scalar_copy_count(char *dst, const char *src, long size)
+{
+	long i = 0, nl = 0;
+
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, src + i, 8);
+		memcpy(dst + i, &w, 8);
+		nl += count_nl_word(w);
+	}
+	for (; i < size; i++) {
+		dst[i] = src[i];
+		if (src[i] == '\n')
+			nl++;
+	}
+	return nl;
+}
+
+static const char *scalar_find_nth(const char *buf, long size, long *np)
+{
+	const char *end = buf + size;
+	long n = *np;
+
+	while (buf < end) {
+		buf = memchr(buf, '\n', end - buf);
+		if (!buf)
+			break;
+		if (--n == 0)
+			return buf;
+		buf++;
+	}
+	*np = n;
+	return NULL;
+}
+
+static bool scalar_supported(void)
+{
+	return true;
+}
+
+static const struct newline_kernel scalar_kernel = {
+	.name = "scalar",
+	.supported = scalar_supported,
+	.count = scalar_count,
+	.copy_count = scalar_copy_count,
+	.find_nth = scalar_find_nth,
+};
+
+#if HAVE_X86_KERNELS
+
+// clear lowest n - 1 set bits, return index of the lowest remaining one
+static inline unsigned int nth_bit(unsigned int mask, long n)
+{
+	while (--n)
+		mask &= mask - 1;
+	return __builtin_ctz(mask);
+}
+
+/*
+ * Matches are accumulated to byte counters which are summed using psadbw
+ * every 255 iterations before they can overflow.
+ */
+__attribute__((target("sse2")))
+static long sse2_count(const char *buf, long size)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	long i = 0, count = 0;
+
+	while (i + 16 <= size) {
+		__m128i acc = _mm_setzero_si128();
+		long end = i + 255 * 16;
+
+		if (end > size)
+			end = size;
+		for (; i + 16 <= end; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+		}
+		acc = _mm_sad_epu8(acc, zero);
+		count += _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+	}
+	return count + scalar_count(buf + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static long sse2_copy_count(char *dst, const char *src, long size)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	long i = 0, count = 0;
+
+	while (i + 16 <= size) {
+		__m128i acc = _mm_setzero_si128();
+		long end = i + 255 * 16;
+
+		if (end > size)
+			end = size;
+		for (; i + 16 <= end; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i), v);
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+		}
+		acc = _mm_sad_epu8(acc, zero);
+		count += _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+	}
+	return count + scalar_copy_count(dst + i, src + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static const char *sse2_find_nth(const char *buf, long size, long *np)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	long i, n = *np;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		long c;
+
+		if (!mask)
+			continue;
+		c = __builtin_popcount(mask);
+		if (c < n) {
+			n -= c;
+			continue;
+		}
+		return buf + i + nth_bit(mask, n);
+	}
+	*np = n;
+	return scalar_find_nth(buf + i, size - i, np);
+}
+
+static bool sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static const struct newline_kernel sse2_kernel = {
+	.name = "sse2",
+	.supported = sse2_supported,
+	.count = sse2_count,
+	.copy_count = sse2_copy_count,
+	.find_nth = sse2_find_nth,
+};
+
+__attribute__((target("avx2")))
+static long avx2_sum(__m256i acc)
+{
+	__m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+
+	return _mm_cvtsi128_si32(s) + _mm_extract_epi16(s, 4);
+}
+
+__attribute__((target("avx2")))
+static long avx2_count(const char *buf, long size)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	long i = 0, count = 0;
+
+	while (i + 32 <= size) {
+		__m256i acc = _mm256_setzero_si256();
+		long end = i + 255 * 32;
+
+		if (end > size)
+			end = size;
+		for (; i + 32 <= end; i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+		}
+		count += avx2_sum(acc);
+	}
+	return count + sse2_count(buf + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static long avx2_copy_count(char *dst, const char *src, long size)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	long i = 0, count = 0;
+
+	while (i + 32 <= size) {
+		__m256i acc = _mm256_setzero_si256();
+		long end = i + 255 * 32;
+
+		if (end > size)
+			end = size;
+		for (; i + 32 <= end; i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+			_mm256_storeu_si256((__m256i *)(dst + i), v);
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+		}
+		count += avx2_sum(acc);
+	}
+	return count + sse2_copy_count(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char *avx2_find_nth(const char *buf, long size, long *np)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	long i, n = *np;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		long c;
+
+		if (!mask)
+			continue;
+		c = __builtin_popcount(mask);
+		if (c < n) {
+			n -= c;
+			continue;
+		}
+		return buf + i + nth_bit(mask, n);
+	}
+	*np = n;
+	return sse2_find_nth(buf + i, size - i, np);
+}
+
+static bool avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+static const struct newline_kernel avx2_kernel = {
+	.name = "avx2",
+	.supported = avx2_supported,
+	.count = avx2_count,
+	.copy_count = avx2_copy_count,
+	.find_nth = avx2_find_nth,
+};
+
+#endif
+
+// best first
+const struct newline_kernel *const newline_kernels[] = {
+#if HAVE_X86_KERNELS
+	&avx2_kernel,
+	&sse2_kernel,
+#endif
+	&scalar_kernel,
+	NULL
+};
+
+const struct newline_kernel *newline_kernel = &scalar_kernel;
+
+/*
+ * Length of whole lines at beginning of buf, at most max bytes if
+ * possible. Returns 0 if buf does not contain a newline.
+ */
+long whole_lines(const char *buf, long size, long max)
+{
+	const char *nl;
+	long i;
+
+	if (max > size)
+		max = size;
+	for (i = max; i > 0; i--) {
+		if (buf[i - 1] == '\n')
+			return i;
+	}
+
+	// very long line
+	nl = memchr(buf + max, '\n', size - max);
+	if (nl)
+		return nl + 1 - buf;
+	return 0;
+}
+
+void select_newline_kernel(void)
+{
+	int i;
+
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+#endif
+	for (i = 0; newline_kernels[i]; i++) {
+		if (newline_kernels[i]->supported()) {
+			newline_kernel = newline_kernels[i];
+			break;
+		}
+	}
+	d_print("%s\n", newline_kernel->name);
+}
@@ -0,0 +1,46 @@
+#ifndef NEWLINE_H
+#define NEWLINE_H
+
+#include "libc.h"
+
+/*
+ * Newline scanning is hot when loading files, editing and calculating
+ * cursor position. Best implementation for the CPU is selected at startup
+ * by select_newline_kernel(). Scalar implementation is used until then.
+ */
+struct newline_kernel {
+	const char *name;
+	bool (*supported)(void);
+	long (*count)(const char *buf, long size);
+	long (*copy_count)(char *dst, const char *src, long size);
+	const char *(*find_nth)(const char *buf, long size, long *np);
+};
+
+extern const struct newline_kernel *newline_kernel;
+extern const struct newline_kernel *const newline_kernels[];
+
+void select_newline_kernel(void);
+long whole_lines(const char *buf, long size, long max);
+
+static inline long count_nl(const char *buf, long size)
+{
+	return newline_kernel->count(buf, size);
+}
+
+// like memcpy() but also returns number of newlines copied
+static inline long copy_count_nl(char *dst, const char *src, long size)
+{
+	return newline_kernel->copy_count(dst, src, size);
+}
+
+/*
+ * Returns pointer to *np:th newline in buf (*np > 0). If there are not
+ * that many newlines NULL is returned and *np is decremented by number of
+ * newlines found.
+ */
+static inline const char *find_nth_nl(const char *buf, long size, long *np)
+{
+	return newline_kernel->find_nth(buf, size, np);
+}
+
+#endif
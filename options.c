@@ -20,18 +20,26 @@ struct global_options options = {
 	.text_width = 72,
 	.ws_error = WSE_SPECIAL,
 
+	.auto_reload = 1,
+	.background_save = 0,
 	.case_sensitive_search = CSS_TRUE,
+	.compress_undo = 1,
 	.display_special = 0,
 	.esc_timeout = 100,
+	.incremental_load = 16,
 	.lock_files = 1,
+	.map_files = 0,
 	.newline = NEWLINE_UNIX,
 	.scroll_margin = 0,
 	.show_line_numbers = 0,
 	.show_tab_bar = 1,
 	.statusline_left = NULL,
 	.statusline_right = NULL,
+	.sync_save = 0,
 	.tab_bar_max_components = 0,
 	.tab_bar_width = 25,
+	.undo_journal = 0,
+	.undo_size = 256,
 	.vertical_tab_bar = 0,
 };
 
@@ -160,7 +168,7 @@ static void syntax_changed(void)
 
 static bool validate_statusline_format(const char *value)
 {
-	static const char chars[] = "fmryYxXpEMnstu%";
+	static const char chars[] = "fmrLByYxXpEMnstu%";
 	int i = 0;
 
 	while (value[i]) {
@@ -388,29 +396,37 @@ static const char *detect_indent_values[] = { "1", "2", "3", "4", "5", "6", "7",
 
 static const struct option_desc option_desc[] = {
 	BOOL_OPT("auto-indent", C(auto_indent), NULL),
+	BOOL_OPT("auto-reload", G(auto_reload), NULL),
+	BOOL_OPT("background-save", G(background_save), NULL),
 	BOOL_OPT("brace-indent", L(brace_indent), NULL),
 	ENUM_OPT("case-sensitive-search", G(case_sensitive_search), case_sensitive_search_enum, NULL),
 	FLAG_OPT("detect-indent", C(detect_indent), detect_indent_values, NULL),
+	BOOL_OPT("compress-undo", G(compress_undo), NULL),
 	BOOL_OPT("display-special", G(display_special), NULL),
 	BOOL_OPT("emulate-tab", C(emulate_tab), NULL),
 	INT_OPT("esc-timeout", G(esc_timeout), 0, 2000, NULL),
 	BOOL_OPT("expand-tab", C(expand_tab), NULL),
 	BOOL_OPT("file-history", C(file_history), NULL),
 	STR_OPT("filetype", L(filetype), validate_filetype, filetype_changed),
+	INT_OPT("incremental-load", G(incremental_load), 0, 1000000, NULL),
 	INT_OPT("indent-width", C(indent_width), 1, 8, NULL),
 	STR_OPT("indent-regex", L(indent_regex), validate_regex, NULL),
 	BOOL_OPT("lock-files", G(lock_files), NULL),
+	BOOL_OPT("map-files", G(map_files), NULL),
 	ENUM_OPT("newline", G(newline), newline_enum, NULL),
 	INT_OPT("scroll-margin", G(scroll_margin), 0, 100, NULL),
 	BOOL_OPT("show-line-numbers", G(show_line_numbers), NULL),
 	BOOL_OPT("show-tab-bar", G(show_tab_bar), NULL),
 	STR_OPT("statusline-left", G(statusline_left), validate_statusline_format, NULL),
 	STR_OPT("statusline-right", G(statusline_right), validate_statusline_format, NULL),
+	BOOL_OPT("sync-save", G(sync_save), NULL),
 	BOOL_OPT("syntax", C(syntax), syntax_changed),
 	INT_OPT("tab-bar-max-components", G(tab_bar_max_components), 0, 10, NULL),
 	INT_OPT("tab-bar-width", G(tab_bar_width), TAB_BAR_MIN_WIDTH, 100, NULL),
 	INT_OPT("tab-width", C(tab_width), 1, 8, NULL),
 	INT_OPT("text-width", C(text_width), 1, 1000, NULL),
+	BOOL_OPT("undo-journal", G(undo_journal), NULL),
+	INT_OPT("undo-size", G(undo_size), 0, 1000000, NULL),
 	BOOL_OPT("vertical-tab-bar", G(vertical_tab_bar), NULL),
 	FLAG_OPT("ws-error", C(ws_error), ws_error_values, NULL),
 };
@@ -85,18 +85,26 @@ struct global_options {
 	int ws_error;
 
 	/* only global */
+	int auto_reload;
+	int background_save;
 	enum case_sensitive_search case_sensitive_search;
+	int compress_undo;
 	int display_special;
 	int esc_timeout;
+	int incremental_load;
 	int lock_files;
+	int map_files;
 	enum newline_sequence newline; // default value for new files
 	int scroll_margin;
 	int show_line_numbers;
 	int show_tab_bar;
 	char *statusline_left;
 	char *statusline_right;
+	int sync_save;
 	int tab_bar_max_components;
 	int tab_bar_width;
+	int undo_journal;
+	int undo_size;
 	int vertical_tab_bar;
 };
 
@@ -5,6 +5,9 @@
 #include "selection.h"
 #include "hl.h"
 
+// longer highlighting is left to the background, see highlight_in_background()
+#define HL_FILL_MS 30
+
 struct line_info {
 	struct view *view;
 	long line_nr;
@@ -17,9 +20,20 @@ struct line_info {
 	long pos;
 	long indent_size;
 	long trailing_ws_offset;
-	struct hl_color **colors;
+
+	// syntax highlighting, span is index of span at or before pos
+	const struct hl_span *spans;
+	int nr_spans;
+	int span;
+
+	// notice words inside comments, see hl_words()
+	int nr_notices;
+	int notice;
 };
 
+static struct hl_span *notices;
+static int notices_alloc;
+
 static bool is_default_bg_color(int color)
 {
 	return color == builtin_colors[BC_DEFAULT]->bg || color < 0;
@@ -120,10 +134,29 @@ static bool whitespace_error(struct line_info *info, unsigned int u, long i)
 	return false;
 }
 
+// pos must not be less than in previous call
+static struct hl_color *get_hl_color(struct line_info *info, long pos)
+{
+	const struct hl_span *s;
+
+	if (info->nr_spans == 0)
+		return NULL;
+	while (info->notice < info->nr_notices && notices[info->notice].start + notices[info->notice].len <= pos)
+		info->notice++;
+	if (info->notice < info->nr_notices && notices[info->notice].start <= pos)
+		return notices[info->notice].color;
+
+	s = &info->spans[info->span];
+	while (s->start + s->len <= pos && info->span + 1 < info->nr_spans)
+		s = &info->spans[++info->span];
+	return s->color;
+}
+
 static unsigned int screen_next_char(struct line_info *info)
 {
 	long count, pos = info->pos;
 	unsigned int u = info->line[pos];
+	struct hl_color *hl_color;
 	struct term_color color;
 	bool ws_error = false;
 
@@ -141,8 +174,9 @@ static unsigned int screen_next_char(struct line_info *info)
 			ws_error = true;
 	}
 
-	if (info->colors && info->colors[pos]) {
-		color = info->colors[pos]->color;
+	hl_color = get_hl_color(info, pos);
+	if (hl_color) {
+		color = hl_color->color;
 	} else {
 		color = *builtin_colors[BC_DEFAULT];
 	}
@@ -194,42 +228,78 @@ static bool is_notice(const char *word, int len)
 	return false;
 }
 
+static void add_notice(struct line_info *info, long start, long len, struct hl_color *color)
+{
+	struct hl_span *n;
+
+	if (info->nr_notices == notices_alloc) {
+		notices_alloc = notices_alloc * 2 + 8;
+		xrenew(notices, notices_alloc);
+	}
+	n = &notices[info->nr_notices++];
+	n->start = start;
+	n->len = len;
+	n->color = color;
+}
+
 // highlight certain words inside comments
 static void hl_words(struct line_info *info)
 {
 	struct hl_color *cc = find_color("comment");
 	struct hl_color *nc = find_color("notice");
-	int i, j, si, max;
+	long pos = info->pos, max;
+	int i;
 
-	if (info->colors == NULL || cc == NULL || nc == NULL)
+	info->nr_notices = 0;
+	info->notice = 0;
+	if (info->nr_spans == 0 || cc == NULL || nc == NULL)
 		return;
-
-	i = info->pos;
-	if (i >= info->size)
+	if (pos >= info->size)
 		return;
 
-	// go to beginning of partially visible word inside comment
-	while (i > 0 && info->colors[i] == cc && is_word_byte(info->line[i]))
-		i--;
-
 	// This should be more than enough. I'm too lazy to iterate characters
 	// instead of bytes and calculate text width.
-	max = info->pos + screen_w * 4 + 8;
+	max = pos + screen_w * 4 + 8;
 
-	while (i < info->size) {
-		if (info->colors[i] != cc || !is_word_byte(info->line[i])) {
-			if (i > max)
-				break;
-			i++;
-		} else {
-			// beginning of a word inside comment
-			si = i++;
-			while (i < info->size && info->colors[i] == cc && is_word_byte(info->line[i]))
-				i++;
-			if (is_notice(info->line + si, i - si)) {
-				for (j = si; j < i; j++)
-					info->colors[j] = nc;
+	// spans before pos are invisible
+	while (info->spans[info->span].start + info->spans[info->span].len <= pos)
+		info->span++;
+
+	// words can't cross spans because consecutive spans have different colors
+	for (i = info->span; i < info->nr_spans; i++) {
+		const struct hl_span *s = &info->spans[i];
+		long j = s->start;
+		long end = s->start + s->len;
+
+		if (j > max)
+			break;
+		if (s->color != cc)
+			continue;
+		if (end > info->size)
+			end = info->size;
+		if (j < pos && is_word_byte(info->line[pos])) {
+			// beginning of partially visible word
+			j = pos;
+			while (j > s->start && is_word_byte(info->line[j - 1]))
+				j--;
+		} else if (j < pos) {
+			j = pos;
+		}
+
+		while (j < end) {
+			long si;
+
+			if (!is_word_byte(info->line[j])) {
+				if (j > max)
+					break;
+				j++;
+				continue;
 			}
+			si = j++;
+			while (j < end && is_word_byte(info->line[j]))
+				j++;
+			if (is_notice(info->line + si, j - si))
+				add_notice(info, si, j - si, nc);
 		}
 	}
 }
@@ -258,7 +328,7 @@ static void line_info_init(struct line_info *info, struct view *v, struct block_
 	}
 }
 
-static void line_info_set_line(struct line_info *info, struct lineref *lr, struct hl_color **colors)
+static void line_info_set_line(struct line_info *info, struct lineref *lr, const struct hl_span *spans, int nr_spans)
 {
 	int i;
 
@@ -268,7 +338,9 @@ static void line_info_set_line(struct line_info *info, struct lineref *lr, struc
 	info->line = lr->line;
 	info->size = lr->size - 1;
 	info->pos = 0;
-	info->colors = colors;
+	info->spans = spans;
+	info->nr_spans = nr_spans;
+	info->span = 0;
 
 	for (i = 0; i < info->size; i++) {
 		char ch = info->line[i];
@@ -332,7 +404,8 @@ void update_range(struct view *v, int y1, int y2)
 {
 	struct line_info info;
 	struct block_iter bi = v->cursor;
-	int i, got_line;
+	struct state *state = NULL;
+	int i, got_line, provisional;
 
 	buf_reset(v->window->edit_x, v->window->edit_w, v->vx);
 	obuf.tab_width = v->buffer->options.tab_width;
@@ -350,18 +423,29 @@ void update_range(struct view *v, int y1, int y2)
 	y2 -= v->vy;
 
 	got_line = !block_iter_is_eof(&bi);
-	hl_fill_start_states(v->buffer, info.line_nr);
+	provisional = !hl_fill_start_states(v->buffer, info.line_nr, HL_FILL_MS);
+	if (provisional) {
+		// rest is highlighted in background and then redrawn
+		v->buffer->hl_pending = true;
+		v->buffer->hl_provisional = true;
+		state = hl_guess_start_state(v->buffer, info.line_nr);
+	}
 	for (i = y1; got_line && i < y2; i++) {
 		struct lineref lr;
-		struct hl_color **colors;
-		int next_changed;
+		struct hl_span *spans;
+		int nr_spans, next_changed;
 
 		obuf.x = 0;
 		buf_move_cursor(v->window->edit_x, v->window->edit_y + i);
 
 		fill_line_nl_ref(&bi, &lr);
-		colors = hl_line(v->buffer, lr.line, lr.size, info.line_nr, &next_changed);
-		line_info_set_line(&info, &lr, colors);
+		if (provisional) {
+			spans = hl_guess_line(v->buffer, lr.line, lr.size, &state, &nr_spans);
+			next_changed = 0;
+		} else {
+			spans = hl_line(v->buffer, lr.line, lr.size, info.line_nr, &nr_spans, &next_changed);
+		}
+		line_info_set_line(&info, &lr, spans, nr_spans);
 		print_line(&info);
 
 		got_line = block_iter_next_line(&bi);
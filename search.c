@@ -8,9 +8,22 @@
 #include "gbuf.h"
 #include "regexp.h"
 #include "selection.h"
+#include "block.h"
+#include "load-save.h"
 
 #define MAX_SUBSTRINGS 32
 
+// rest of a file that is still being loaded is searched too
+static bool next_line(struct block_iter *bi)
+{
+	while (!block_iter_next_line(bi)) {
+		if (!buffer->loader)
+			return false;
+		continue_loading(buffer);
+	}
+	return true;
+}
+
 static bool do_search_fwd(regex_t *regex, struct block_iter *bi, bool skip)
 {
 	int flags = block_iter_is_bol(bi) ? 0 : REG_NOTBOL;
@@ -49,7 +62,7 @@ static bool do_search_fwd(regex_t *regex, struct block_iter *bi, bool skip)
 		}
 		skip = false; // not at cursor position anymore
 		flags = 0;
-	} while (block_iter_next_line(bi));
+	} while (next_line(bi));
 	return false;
 }
 
@@ -223,6 +236,8 @@ static void do_search_next(bool skip)
 		if (do_search_bwd(&current_search.regex, &bi, cursor_x, skip))
 			return;
 
+		// wrapping to the bottom needs the whole file
+		finish_loading(buffer);
 		block_iter_eof(&bi);
 		if (do_search_bwd(&current_search.regex, &bi, -1, false)) {
 			info_msg("Continuing at bottom.");
@@ -367,6 +382,57 @@ out:
 	return nr;
 }
 
+// replacements collected by replace_all_on_line()
+struct replace_all {
+	struct gbuf hunks;
+	// end of the previous match
+	long end;
+	// size of replaced text minus size of matched text
+	long diff;
+};
+
+static int replace_all_on_line(struct replace_all *ra, struct lineref *lr, long offset,
+	regex_t *re, const char *format, unsigned int flags)
+{
+	const char *buf = (const char *)lr->line;
+	regmatch_t m[MAX_SUBSTRINGS];
+	size_t pos = 0;
+	int eflags = 0;
+	int nr = 0;
+
+	while (regexp_exec(re, buf + pos, lr->size - pos, MAX_SUBSTRINGS, m, eflags)) {
+		long match_len = m[0].rm_eo - m[0].rm_so;
+		long match_offset = offset + pos + m[0].rm_so;
+		char *str = build_replace(buf + pos, format, m);
+		long nr_insert = strlen(str);
+
+		if (match_len || nr_insert) {
+			if (!ra->hunks.len) {
+				// first hunk starts at cursor
+				block_iter_goto_offset(&view->cursor, match_offset);
+				ra->end = match_offset;
+			}
+			add_hunk(&ra->hunks, match_offset - ra->end, match_len, str, nr_insert);
+			ra->end = match_offset + match_len;
+			ra->diff += nr_insert - match_len;
+		}
+		free(str);
+		nr++;
+
+		if (!match_len)
+			break;
+
+		if (!(flags & REPLACE_GLOBAL))
+			break;
+
+		pos += m[0].rm_so + match_len;
+
+		/* don't match beginning of line again */
+		eflags = REG_NOTBOL;
+	}
+	return nr;
+}
+
 void reg_replace(const char *pattern, const char *format, unsigned int flags)
 {
 	BLOCK_ITER(bi, &buffer->blocks);
@@ -387,6 +453,10 @@ void reg_replace(const char *pattern, const char *format, unsigned int flags)
 			return;
 	}
 
+	// range ends at the real end of file, not at the loaded part
+	finish_loading(buffer);
+	block_iter_bof(&bi);
+
 	if (view->selection) {
 		struct selection_info info;
 		init_selection(view, &info);
@@ -402,39 +472,75 @@ void reg_replace(const char *pattern, const char *format, unsigned int flags)
 		nr_bytes = block_iter_get_offset(&eof);
 	}
 
-	/* record multiple changes as one chain only when replacing all */
-	if (!(flags & REPLACE_CONFIRM))
-		begin_change_chain();
+	if (flags & REPLACE_CONFIRM) {
+		while (1) {
+			// number of bytes to process
+			long count;
+			struct lineref lr;
+			int nr;
+
+			fill_line_ref(&bi, &lr);
+			count = lr.size;
+			if (lr.size > nr_bytes) {
+				// end of selection is not full line
+				lr.size = nr_bytes;
+			}
 
-	while (1) {
-		// number of bytes to process
-		long count;
-		struct lineref lr;
-		int nr;
+			nr = replace_on_line(&lr, &re, format, &bi, &flags);
+			if (nr) {
+				nr_substitutions += nr;
+				nr_lines++;
+			}
+			if (flags & REPLACE_CANCEL)
+				break;
+			if (count + 1 >= nr_bytes)
+				break;
+			nr_bytes -= count + 1;
 
-		fill_line_ref(&bi, &lr);
-		count = lr.size;
-		if (lr.size > nr_bytes) {
-			// end of selection is not full line
-			lr.size = nr_bytes;
+			BUG_ON(!block_iter_next_line(&bi));
 		}
 
-		nr = replace_on_line(&lr, &re, format, &bi, &flags);
-		if (nr) {
-			nr_substitutions += nr;
-			nr_lines++;
+		/* "a" answer started a change chain */
+		if (!(flags & REPLACE_CONFIRM))
+			end_change_chain();
+	} else {
+		/* collect all replacements and make them as one change */
+		struct replace_all ra = { GBUF_INIT, 0, 0 };
+		long offset = block_iter_get_offset(&bi);
+
+		while (1) {
+			long count;
+			struct lineref lr;
+			int nr;
+
+			fill_line_ref(&bi, &lr);
+			count = lr.size;
+			if (lr.size > nr_bytes)
+				lr.size = nr_bytes;
+
+			nr = replace_all_on_line(&ra, &lr, offset, &re, format, flags);
+			if (nr) {
+				nr_substitutions += nr;
+				nr_lines++;
+			}
+			if (count + 1 >= nr_bytes)
+				break;
+			nr_bytes -= count + 1;
+			offset += count + 1;
+
+			BUG_ON(!block_iter_next_line(&bi));
 		}
-		if (flags & REPLACE_CANCEL)
-			break;
-		if (count + 1 >= nr_bytes)
-			break;
-		nr_bytes -= count + 1;
 
-		BUG_ON(!block_iter_next_line(&bi));
-	}
+		if (ra.hunks.len) {
+			buffer_replace_hunks((const char *)ra.hunks.buffer, ra.hunks.len);
 
-	if (!(flags & REPLACE_CONFIRM))
-		end_change_chain();
+			/* move cursor after the last replaced text */
+			block_iter_goto_offset(&view->cursor, ra.end + ra.diff);
+			if (view->selection)
+				view->sel_eo += ra.diff;
+		}
+		gbuf_free(&ra.hunks);
+	}
 
 	regfree(&re);
 
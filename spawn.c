@@ -7,6 +7,7 @@
 #include "msg.h"
 #include "term.h"
 #include "fork.h"
+#include "event.h"
 
 static void handle_error_msg(struct compiler *c, char *str)
 {
@@ -62,75 +63,84 @@ static void read_errors(struct compiler *c, int fd, int quiet)
 	fclose(f);
 }
 
-static void filter(int rfd, int wfd, struct filter_data *fdata)
+struct filter_state {
+	struct filter_data *fdata;
+	struct gbuf buf;
+	long wlen;
+	int wfd;
+	bool done;
+};
+
+static void filter_read(int fd, short revents, void *data)
 {
-	unsigned int wlen = 0;
-	GBUF(buf);
-	int rc;
+	struct filter_state *s = data;
+	char buf[8192];
+	ssize_t rc = read(fd, buf, sizeof(buf));
 
-	if (!fdata->in_len) {
-		close(wfd);
-		wfd = -1;
+	if (rc < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		error_msg("read: %s", strerror(errno));
+		s->done = true;
+		return;
 	}
-	while (1) {
-		fd_set rfds, wfds;
-		fd_set *wfdsp = NULL;
-		int fd_high = rfd;
-
-		FD_ZERO(&rfds);
-		FD_SET(rfd, &rfds);
-
-		if (wfd >= 0) {
-			FD_ZERO(&wfds);
-			FD_SET(wfd, &wfds);
-			wfdsp = &wfds;
-		}
-		if (wfd > fd_high)
-			fd_high = wfd;
-
-		rc = select(fd_high + 1, &rfds, wfdsp, NULL, NULL);
-		if (rc < 0) {
-			if (errno == EINTR)
-				continue;
-			error_msg("select: %s", strerror(errno));
-			break;
-		}
+	if (!rc) {
+		if (s->wlen < s->fdata->in_len)
+			error_msg("Command did not read all data.");
+		s->done = true;
+		return;
+	}
+	gbuf_add_buf(&s->buf, buf, rc);
+}
 
-		if (FD_ISSET(rfd, &rfds)) {
-			char data[8192];
-
-			rc = read(rfd, data, sizeof(data));
-			if (rc < 0) {
-				error_msg("read: %s", strerror(errno));
-				break;
-			}
-			if (!rc) {
-				if (wlen < fdata->in_len)
-					error_msg("Command did not read all data.");
-				break;
-			}
-			gbuf_add_buf(&buf, data, rc);
-		}
-		if (wfdsp && FD_ISSET(wfd, &wfds)) {
-			rc = write(wfd, fdata->in + wlen, fdata->in_len - wlen);
-			if (rc < 0) {
-				error_msg("write: %s", strerror(errno));
-				break;
-			}
-			wlen += rc;
-			if (wlen == fdata->in_len) {
-				if (close(wfd)) {
-					error_msg("close: %s", strerror(errno));
-					break;
-				}
-				wfd = -1;
-			}
+static void filter_write(int fd, short revents, void *data)
+{
+	struct filter_state *s = data;
+	ssize_t rc = write(fd, s->fdata->in + s->wlen, s->fdata->in_len - s->wlen);
+
+	if (rc < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		error_msg("write: %s", strerror(errno));
+		s->done = true;
+		return;
+	}
+	s->wlen += rc;
+	if (s->wlen == s->fdata->in_len) {
+		remove_fd_handler(fd);
+		s->wfd = -1;
+		if (close(fd)) {
+			error_msg("close: %s", strerror(errno));
+			s->done = true;
 		}
 	}
+}
+
+// output is read while input is written, the pipes would fill up otherwise
+static void filter(int rfd, int wfd, struct filter_data *fdata)
+{
+	struct filter_state s = { fdata, GBUF_INIT, 0, wfd, false };
 
-	if (buf.len) {
-		fdata->out_len = buf.len;
-		fdata->out = gbuf_steal(&buf);
+	if (fdata->in_len) {
+		// never block writing while the command waits for us to read
+		fcntl(wfd, F_SETFL, O_NONBLOCK);
+		add_fd_handler(wfd, POLLOUT, filter_write, &s);
+	} else {
+		close(wfd);
+		s.wfd = -1;
+	}
+	add_fd_handler(rfd, POLLIN, filter_read, &s);
+	while (!s.done)
+		run_other_events();
+	remove_fd_handler(rfd);
+	if (s.wfd >= 0) {
+		remove_fd_handler(s.wfd);
+		close(s.wfd);
+	}
+
+	if (s.buf.len) {
+		fdata->out_len = s.buf.len;
+		fdata->out = gbuf_steal(&s.buf);
 	} else {
 		fdata->out_len = 0;
 		fdata->out = NULL;
@@ -192,9 +202,9 @@ int spawn_filter(char **argv, struct filter_data *data)
 	close(dev_null);
 	close(p0[0]);
 	close(p1[1]);
+	// closes p0[1]
 	filter(p1[0], p0[1], data);
 	close(p1[0]);
-	close(p0[1]);
 
 	if (handle_child_error(pid))
 		return -1;
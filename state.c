@@ -273,6 +273,15 @@ static void cmd_heredocend(const char *pf, char **args)
 	current_syntax->heredoc = true;
 }
 
+static bool in_string_chain(const struct hash_str *h, const struct hash_str *str)
+{
+	for (; h; h = h->next) {
+		if (h->len == str->len && !memcmp(h->str, str->str, str->len))
+			return true;
+	}
+	return false;
+}
+
 static void cmd_list(const char *pf, char **args)
 {
 	const char *name = args[0];
@@ -298,12 +307,20 @@ static void cmd_list(const char *pf, char **args)
 	for (i = 1; args[i]; i++) {
 		const char *str = args[i];
 		int len = strlen(str);
-		long idx = buf_hash(str, len) % ARRAY_COUNT(list->hash);
 		struct hash_str *h = xmalloc(sizeof(struct hash_str *) + sizeof(int) + len);
-		h->next = list->hash[idx];
+		int j;
+
 		h->len = len;
-		memcpy(h->str, str, len);
-		list->hash[idx] = h;
+		for (j = 0; j < len; j++)
+			h->str[j] = list->icase ? tolower(str[j]) : str[j];
+
+		// perfect hash needs unique strings
+		if (in_string_chain(list->strings, h)) {
+			free(h);
+			continue;
+		}
+		h->next = list->strings;
+		list->strings = h;
 	}
 }
 
@@ -7,17 +7,6 @@
 
 static PTR_ARRAY(syntaxes);
 
-unsigned int buf_hash(const char *str, unsigned int size)
-{
-	long i, hash = 0;
-
-	for (i = 0; i < size; i++) {
-		unsigned int ch = tolower(str[i]);
-		hash = (hash << 5) - hash + ch;
-	}
-	return hash;
-}
-
 struct string_list *find_string_list(struct syntax *syn, const char *name)
 {
 	int i;
@@ -113,6 +102,77 @@ static const char *get_prefix(void)
 
 static void update_state_colors(struct syntax *syn, struct state *s);
 
+// false if cond can't match when the current byte is ch
+static bool can_match(const struct condition *cond, unsigned char ch)
+{
+	char c = ch;
+
+	switch (cond->type) {
+	case COND_CHAR:
+	case COND_CHAR_BUFFER:
+		return cond->u.cond_char.bitmap[ch / 8] & 1 << (ch & 7);
+	case COND_STR:
+		return !cond->u.cond_str.len || cond->u.cond_str.str[0] == c;
+	case COND_STR_ICASE:
+		return !cond->u.cond_str.len || !strncasecmp(cond->u.cond_str.str, &c, 1);
+	case COND_STR2:
+		// same test as in highlight_line()
+		return ch == cond->u.cond_str.str[0];
+	case COND_HEREDOCEND:
+		return !cond->u.cond_heredocend.len || cond->u.cond_heredocend.str[0] == c;
+	default:
+		// bufis, inlist and recolor look at bytes before the current one
+		return true;
+	}
+}
+
+/*
+ * Build first byte dispatch table of a state. Bytes that have the same
+ * candidate conditions share the list. A char condition always matches
+ * when it is in the list so conditions after it are left out.
+ */
+static void compile_state(struct state *s)
+{
+	struct condition **list = xnew(struct condition *, s->conds.count + 1);
+	struct condition **pool = NULL;
+	long offsets[256];
+	long pool_len = 0;
+	int nr_lists = 0, ch, i;
+
+	for (ch = 0; ch < 256; ch++) {
+		int len = 0;
+
+		for (i = 0; i < s->conds.count; i++) {
+			struct condition *c = s->conds.ptrs[i];
+
+			if (!can_match(c, ch))
+				continue;
+			list[len++] = c;
+			if (c->type == COND_CHAR || c->type == COND_CHAR_BUFFER)
+				break;
+		}
+		list[len++] = NULL;
+
+		for (i = 0; i < nr_lists; i++) {
+			if (offsets[i] + len <= pool_len && !memcmp(pool + offsets[i], list, len * sizeof(*list)))
+				break;
+		}
+		if (i == nr_lists) {
+			xrenew(pool, pool_len + len);
+			memcpy(pool + pool_len, list, len * sizeof(*list));
+			offsets[nr_lists++] = pool_len;
+			pool_len += len;
+		}
+		s->dispatch[ch] = i;
+	}
+
+	// first list is the start of the pool
+	s->cond_lists = xnew(struct condition **, nr_lists);
+	for (i = 0; i < nr_lists; i++)
+		s->cond_lists[i] = pool + offsets[i];
+	free(list);
+}
+
 struct state *merge_syntax(struct syntax *syn, struct syntax_merge *m)
 {
 	// NOTE: string_lists is owned by struct syntax so there's no need to
@@ -144,12 +204,15 @@ struct state *merge_syntax(struct syntax *syn, struct syntax_merge *m)
 
 		// Don't complain about unvisited copied states.
 		s->copied = true;
+
+		s->cond_lists = NULL;
 	}
 
 	for (i = old_count; i < states->count; i++) {
 		fix_conditions(syn, states->ptrs[i], m, prefix);
 		if (m->delim)
 			update_state_colors(syn, states->ptrs[i]);
+		compile_state(states->ptrs[i]);
 	}
 
 	m->subsyn->used = true;
@@ -188,22 +251,25 @@ static void free_state(struct state *s)
 	for (i = 0; i < s->conds.count; i++)
 		free_condition(s->conds.ptrs[i]);
 	free(s->conds.ptrs);
+	if (s->cond_lists) {
+		free(s->cond_lists[0]);
+		free(s->cond_lists);
+	}
 	free(s->a.emit_name);
 	free(s);
 }
 
 static void free_string_list(struct string_list *list)
 {
-	int i;
+	struct hash_str *h = list->strings;
 
-	for (i = 0; i < ARRAY_COUNT(list->hash); i++) {
-		struct hash_str *h = list->hash[i];
-		while (h) {
-			struct hash_str *next = h->next;
-			free(h);
-			h = next;
-		}
+	while (h) {
+		struct hash_str *next = h->next;
+		free(h);
+		h = next;
 	}
+	free(list->slots);
+	free(list->displacements);
 	free(list->name);
 	free(list);
 }
@@ -228,6 +294,105 @@ static void free_syntax(struct syntax *syn)
 	free(syn);
 }
 
+static bool place_bucket(struct string_list *list, struct hash_str **keys, const uint64_t *hashes, unsigned int count, unsigned int d)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		unsigned int slot = hash_slot(hashes[i], d, list->nr_slots);
+
+		if (list->slots[slot]) {
+			while (i-- > 0)
+				list->slots[hash_slot(hashes[i], d, list->nr_slots)] = NULL;
+			return false;
+		}
+		list->slots[slot] = keys[i];
+	}
+	return true;
+}
+
+static bool place_buckets(struct string_list *list, struct hash_str **keys, const uint64_t *hashes,
+	const unsigned int *starts, unsigned int max)
+{
+	unsigned int size, b, d;
+
+	// biggest buckets first while there are many free slots
+	for (size = max; size > 0; size--) {
+		for (b = 0; b < list->nr_buckets; b++) {
+			unsigned int start = starts[b];
+
+			if (starts[b + 1] - start != size)
+				continue;
+			for (d = 0; !place_bucket(list, keys + start, hashes + start, size, d); d++) {
+				if (d == 1 << 20)
+					return false;
+			}
+			list->displacements[b] = d;
+		}
+	}
+	return true;
+}
+
+/*
+ * Hash and displace: strings are divided to buckets by hash and then
+ * for each bucket a displacement is searched that puts all its strings
+ * to free slots. Strings in the list are unique so lookup needs to
+ * compare only one string.
+ */
+static void build_string_hash(struct string_list *list)
+{
+	unsigned int n = 0, max = 0, i, b;
+	unsigned int *starts;
+	struct hash_str **keys;
+	uint64_t *hashes;
+	struct hash_str *h;
+
+	for (h = list->strings; h; h = h->next) {
+		list->lengths |= length_bit(h->len);
+		n++;
+	}
+	list->nr_slots = 1;
+	while (list->nr_slots < n + n / 4 + 1)
+		list->nr_slots *= 2;
+	list->nr_buckets = n / 4 + 1;
+
+	// sort strings by bucket, icase strings are already lowercase
+	starts = xnew0(unsigned int, list->nr_buckets + 1);
+	keys = xnew0(struct hash_str *, n);
+	hashes = xnew(uint64_t, n);
+	for (h = list->strings; h; h = h->next)
+		starts[(string_hash(h->str, h->len, false) >> 32) % list->nr_buckets + 1]++;
+	for (b = 0; b < list->nr_buckets; b++) {
+		if (starts[b + 1] > max)
+			max = starts[b + 1];
+		starts[b + 1] += starts[b];
+	}
+	for (h = list->strings; h; h = h->next) {
+		uint64_t hash = string_hash(h->str, h->len, false);
+
+		b = (hash >> 32) % list->nr_buckets;
+		for (i = starts[b]; keys[i]; i++)
+			;
+		keys[i] = h;
+		hashes[i] = hash;
+	}
+
+	list->displacements = xnew0(unsigned int, list->nr_buckets);
+	while (1) {
+		list->slots = xnew0(struct hash_str *, list->nr_slots);
+		if (place_buckets(list, keys, hashes, starts, max))
+			break;
+
+		// very unlikely
+		free(list->slots);
+		BUG_ON(list->nr_slots > n * 64);
+		list->nr_slots *= 2;
+	}
+	free(hashes);
+	free(keys);
+	free(starts);
+}
+
 void finalize_syntax(struct syntax *syn, int saved_nr_errors)
 {
 	int i;
@@ -272,6 +437,16 @@ void finalize_syntax(struct syntax *syn, int saved_nr_errors)
 			error_msg("List %s never used", list->name);
 	}
 
+	for (i = 0; i < syn->string_lists.count; i++)
+		build_string_hash(syn->string_lists.ptrs[i]);
+
+	// merged states have been compiled already
+	for (i = 0; i < syn->states.count; i++) {
+		struct state *s = syn->states.ptrs[i];
+		if (!s->cond_lists)
+			compile_state(s);
+	}
+
 	ptr_array_add(&syntaxes, syn);
 }
 
@@ -3,6 +3,9 @@
 
 #include "libc.h"
 #include "ptr-array.h"
+#include "ctype.h"
+
+#include <inttypes.h>
 
 enum condition_type {
 	COND_BUFIS,
@@ -80,6 +83,11 @@ struct state {
 	} type;
 	struct action a;
 
+	// Conditions that can match when the current byte is ch are
+	// cond_lists[dispatch[ch]], NULL terminated and in original order.
+	unsigned char dispatch[256];
+	struct condition ***cond_lists;
+
 	struct {
 		struct syntax *subsyntax;
 		struct ptr_array states;
@@ -94,7 +102,18 @@ struct hash_str {
 
 struct string_list {
 	char *name;
-	struct hash_str *hash[62];
+	// linked through next, lowercase if icase
+	struct hash_str *strings;
+
+	// perfect hash table built by finalize_syntax()
+	struct hash_str **slots;
+	unsigned int *displacements;
+	unsigned int nr_slots;
+	unsigned int nr_buckets;
+
+	// bit n is set if there is a string of length n
+	uint64_t lengths;
+
 	bool icase;
 	bool used;
 	bool defined;
@@ -121,7 +140,59 @@ static inline bool is_subsyntax(struct syntax *syn)
 	return syn->name[0] == '.';
 }
 
-unsigned int buf_hash(const char *str, unsigned int size);
+static inline uint64_t length_bit(int len)
+{
+	// long strings share the last bit
+	return 1ULL << (len < 63 ? len : 63);
+}
+
+static inline uint64_t string_hash(const char *str, int len, bool icase)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char ch = str[i];
+		if (icase)
+			ch = tolower(ch);
+		hash = (hash ^ ch) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// d is displacement of the bucket of the string, nr_slots is power of 2
+static inline unsigned int hash_slot(uint64_t hash, unsigned int d, unsigned int nr_slots)
+{
+	hash += d * 0x9e3779b97f4a7c15ULL;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash & (nr_slots - 1);
+}
+
+static inline bool in_string_list(const struct string_list *list, const char *str, int len)
+{
+	uint64_t hash;
+	const struct hash_str *h;
+	int i;
+
+	// cheap test for lengths that no string has
+	if (!(list->lengths & length_bit(len)))
+		return false;
+
+	hash = string_hash(str, len, list->icase);
+	h = list->slots[hash_slot(hash, list->displacements[(hash >> 32) % list->nr_buckets], list->nr_slots)];
+	if (h == NULL || h->len != len)
+		return false;
+	if (!list->icase)
+		return !memcmp(str, h->str, len);
+	for (i = 0; i < len; i++) {
+		if (tolower(str[i]) != h->str[i])
+			return false;
+	}
+	return true;
+}
+
 struct string_list *find_string_list(struct syntax *syn, const char *name);
 struct state *find_state(struct syntax *syn, const char *name);
 struct state *merge_syntax(struct syntax *syn, struct syntax_merge *m);
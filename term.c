@@ -2,6 +2,7 @@
 #include "common.h"
 #include "editor.h"
 #include "options.h"
+#include "event.h"
 
 #undef CTRL
 
@@ -172,17 +173,7 @@ static bool fill_buffer(void)
 
 static bool fill_buffer_timeout(void)
 {
-	struct timeval tv = {
-		.tv_sec = options.esc_timeout / 1000,
-		.tv_usec = (options.esc_timeout % 1000) * 1000
-	};
-	fd_set set;
-	int rc;
-
-	FD_ZERO(&set);
-	FD_SET(0, &set);
-	rc = select(1, &set, NULL, NULL, &tv);
-	if (rc > 0 && fill_buffer())
+	if (poll_fd(0, POLLIN, options.esc_timeout) > 0 && fill_buffer())
 		return true;
 	return false;
 }
@@ -326,6 +317,12 @@ static bool is_text(const char *str, int len)
 	return true;
 }
 
+// returns true if term_read_key() would not block
+bool term_input_pending(void)
+{
+	return input_buf_fill || poll_fd(0, POLLIN, 0) > 0;
+}
+
 bool term_read_key(unsigned int *key, enum term_key_type *type)
 {
 	if (!input_buf_fill && !fill_buffer())
@@ -392,16 +389,8 @@ char *term_read_paste(long *size)
 		input_buf_fill = 0;
 	}
 	while (1) {
-		struct timeval tv = {
-			.tv_sec = 0,
-			.tv_usec = 0
-		};
-		fd_set set;
-		int rc;
-
-		FD_ZERO(&set);
-		FD_SET(0, &set);
-		rc = select(1, &set, NULL, NULL, &tv);
+		int rc = poll_fd(0, POLLIN, 0);
+
 		if (rc < 0 && errno == EINTR)
 			continue;
 		if (rc <= 0)
@@ -115,6 +115,7 @@ int term_init(bool use_terminfo, bool use_termcap);
 void term_raw(void);
 void term_cooked(void);
 
+bool term_input_pending(void);
 bool term_read_key(unsigned int *key, enum term_key_type *type);
 char *term_read_paste(long *size);
 void term_discard_paste(void);
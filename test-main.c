@@ -1,14 +1,40 @@
 #include "editor.h"
 #include "common.h"
 #include "path.h"
+#include "block-tree.h"
+#include "line-states.h"
+#include "block.h"
+#include "buffer.h"
+#include "view.h"
+#include "newline.h"
+#include "utf8.h"
+#include "load-save.h"
+#include "lz.h"
+#include "gbuf.h"
+#include "decoder.h"
+#include "cconv.h"
+#include "diff.h"
+#include "watch.h"
+#include "change.h"
+#include "state.h"
+#include "syntax.h"
+#include "color.h"
+#include "hl.h"
+#include "journal.h"
+#include "search.h"
+#include "event.h"
+#include "command.h"
 
 #include <locale.h>
 #include <langinfo.h>
 
+static int exit_status;
+
 static void fail(const char *format, ...)
 {
 	va_list ap;
 
+	exit_status = 1;
 	va_start(ap, format);
 	vfprintf(stderr, format, ap);
 	va_end(ap);
@@ -39,6 +65,1846 @@ static void test_relative_filename(void)
 	}
 }
 
+static struct block *test_block(long size, long nl)
+{
+	struct block *blk = xnew0(struct block, 1);
+
+	blk->size = size;
+	blk->nl = nl;
+	return blk;
+}
+
+static void test_block_tree(void)
+{
+	LIST_HEAD(head);
+	struct block *blk;
+	int i;
+
+	srand(1);
+	for (i = 0; i < 2000; i++) {
+		long size = rand() % 1000 + 1;
+
+		if (list_empty(&head) || rand() % 3) {
+			struct block *new = test_block(size, size / 10 + 1);
+
+			if (list_empty(&head)) {
+				block_tree_insert_after(new, NULL);
+				list_add_before(&new->node, &head);
+			} else {
+				blk = BLOCK(head.next);
+				block_tree_insert_before(new, blk);
+				list_add_before(&new->node, &blk->node);
+			}
+		} else if (rand() % 2 && head.next->next != &head) {
+			blk = BLOCK(head.prev);
+			block_tree_remove(blk);
+			list_del(&blk->node);
+			free(blk);
+		} else {
+			blk = BLOCK(head.prev);
+			blk->size = size;
+			block_tree_update(blk);
+		}
+		if (head.next->next != &head) {
+			// move first block before the last one
+			struct block *last = BLOCK(head.prev);
+
+			blk = BLOCK(head.next);
+			block_tree_remove(blk);
+			list_del(&blk->node);
+			block_tree_insert_before(blk, last);
+			list_add_before(&blk->node, &last->node);
+		}
+	}
+	block_tree_sanity_check(&head);
+
+	i = 0;
+	list_for_each_entry(blk, &head, node) {
+		long offset = 0, line = 0;
+		struct block *b;
+
+		for (b = BLOCK(head.next); b != blk; b = BLOCK(b->node.next)) {
+			offset += b->size;
+			line += b->nl;
+		}
+		if (block_tree_offset(blk) != offset || block_tree_line(blk) != line)
+			fail("block_tree_offset/line wrong at block %d\n", i);
+
+		offset++;
+		if (block_tree_find_offset(blk, &offset) != blk || offset != 1)
+			fail("block_tree_find_offset wrong at block %d\n", i);
+
+		line++;
+		if (block_tree_find_line(blk, &line) != blk || line != 1)
+			fail("block_tree_find_line wrong at block %d\n", i);
+		i++;
+	}
+}
+
+static struct state *test_state(int i)
+{
+	// few different states so that runs are long, some invalidated
+	return (struct state *)(uintptr_t)(i % 4 * 8 + (i % 7 == 0));
+}
+
+static void test_line_states(void)
+{
+	struct line_states s = { NULL, 0 };
+	struct state *model[3000];
+	int count = 1, i, j;
+
+	srand(2);
+	line_states_reset(&s, test_state(0));
+	model[0] = test_state(0);
+	for (i = 0; i < 5000; i++) {
+		int line = rand() % count;
+		int n = rand() % 20 + 1;
+
+		switch (rand() % 5) {
+		case 0:
+		case 1:
+			line = rand() % (count + 1);
+			if (line < ARRAY_COUNT(model)) {
+				model[line] = test_state(rand());
+				line_states_set(&s, line, model[line]);
+				if (line == count)
+					count++;
+			}
+			break;
+		case 2:
+			if (count + n <= ARRAY_COUNT(model)) {
+				memmove(model + line + n, model + line, (count - line) * sizeof(*model));
+				for (j = 0; j < n; j++)
+					model[line + j] = test_state(7);
+				line_states_insert(&s, line, n, test_state(7));
+				count += n;
+			}
+			break;
+		case 3:
+			if (line + n <= count && count > n) {
+				memmove(model + line, model + line + n, (count - line - n) * sizeof(*model));
+				line_states_delete(&s, line, n);
+				count -= n;
+			}
+			break;
+		case 4:
+			if (rand() % 10 == 0) {
+				count = line + 1;
+				line_states_truncate(&s, count);
+			}
+			break;
+		}
+	}
+	line_states_sanity_check(&s);
+
+	if (line_states_count(&s) != count)
+		fail("line_states_count: %d, expected %d\n", line_states_count(&s), count);
+	for (i = 0; i < count; i++) {
+		if (line_states_get(&s, i) != model[i])
+			fail("line_states_get wrong at line %d\n", i);
+	}
+	for (i = 0; i < count; i++) {
+		int expected = i;
+
+		while (expected < count && ((uintptr_t)model[expected] & 1) == 0)
+			expected++;
+		if (line_states_find_invalid(&s, i) != expected)
+			fail("line_states_find_invalid wrong at line %d\n", i);
+	}
+	line_states_free(&s);
+	if (s.nr_runs)
+		fail("line_states_free leaked %ld runs\n", s.nr_runs);
+}
+
+static void test_compact_blocks(void)
+{
+	struct buffer *b = buffer_new(NULL);
+	struct view v;
+	struct block_stats s;
+	struct block *blk;
+	char *text = xnew(char, 1000 * 20 * 16);
+	long size = 0, offset, i;
+
+	srand(3);
+	for (i = 0; i < 1000; i++) {
+		int lines = rand() % 20 + 1;
+
+		blk = block_new(b, lines * 16);
+		while (lines--) {
+			int len = sprintf(blk->data + blk->size, "line %ld\n", b->nl);
+
+			memcpy(text + size, blk->data + blk->size, len);
+			size += len;
+			blk->size += len;
+			blk->nl++;
+			b->nl++;
+		}
+		block_add_tail(&b->blocks, blk);
+	}
+
+	clear(&v);
+	v.buffer = b;
+	v.cursor.head = &b->blocks;
+	v.cursor.blk = BLOCK(b->blocks.next);
+	block_iter_goto_offset(&v.cursor, size / 3);
+	ptr_array_add(&b->views, &v);
+
+	compact_blocks(b);
+	block_tree_sanity_check(&b->blocks);
+
+	get_block_stats(b, &s);
+	if (s.blocks > size / 4096 || s.size != size)
+		fail("compact_blocks: %ld blocks, %ld bytes\n", s.blocks, s.size);
+	offset = 0;
+	list_for_each_entry(blk, &b->blocks, node) {
+		if (memcmp(blk->data, text + offset, blk->size))
+			fail("compact_blocks: contents differ at %ld\n", offset);
+		if (blk->size && blk->data[blk->size - 1] != '\n')
+			fail("compact_blocks: incomplete line at %ld\n", offset);
+		offset += blk->size;
+	}
+	if (v.cursor.offset > v.cursor.blk->size || block_iter_get_offset(&v.cursor) != size / 3)
+		fail("compact_blocks: cursor moved\n");
+
+	ptr_array_remove(&b->views, &v);
+	free_buffer(b);
+	free(text);
+}
+
+static char *buffer_text(struct buffer *b, long *sizep)
+{
+	struct block *blk;
+	GBUF(buf);
+
+	list_for_each_entry(blk, &b->blocks, node)
+		gbuf_add_buf(&buf, (const char *)blk->data, blk->size);
+	*sizep = buf.len;
+	return gbuf_steal(&buf);
+}
+
+// empty buffer that is edited through the global buffer and view
+static struct buffer *new_edit_buffer(struct view *v)
+{
+	struct buffer *b = open_empty_buffer();
+
+	clear(v);
+	v->buffer = b;
+	v->cursor.head = &b->blocks;
+	v->cursor.blk = BLOCK(b->blocks.next);
+	ptr_array_add(&b->views, v);
+	buffer = b;
+	view = v;
+	return b;
+}
+
+static void free_edit_buffer(struct buffer *b, struct view *v)
+{
+	ptr_array_remove(&b->views, v);
+	free_buffer(b);
+	buffer = NULL;
+	view = NULL;
+}
+
+static void check_text(struct buffer *b, const char *expected, const char *what)
+{
+	long size;
+	char *text = buffer_text(b, &size);
+
+	if (size != strlen(expected) || memcmp(text, expected, size))
+		fail("%s: wrong text\n", what);
+	free(text);
+}
+
+static void insert_text(const char *text)
+{
+	begin_change(CHANGE_MERGE_NONE);
+	buffer_insert_bytes(text, strlen(text));
+	end_change();
+}
+
+static void delete_text(long len)
+{
+	begin_change(CHANGE_MERGE_NONE);
+	buffer_delete_bytes(len);
+	end_change();
+}
+
+// insert text, then delete it so that it is saved for undo
+static void insert_and_delete(struct view *v, const char *text, long size)
+{
+	insert_text(text);
+	block_iter_bof(&v->cursor);
+	delete_text(size);
+}
+
+// undo-size is kept by compressing old changes or forgetting them
+static void test_undo_trim(void)
+{
+	struct view v;
+	struct buffer *b = new_edit_buffer(&v);
+	int saved_size = options.undo_size;
+	int saved_compress = options.compress_undo;
+	long size = 512 * 1024, changes, bytes, i, k;
+	char *text[3];
+
+	options.undo_size = 1;
+	options.compress_undo = 1;
+	srand(5);
+	for (k = 0; k < 3; k++) {
+		text[k] = xnew(char, size + 1);
+		for (i = 0; i < size; i++)
+			text[k][i] = i % 64 == 63 ? '\n' : 'a' + (k ? rand() % 26 : i % 7);
+		text[k][size] = 0;
+	}
+
+	// repetitive text is compressed and nothing is forgotten
+	for (k = 0; k < 3; k++)
+		insert_and_delete(&v, text[0], size);
+	if (!get_undo_stats(b, &changes, &bytes) || changes != 6 || b->undo_size > size + size / 2)
+		fail("undo compress: %ld changes, undo_size %ld\n", changes, b->undo_size);
+	for (k = 0; k < 3; k++) {
+		undo();
+		check_text(b, text[0], "undo compress, undo");
+		undo();
+		check_text(b, "", "undo compress, undo insert");
+	}
+	if (undo())
+		fail("undo compress: too many changes\n");
+	if (b->undo_size != 3 * size)
+		fail("undo compress: undo_size %ld after undo\n", b->undo_size);
+	free_edit_buffer(b, &v);
+
+	// random text can't be compressed, oldest changes are forgotten
+	b = new_edit_buffer(&v);
+	for (k = 0; k < 3; k++)
+		insert_and_delete(&v, text[k], size);
+	if (!get_undo_stats(b, &changes, &bytes) || changes != 2 || b->undo_size != size)
+		fail("undo trim: %ld changes, undo_size %ld\n", changes, b->undo_size);
+	undo();
+	check_text(b, text[2], "undo trim, undo");
+	undo();
+	check_text(b, "", "undo trim, undo insert");
+	if (undo())
+		fail("undo trim: forgotten change was undone\n");
+
+	options.undo_size = saved_size;
+	options.compress_undo = saved_compress;
+	for (k = 0; k < 3; k++)
+		free(text[k]);
+	free_edit_buffer(b, &v);
+}
+
+// redo branches must survive forgetting old changes
+static void test_undo_trim_branches(void)
+{
+	struct view v;
+	struct buffer *b = new_edit_buffer(&v);
+	int saved_size = options.undo_size;
+	int saved_compress = options.compress_undo;
+	long size = 1536 * 1024;
+	char *big = xnew(char, size + 3);
+
+	options.undo_size = 1;
+	options.compress_undo = 0;
+	memset(big, 'x', size);
+	big[size - 1] = '\n';
+	big[size] = 0;
+
+	insert_text(big);
+	insert_text("b\n");
+	undo();
+	// deleted text does not fit in undo-size, older changes are forgotten
+	block_iter_bof(&v.cursor);
+	delete_text(size);
+	check_text(b, "", "trim");
+	if (b->undo_size != size)
+		fail("trim: undo_size %ld\n", b->undo_size);
+
+	undo();
+	check_text(b, big, "trim, undo");
+	block_iter_bof(&v.cursor);
+	insert_text("c\n");
+	undo();
+	if (!redo(1))
+		fail("trim, redo: branch lost\n");
+	check_text(b, "", "trim, redo");
+	undo();
+	if (!redo(2))
+		fail("trim, redo newest: branch lost\n");
+	memmove(big + 2, big, size);
+	memcpy(big, "c\n", 2);
+	big[size + 2] = 0;
+	check_text(b, big, "trim, redo newest");
+
+	options.undo_size = saved_size;
+	options.compress_undo = saved_compress;
+	free(big);
+	free_edit_buffer(b, &v);
+}
+
+// change records come from slabs and are reused after being forgotten
+static void test_change_slabs(void)
+{
+	struct view v;
+	struct buffer *b = new_edit_buffer(&v);
+	int saved_size = options.undo_size;
+	int saved_compress = options.compress_undo;
+	long size = 1536 * 1024, nr = 2500, changes, bytes, i;
+	char *text = xnew(char, size + nr + 2);
+	struct change *unused;
+
+	options.undo_size = 1;
+	options.compress_undo = 0;
+	for (i = 0; i < nr; i++)
+		insert_text("x");
+	if (!get_undo_stats(b, &changes, &bytes) || changes != nr)
+		fail("change slabs: %ld changes\n", changes);
+	for (i = 0; i < nr; i++)
+		undo();
+	check_text(b, "", "change slabs, undo");
+	for (i = 0; i < nr; i++)
+		redo(0);
+	// newline is added after the first x
+	memset(text, 'x', nr);
+	strcpy(text + nr, "\n");
+	check_text(b, text, "change slabs, redo");
+
+	// too big deletion, all older changes are forgotten
+	memset(text, 'y', size);
+	text[size - 1] = '\n';
+	memset(text + size, 'x', nr);
+	strcpy(text + size + nr, "\n");
+	block_iter_bof(&v.cursor);
+	insert_text(text);
+	delete_text(size + nr + 1);
+	if (!get_undo_stats(b, &changes, &bytes) || changes != 1 || !b->unused_changes)
+		fail("change slabs: %ld changes after trimming\n", changes);
+	unused = b->unused_changes;
+	insert_text("z");
+	if (b->cur_change != unused)
+		fail("change slabs: forgotten change was not reused\n");
+	// deletion itself is forgotten when it is no longer current
+	undo();
+	if (undo())
+		fail("change slabs: too big change was kept\n");
+	check_text(b, text + size, "change slabs, undo after trim");
+
+	options.undo_size = saved_size;
+	options.compress_undo = saved_compress;
+	free(text);
+	free_edit_buffer(b, &v);
+}
+
+// array of newer changes grows when more redo branches are made
+static void test_change_branches(void)
+{
+	struct view v;
+	struct buffer *b = new_edit_buffer(&v);
+	char line[16];
+	int i, nr = 9;
+
+	insert_text("base\n");
+	for (i = 0; i < nr; i++) {
+		block_iter_bof(&v.cursor);
+		sprintf(line, "b%d\n", i);
+		insert_text(line);
+		undo();
+	}
+	if (b->cur_change->nr_prev != nr)
+		fail("change branches: %u branches\n", b->cur_change->nr_prev);
+	for (i = 0; i < nr; i++) {
+		char expected[16];
+
+		if (!redo(i + 1))
+			fail("change branches: can't redo %d\n", i + 1);
+		sprintf(expected, "b%d\nbase\n", i);
+		check_text(b, expected, "change branches, redo");
+		undo();
+	}
+	undo();
+	check_text(b, "", "change branches, undo");
+	if (!redo(0) || !redo(0))
+		fail("change branches: can't redo newest\n");
+	check_text(b, "b8\nbase\n", "change branches, redo newest");
+	free_edit_buffer(b, &v);
+}
+
+static void test_replace_hunks(void)
+{
+	struct buffer *b = buffer_new(NULL);
+	struct view v;
+	GBUF(hunks);
+	GBUF(expected);
+	char *orig, *text, *rev, *rev2;
+	long orig_size, size, rsize, rsize2, del, ins, pos = 0, i;
+	struct block *blk;
+
+	for (i = 0; i < 200; i++) {
+		blk = block_new(b, 4096);
+		while (blk->size < 3000) {
+			blk->size += sprintf((char *)blk->data + blk->size, "%ld abc\n", b->nl);
+			blk->nl++;
+			b->nl++;
+		}
+		block_add_tail(&b->blocks, blk);
+	}
+	orig = buffer_text(b, &orig_size);
+
+	clear(&v);
+	v.buffer = b;
+	v.cursor.head = &b->blocks;
+	v.cursor.blk = BLOCK(b->blocks.next);
+	buffer = b;
+	view = &v;
+
+	srand(6);
+	block_iter_goto_offset(&v.cursor, 5000);
+	gbuf_add_buf(&expected, orig, 5000);
+	pos = 5000;
+	while (pos < orig_size - 100000) {
+		long skip = rand() % 5000;
+		long d = rand() % 20;
+		long n = rand() % 30;
+		char ins_text[32];
+
+		for (i = 0; i < n; i++)
+			ins_text[i] = rand() % 5 ? 'x' : '\n';
+		add_hunk(&hunks, skip, d, ins_text, n);
+		gbuf_add_buf(&expected, orig + pos, skip);
+		gbuf_add_buf(&expected, ins_text, n);
+		pos += skip + d;
+	}
+	gbuf_add_buf(&expected, orig + pos, orig_size - pos);
+
+	rev = do_replace_hunks((const char *)hunks.buffer, hunks.len, &rsize, &del, &ins);
+	block_tree_sanity_check(&b->blocks);
+	text = buffer_text(b, &size);
+	if (size != expected.len || memcmp(text, expected.buffer, size) || b->nl != count_nl(text, size))
+		fail("do_replace_hunks: wrong result\n");
+	if (del != pos - 5000 || ins != del + size - orig_size)
+		fail("do_replace_hunks: span %ld -> %ld\n", del, ins);
+	free(text);
+
+	rev2 = do_replace_hunks(rev, rsize, &rsize2, &del, &ins);
+	text = buffer_text(b, &size);
+	if (size != orig_size || memcmp(text, orig, size) || b->nl != count_nl(text, size))
+		fail("do_replace_hunks: reverse failed\n");
+	if (rsize2 != hunks.len || memcmp(rev2, hunks.buffer, rsize2))
+		fail("do_replace_hunks: reverse of reverse differs\n");
+	free(text);
+
+	free(rev);
+	free(rev2);
+	free(orig);
+	gbuf_free(&hunks);
+	gbuf_free(&expected);
+	free_buffer(b);
+	buffer = NULL;
+	view = NULL;
+}
+
+static void test_diff(void)
+{
+	static const char *const words[] = { "a\n", "b\n", "c\n", "a" };
+	int iter;
+
+	srand(7);
+	for (iter = 0; iter < 2000; iter++) {
+		struct diff_lines a = { NULL, 0, 0 };
+		struct diff_lines b = { NULL, 0, 0 };
+		struct diff_hunk *hunks;
+		long n = rand() % 30, m = rand() % 30, nr, i, j, edits = 0, prev = -1, lcs[31][31];
+		GBUF(result);
+		GBUF(expected);
+
+		for (i = 0; i < n; i++)
+			diff_lines_add(&a, words[rand() % 3], 2);
+		for (i = 0; i < m; i++) {
+			const char *w = words[i == m - 1 ? rand() % 4 : rand() % 3];
+
+			diff_lines_add(&b, w, strlen(w));
+			gbuf_add_str(&expected, w);
+		}
+
+		// apply hunks to a
+		nr = diff(&a, &b, &hunks);
+		j = 0;
+		for (i = 0; i < nr; i++) {
+			const struct diff_hunk *h = &hunks[i];
+
+			if (h->old_start <= prev || h->old_start > h->old_end || h->new_start > h->new_end)
+				fail("diff: bad hunk %ld\n", i);
+			for (; j < h->old_start; j++)
+				gbuf_add_buf(&result, a.ptr[j].text, a.ptr[j].len);
+			for (j = h->new_start; j < h->new_end; j++)
+				gbuf_add_buf(&result, b.ptr[j].text, b.ptr[j].len);
+			edits += h->old_end - h->old_start + h->new_end - h->new_start;
+			j = prev = h->old_end;
+		}
+		for (; j < n; j++)
+			gbuf_add_buf(&result, a.ptr[j].text, a.ptr[j].len);
+		if (result.len != expected.len || memcmp(result.buffer, expected.buffer, result.len))
+			fail("diff: %d: wrong result\n", iter);
+
+		// script must be shortest
+		for (i = n; i >= 0; i--) {
+			for (j = m; j >= 0; j--) {
+				if (i == n || j == m)
+					lcs[i][j] = 0;
+				else if (a.ptr[i].len == b.ptr[j].len && !memcmp(a.ptr[i].text, b.ptr[j].text, a.ptr[i].len))
+					lcs[i][j] = lcs[i + 1][j + 1] + 1;
+				else
+					lcs[i][j] = lcs[i + 1][j] > lcs[i][j + 1] ? lcs[i + 1][j] : lcs[i][j + 1];
+			}
+		}
+		if (edits != n + m - 2 * lcs[0][0])
+			fail("diff: %d: %ld edits, expected %ld\n", iter, edits, n + m - 2 * lcs[0][0]);
+
+		free(hunks);
+		gbuf_free(&result);
+		gbuf_free(&expected);
+		diff_lines_free(&a);
+		diff_lines_free(&b);
+	}
+}
+
+static void write_file(const char *filename, const char *text)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+	if (fd < 0 || xwrite(fd, text, strlen(text)) < 0)
+		fail("writing %s failed\n", filename);
+	close(fd);
+}
+
+static void check_file(const char *filename, const char *expected, const char *what)
+{
+	char *buf;
+	ssize_t size = read_file(filename, &buf);
+
+	if (size != strlen(expected) || memcmp(buf, expected, size))
+		fail("%s: wrong file contents\n", what);
+	free(buf);
+}
+
+/*
+ * Editor files such as undo journals go to a temporary home directory.
+ * It is not in /tmp because files there are saved without a temporary
+ * file and never in the background.
+ */
+static char *make_temp_home(void)
+{
+	char name[] = "/var/tmp/dex-test-XXXXXX";
+	char *sub;
+
+	if (!mkdtemp(name)) {
+		fail("mkdtemp %s failed: %s\n", name, strerror(errno));
+		return xstrdup(name);
+	}
+	sub = xsprintf("%s/.%s", name, program);
+	mkdir(sub, 0700);
+	free(sub);
+	home_dir = xstrdup(name);
+	return home_dir;
+}
+
+static void remove_tree(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *de;
+
+	if (!dir) {
+		unlink(path);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		char *sub;
+
+		if (streq(de->d_name, ".") || streq(de->d_name, ".."))
+			continue;
+		sub = xsprintf("%s/%s", path, de->d_name);
+		remove_tree(sub);
+		free(sub);
+	}
+	closedir(dir);
+	rmdir(path);
+}
+
+static struct buffer *open_test_file(struct view *v, const char *filename)
+{
+	struct buffer *b = buffer_new(NULL);
+
+	if (load_buffer(b, true, filename))
+		fail("loading %s failed\n", filename);
+	b->abs_filename = xstrdup(filename);
+	clear(v);
+	v->buffer = b;
+	v->cursor.head = &b->blocks;
+	v->cursor.blk = BLOCK(b->blocks.next);
+	ptr_array_add(&b->views, v);
+	buffer = b;
+	view = v;
+	return b;
+}
+
+// edits made while saving in background must stay recoverable
+static void test_background_save(void)
+{
+	int saved_background = options.background_save;
+	int saved_journal = options.undo_journal;
+	char *saved_home = home_dir;
+	char *home = make_temp_home();
+	char *filename = xsprintf("%s/file", home);
+	struct change *saved;
+	struct buffer *b;
+	struct view v;
+
+	options.background_save = 1;
+	options.undo_journal = 1;
+	write_file(filename, "one\n");
+	b = open_test_file(&v, filename);
+	insert_text("two\n");
+	saved = b->cur_change;
+	if (save_buffer(b, filename, b->encoding, NEWLINE_UNIX) != 1)
+		fail("background save did not start\n");
+	insert_text("three\n");
+	if (!finish_background_saves(b, true))
+		fail("background save did not finish\n");
+	check_file(filename, "two\none\n", "background save");
+	if (b->saved_change != saved || !buffer_modified(b))
+		fail("background save: wrong saved change\n");
+	free_edit_buffer(b, &v);
+
+	b = open_test_file(&v, filename);
+	load_journal(b);
+	check_text(b, "three\ntwo\none\n", "background save, journal");
+	if (!buffer_modified(b))
+		fail("background save: edit not recovered\n");
+	free_edit_buffer(b, &v);
+
+	remove_tree(home);
+	free(home);
+	free(filename);
+	home_dir = saved_home;
+	options.background_save = saved_background;
+	options.undo_journal = saved_journal;
+}
+
+static char *journal_path(const char *home)
+{
+	char *dirname = xsprintf("%s/.%s/undo", home, program);
+	DIR *dir = opendir(dirname);
+	char *path = NULL;
+	struct dirent *de;
+
+	while (dir && (de = readdir(dir))) {
+		if (de->d_name[0] != '.')
+			path = xsprintf("%s/%s", dirname, de->d_name);
+	}
+	if (dir)
+		closedir(dir);
+	free(dirname);
+	if (!path)
+		fail("no undo journal in %s\n", home);
+	return path;
+}
+
+// history and unsaved edits survive closing the file and a crash
+static void test_journal(void)
+{
+	int saved_journal = options.undo_journal;
+	int saved_background = options.background_save;
+	char *saved_home = home_dir;
+	char *home = make_temp_home();
+	char *filename = xsprintf("%s/file", home);
+	char *path, *buf;
+	struct buffer *b;
+	struct view v;
+	ssize_t size;
+	int fd;
+
+	options.undo_journal = 1;
+	options.background_save = 0;
+	write_file(filename, "one\n");
+	b = open_test_file(&v, filename);
+	insert_text("a\n");
+	insert_text("b\n");
+	undo();
+	insert_text("c\n");
+	if (save_buffer(b, filename, b->encoding, NEWLINE_UNIX))
+		fail("test_journal: save failed\n");
+	b->saved_change = b->cur_change;
+	journal_saved(b);
+	undo();
+	free_edit_buffer(b, &v);
+
+	// round trip, saved state is reached by redo
+	b = open_test_file(&v, filename);
+	load_journal(b);
+	check_text(b, "a\none\n", "test_journal, reopen");
+	if (!buffer_modified(b))
+		fail("test_journal: undo was not recovered\n");
+	redo(2);
+	check_text(b, "c\na\none\n", "test_journal, redo");
+	if (buffer_modified(b))
+		fail("test_journal: saved change was not recovered\n");
+	undo();
+	redo(1);
+	check_text(b, "b\na\none\n", "test_journal, redo other branch");
+	insert_text("d\n");
+	sync_journals();
+
+	// crash while writing a record, the incomplete record is ignored
+	path = journal_path(home);
+	size = read_file(path, &buf);
+	if (size < 0)
+		fail("test_journal: can't read %s\n", path);
+	free_edit_buffer(b, &v);
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || xwrite(fd, buf, size) != size || xwrite(fd, "N\x07\0", 3) != 3)
+		fail("test_journal: can't write %s\n", path);
+	close(fd);
+
+	b = open_test_file(&v, filename);
+	load_journal(b);
+	check_text(b, "d\nb\na\none\n", "test_journal, crash");
+	insert_text("e\n");
+	free_edit_buffer(b, &v);
+
+	// records after the incomplete one are readable
+	b = open_test_file(&v, filename);
+	load_journal(b);
+	check_text(b, "e\nd\nb\na\none\n", "test_journal, after crash");
+	undo();
+	undo();
+	undo();
+	redo(2);
+	check_text(b, "c\na\none\n", "test_journal, undo after crash");
+	free_edit_buffer(b, &v);
+
+	// file changed by someone else, journal is discarded
+	write_file(filename, "two\n");
+	b = open_test_file(&v, filename);
+	load_journal(b);
+	check_text(b, "two\n", "test_journal, changed file");
+	if (b->cur_change->prev || access(path, F_OK) == 0)
+		fail("test_journal: stale journal was used\n");
+	free_edit_buffer(b, &v);
+
+	remove_tree(home);
+	free(home);
+	free(filename);
+	free(path);
+	free(buf);
+	home_dir = saved_home;
+	options.undo_journal = saved_journal;
+	options.background_save = saved_background;
+}
+
+static void save_test_file(struct buffer *b, const char *filename)
+{
+	if (save_buffer(b, filename, b->encoding, NEWLINE_UNIX))
+		fail("saving %s failed\n", filename);
+	b->saved_change = b->cur_change;
+	journal_saved(b);
+}
+
+static long file_size(const char *filename)
+{
+	struct stat st;
+
+	if (stat(filename, &st))
+		return -1;
+	return st.st_size;
+}
+
+// journal keeps only the history that fits in undo-size
+static void test_journal_trim(void)
+{
+	int saved_journal = options.undo_journal;
+	int saved_background = options.background_save;
+	int saved_size = options.undo_size;
+	int saved_compress = options.compress_undo;
+	char *saved_home = home_dir;
+	char *home = make_temp_home();
+	char *filename = xsprintf("%s/file", home);
+	long size = 512 * 1024, changes, bytes, i, k;
+	char *text[3], *path, *expected;
+	struct buffer *b;
+	struct view v;
+
+	options.undo_journal = 1;
+	options.background_save = 0;
+	options.undo_size = 0;
+	options.compress_undo = 0;
+	srand(7);
+	for (k = 0; k < 3; k++) {
+		text[k] = xnew(char, size + 1);
+		for (i = 0; i < size; i++)
+			text[k][i] = i % 64 == 63 ? '\n' : 'a' + rand() % 26;
+		text[k][size] = 0;
+	}
+
+	write_file(filename, "one\n");
+	b = open_test_file(&v, filename);
+	for (k = 0; k < 3; k++)
+		insert_and_delete(&v, text[k], size);
+	save_test_file(b, filename);
+	free_edit_buffer(b, &v);
+	path = journal_path(home);
+	if (file_size(path) < 6 * size)
+		fail("journal trim: journal is %ld bytes\n", file_size(path));
+
+	// history is trimmed and the journal rewritten when it is loaded
+	options.undo_size = 1;
+	b = open_test_file(&v, filename);
+	load_journal(b);
+	if (!get_undo_stats(b, &changes, &bytes) || changes != 2 || file_size(path) > 2 * size + 1024)
+		fail("journal trim, load: %ld changes, journal %ld bytes\n", changes, file_size(path));
+
+	// journal is rewritten on save when it has grown
+	for (k = 0; k < 2; k++)
+		insert_and_delete(&v, text[k], size);
+	save_test_file(b, filename);
+	if (file_size(path) > 2 * size + 1024)
+		fail("journal trim, save: journal %ld bytes\n", file_size(path));
+	insert_text("two\n");
+	free_edit_buffer(b, &v);
+
+	b = open_test_file(&v, filename);
+	load_journal(b);
+	check_text(b, "two\none\n", "journal trim, reopen");
+	undo();
+	check_text(b, "one\n", "journal trim, undo");
+	undo();
+	expected = xnew(char, size + 5);
+	memcpy(expected, text[1], size);
+	strcpy(expected + size, "one\n");
+	check_text(b, expected, "journal trim, undo delete");
+	undo();
+	if (undo())
+		fail("journal trim: forgotten change was undone\n");
+	free_edit_buffer(b, &v);
+
+	remove_tree(home);
+	for (k = 0; k < 3; k++)
+		free(text[k]);
+	free(home);
+	free(filename);
+	free(path);
+	free(expected);
+	home_dir = saved_home;
+	options.undo_journal = saved_journal;
+	options.background_save = saved_background;
+	options.undo_size = saved_size;
+	options.compress_undo = saved_compress;
+}
+
+static struct buffer *open_test_file_loading(struct view *v, const char *filename)
+{
+	int saved_incremental = options.incremental_load;
+	enum editor_status saved_status = editor_status;
+	struct buffer *b;
+
+	options.incremental_load = 1;
+	editor_status = EDITOR_RUNNING;
+	b = open_test_file(v, filename);
+	editor_status = saved_status;
+	options.incremental_load = saved_incremental;
+	if (!b->loader)
+		fail("%s was loaded at once\n", filename);
+	return b;
+}
+
+// history without unsaved changes doesn't stop incremental loading
+static void test_journal_loading(void)
+{
+	int saved_journal = options.undo_journal;
+	int saved_background = options.background_save;
+	char *saved_home = home_dir;
+	char *home = make_temp_home();
+	char *filename = xsprintf("%s/file", home);
+	long i, nr = 6 * 1024 * 1024 / 4;
+	char *text = xnew(char, nr * 4 + 1);
+	char *path;
+	struct buffer *b;
+	struct view v;
+
+	options.undo_journal = 1;
+	options.background_save = 0;
+	for (i = 0; i < nr; i++)
+		memcpy(text + i * 4, "abc\n", 4);
+	text[nr * 4] = 0;
+	write_file(filename, text);
+	b = open_test_file(&v, filename);
+	insert_text("x\n");
+	save_test_file(b, filename);
+	free_edit_buffer(b, &v);
+	path = journal_path(home);
+
+	b = open_test_file_loading(&v, filename);
+	load_journal(b);
+	if (!b->loader || !b->cur_change->next)
+		fail("journal loading: history not read while loading\n");
+	undo();
+	if (b->loader)
+		fail("journal loading: undo didn't finish loading\n");
+	check_text(b, text, "journal loading, undo");
+	redo(0);
+	free_edit_buffer(b, &v);
+
+	// file changed by someone else is noticed when loading finishes
+	text[0] = 'y';
+	write_file(filename, text);
+	b = open_test_file_loading(&v, filename);
+	load_journal(b);
+	finish_loading(b);
+	if (b->cur_change->next || b->journal || access(path, F_OK) == 0)
+		fail("journal loading: stale journal was used\n");
+	check_text(b, text, "journal loading, changed file");
+	free_edit_buffer(b, &v);
+
+	remove_tree(home);
+	free(home);
+	free(filename);
+	free(path);
+	free(text);
+	home_dir = saved_home;
+	options.undo_journal = saved_journal;
+	options.background_save = saved_background;
+}
+
+// file is loaded incrementally, rest is loaded while waiting for input
+static struct buffer *open_loading_file(struct view *v, const char *text, long size)
+{
+	char filename[] = "/tmp/dex-test-XXXXXX";
+	int saved_incremental = options.incremental_load;
+	enum editor_status saved_status = editor_status;
+	struct buffer *b;
+	int fd = mkstemp(filename);
+
+	if (fd < 0 || xwrite(fd, text, size) != size)
+		fail("can't write %s\n", filename);
+	close(fd);
+
+	options.incremental_load = 1;
+	editor_status = EDITOR_RUNNING;
+	b = open_test_file(v, filename);
+	editor_status = saved_status;
+	options.incremental_load = saved_incremental;
+	unlink(filename);
+	if (!b->loader)
+		fail("%s was loaded at once\n", filename);
+	return b;
+}
+
+// commands that use the whole file must see the part not loaded yet
+static void test_edit_loading(void)
+{
+	long i, nr = 6 * 1024 * 1024 / 4;
+	char *text = xnew(char, nr * 4 + 1);
+	struct buffer *b;
+	struct view v;
+
+	for (i = 0; i < nr; i++)
+		memcpy(text + i * 4, "abc\n", 4);
+	text[nr * 4] = 0;
+
+	b = open_loading_file(&v, text, nr * 4);
+	reg_replace("b", "x", 0);
+	for (i = 0; i < nr; i++)
+		text[i * 4 + 1] = 'x';
+	if (b->loader)
+		fail("replace: still loading\n");
+	check_text(b, text, "replace while loading");
+	if (b->nl != nr)
+		fail("replace while loading: %ld lines\n", b->nl);
+	free_edit_buffer(b, &v);
+
+	b = open_loading_file(&v, text, nr * 4);
+	handle_command(commands, "filter tr x y");
+	for (i = 0; i < nr; i++)
+		text[i * 4 + 1] = 'y';
+	check_text(b, text, "filter while loading");
+	free_edit_buffer(b, &v);
+	free(text);
+}
+
+static void check_line(struct buffer *b, long line, const char *expected, const char *what)
+{
+	BLOCK_ITER(bi, &b->blocks);
+	struct lineref lr;
+
+	block_iter_goto_line(&bi, line);
+	fill_line_ref(&bi, &lr);
+	if (lr.size != strlen(expected) || memcmp(lr.line, expected, lr.size))
+		fail("%s: wrong line %ld\n", what, line);
+}
+
+// encoding is detected while the file is loaded
+static void test_detect_loading(void)
+{
+	static char utf8[] = "UTF-8", latin9[] = "ISO-8859-15";
+	char *saved_charset = charset;
+	long i, nr = 6 * 1024 * 1024 / 4, size = 0;
+	char *text = xnew(char, nr * 4 + 16);
+	struct buffer *b;
+	struct view v;
+
+	size += sprintf(text, "\xc3\xa9\n");
+	for (i = 0; i < nr; i++)
+		size += sprintf(text + size, "abc\n");
+	size += sprintf(text + size, "\xff\n");
+
+	// invalid byte at the end, loaded again as latin1
+	charset = utf8;
+	b = open_loading_file(&v, text, size);
+	if (!streq(b->encoding, "UTF-8"))
+		fail("detect: %s, expected UTF-8 at first\n", b->encoding);
+	check_line(b, 0, "\xc3\xa9", "detect, UTF-8");
+	block_iter_goto_line(&v.cursor, 1000);
+	view_update_cursor_y(&v);
+	finish_loading(b);
+	if (!streq(b->encoding, "ISO-8859-1"))
+		fail("detect: %s, expected ISO-8859-1\n", b->encoding);
+	if (b->nl != nr + 2)
+		fail("detect: %ld lines\n", b->nl);
+	check_line(b, 0, "\xc3\x83\xc2\xa9", "detect, latin1");
+	check_line(b, nr + 1, "\xc3\xbf", "detect, latin1 end");
+	view_update_cursor_y(&v);
+	if (v.cy != 1000 || block_iter_get_offset(&v.cursor) != 5 + 999 * 4)
+		fail("detect: cursor at line %d\n", v.cy);
+	block_tree_sanity_check(&b->blocks);
+	free_edit_buffer(b, &v);
+
+	// ASCII at first, charset is used until UTF-8 is found
+	charset = latin9;
+	memmove(text, text + 3, size - 3);
+	size -= 3;
+	strcpy(text + size - 2, "\xc3\xa9\n");
+	size++;
+	b = open_loading_file(&v, text, size);
+	if (!streq(b->encoding, latin9))
+		fail("detect: %s, expected charset at first\n", b->encoding);
+	finish_loading(b);
+	if (!streq(b->encoding, "UTF-8"))
+		fail("detect: %s, expected UTF-8\n", b->encoding);
+	check_line(b, nr, "\xc3\xa9", "detect, UTF-8 end");
+	free_edit_buffer(b, &v);
+
+	charset = saved_charset;
+	free(text);
+}
+
+// reload text2 over text1, cursor at line1, col 2 must move to line2, col2
+static void test_reload_case(const char *text1, const char *text2, long line1, long line2, long col2)
+{
+	char filename[] = "/tmp/dex-test-XXXXXX";
+	struct buffer *b = buffer_new(NULL);
+	struct view v;
+	char *text;
+	long size;
+	int fd = mkstemp(filename);
+
+	close(fd);
+	write_file(filename, text1);
+	load_buffer(b, true, filename);
+	b->abs_filename = xstrdup(filename);
+
+	clear(&v);
+	v.buffer = b;
+	v.cursor.head = &b->blocks;
+	v.cursor.blk = BLOCK(b->blocks.next);
+	ptr_array_add(&b->views, &v);
+	buffer = b;
+	view = &v;
+	block_iter_goto_line(&v.cursor, line1);
+	block_iter_skip_bytes(&v.cursor, 2);
+
+	write_file(filename, text2);
+	if (reload_buffer(b))
+		fail("reload_buffer failed\n");
+	text = buffer_text(b, &size);
+	if (size != strlen(text2) || memcmp(text, text2, size) || b->nl != count_nl(text, size))
+		fail("reload_buffer: wrong text\n");
+	free(text);
+	if (buffer_modified(b))
+		fail("reload_buffer: buffer is modified\n");
+	view_update_cursor_y(&v);
+	if (v.cy != line2 || block_iter_bol(&v.cursor) != col2)
+		fail("reload_buffer: cursor at %d, expected %ld\n", v.cy, line2);
+
+	undo();
+	text = buffer_text(b, &size);
+	if (size != strlen(text1) || memcmp(text, text1, size))
+		fail("reload_buffer: undo failed\n");
+	free(text);
+
+	unlink(filename);
+	free_buffer(b);
+	buffer = NULL;
+	view = NULL;
+}
+
+static void test_reload(void)
+{
+	GBUF(text1);
+	GBUF(text2);
+	char line[64];
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		sprintf(line, "line %d\n", i);
+		gbuf_add_str(&text1, line);
+		if (i == 10)
+			gbuf_add_str(&text2, "changed\n");
+		else if (i == 800)
+			gbuf_add_str(&text2, "new 1\nnew 2\nnew 3\n");
+		if (i != 10 && (i < 500 || i > 502) && i != 999)
+			gbuf_add_str(&text2, line);
+	}
+	gbuf_add_str(&text2, "last\n");
+	test_reload_case((char *)text1.buffer, (char *)text2.buffer, 600, 597, 2);
+
+	// deleting last lines and replacing everything
+	test_reload_case("aa\nbb\ncc\n", "aa\n", 2, 0, 2);
+	test_reload_case("aa\nbb\ncc\n", "x\ny\n", 1, 0, 0);
+	test_reload_case("aa\nbb\n", "aa\nbb\ncc\ndd\n", 1, 1, 2);
+	gbuf_free(&text1);
+	gbuf_free(&text2);
+}
+
+static int nr_reads;
+static int nr_timer_calls[2];
+static int event_pipe[2];
+
+static void count_timer(void *data)
+{
+	(*(int *)data)++;
+}
+
+static void read_event(int fd, short revents, void *data)
+{
+	char buf[64];
+
+	if (read(fd, buf, sizeof(buf)) > 0)
+		nr_reads++;
+}
+
+// handler is replaced while polling
+static void replace_handler(int fd, short revents, void *data)
+{
+	remove_fd_handler(fd);
+	add_fd_handler(event_pipe[0], POLLIN, read_event, NULL);
+}
+
+static void test_events(void)
+{
+	int timeout = 0;
+
+	init_events();
+	if (pipe(event_pipe))
+		fail("test_events: pipe failed\n");
+	// poll() would wait forever if waking up did not work
+	add_timer(5000, count_timer, &timeout);
+
+	add_fd_handler(event_pipe[0], POLLIN, read_event, NULL);
+	xwrite(event_pipe[1], "x", 1);
+	run_other_events();
+	if (nr_reads != 1)
+		fail("test_events: handler ran %d times\n", nr_reads);
+
+	// self-pipe
+	wake_up_events();
+	run_other_events();
+	if (nr_reads != 1 || timeout)
+		fail("test_events: waking up failed\n");
+
+	// removed handler is not polled
+	remove_fd_handler(event_pipe[0]);
+	xwrite(event_pipe[1], "x", 1);
+	wake_up_events();
+	run_other_events();
+	if (nr_reads != 1)
+		fail("test_events: removed handler ran\n");
+
+	add_fd_handler(event_pipe[0], POLLIN, replace_handler, NULL);
+	run_other_events();
+	if (nr_reads != 1)
+		fail("test_events: replaced handler ran\n");
+	run_other_events();
+	if (nr_reads != 2)
+		fail("test_events: new handler did not run\n");
+	remove_fd_handler(event_pipe[0]);
+
+	// timer with same fn and data is replaced
+	add_timer(0, count_timer, &nr_timer_calls[0]);
+	add_timer(0, count_timer, &nr_timer_calls[0]);
+	add_timer(0, count_timer, &nr_timer_calls[1]);
+	run_other_events();
+	if (nr_timer_calls[0] != 1 || nr_timer_calls[1] != 1 || timeout)
+		fail("test_events: timers ran %d and %d times\n", nr_timer_calls[0], nr_timer_calls[1]);
+	add_timer(0, count_timer, &nr_timer_calls[0]);
+	remove_timer(count_timer, &nr_timer_calls[0]);
+	wake_up_events();
+	run_other_events();
+	if (nr_timer_calls[0] != 1)
+		fail("test_events: removed timer ran\n");
+
+	remove_timer(count_timer, &timeout);
+	close(event_pipe[0]);
+	close(event_pipe[1]);
+}
+
+// each byte is shown as first letter of its color name
+static void test_hl_line(struct buffer *b, const char *line, const char *expected)
+{
+	int len = strlen(line), nr_spans, nc, i, pos = 0;
+	struct hl_span *spans;
+	char got[256];
+
+	line_states_truncate(&b->line_start_states, 1);
+	spans = hl_line(b, line, len, 0, &nr_spans, &nc);
+	for (i = 0; i < nr_spans; i++) {
+		struct hl_color *c = spans[i].color;
+
+		if (spans[i].start != pos || (i > 0 && c == spans[i - 1].color))
+			fail("hl_line: bad span %d\n", i);
+		for (; pos < spans[i].start + spans[i].len; pos++)
+			got[pos] = c ? strchr(c->name, '.')[1] : '-';
+	}
+	got[pos] = 0;
+	if (strcmp(got, expected))
+		fail("hl_line: %s\n got: %s\n expected: %s\n", line, got, expected);
+}
+
+static void test_hl(void)
+{
+	static const char *const names[] = {
+		"c.comment", "c.error", "c.keyword", "c.numeric",
+		"c.preproc", "c.string", "c.type",
+		"sql.keyword", "sql.identifier",
+	};
+	struct term_color color = { -1, -1, 0 };
+	struct buffer *b = buffer_new(NULL);
+	struct syntax *syn;
+	int err, i;
+
+	for (i = 0; i < ARRAY_COUNT(names); i++)
+		set_highlight_color(names[i], &color);
+	syn = load_syntax_file("share/syntax/c", true, &err);
+	if (!syn) {
+		fail("could not load C syntax\n");
+		free_buffer(b);
+		return;
+	}
+	update_syntax_colors(syn);
+	b->syn = syn;
+	line_states_reset(&b->line_start_states, syn->states.ptrs[0]);
+
+	test_hl_line(b, "static int x = 0x1fu; // c\n",
+		"kkkkkk-ttt-----nnnnn--cccc-");
+	test_hl_line(b, "if (s[0] == '\\n') return \"a\\x4g\";\n",
+		"kk----n-----------kkkkkk-ss---ss--");
+	test_hl_line(b, "#include <stdio.h> /* x */\n",
+		"pppppppppssssssssspccccccc-");
+
+	// case-insensitive lists
+	syn = load_syntax_file("share/syntax/sql", true, &err);
+	if (!syn) {
+		fail("could not load SQL syntax\n");
+		free_buffer(b);
+		return;
+	}
+	update_syntax_colors(syn);
+	b->syn = syn;
+	line_states_reset(&b->line_start_states, syn->states.ptrs[0]);
+	test_hl_line(b, "SeLeCt x, Date FROM t where selected\n",
+		"kkkkkk----iiii-kkkk---kkkkk----------");
+	free_buffer(b);
+}
+
+// first letter of color name of the first byte of line
+static char guess_color(struct buffer *b, int line_nr, const char *line)
+{
+	struct state *st = hl_guess_start_state(b, line_nr);
+	int nr_spans;
+	struct hl_span *spans = hl_guess_line(b, line, strlen(line), &st, &nr_spans);
+
+	if (!nr_spans || !spans[0].color)
+		return '-';
+	return strchr(spans[0].color->name, '.')[1];
+}
+
+static void hl_insert_text(const char *text)
+{
+	begin_change(CHANGE_MERGE_NONE);
+	buffer_insert_bytes(text, strlen(text));
+	end_change();
+}
+
+// lines far away are first highlighted with a guessed start state
+static void test_hl_background(void)
+{
+	struct syntax *syn = find_syntax("c");
+	struct buffer *b;
+	struct view v;
+	GBUF(text);
+	int i, last, rounds = 0;
+
+	if (!syn)
+		return;
+	b = open_empty_buffer();
+	clear(&v);
+	v.buffer = b;
+	v.cursor.head = &b->blocks;
+	v.cursor.blk = BLOCK(b->blocks.next);
+	ptr_array_add(&b->views, &v);
+	buffer = b;
+	view = &v;
+
+	gbuf_add_str(&text, "/*\n");
+	for (i = 0; i < 100000; i++)
+		gbuf_add_str(&text, "x\n");
+	hl_insert_text((char *)text.buffer);
+	b->syn = syn;
+	line_states_reset(&b->line_start_states, syn->states.ptrs[0]);
+	last = b->nl - 1;
+
+	if (hl_fill_start_states(b, last, 0))
+		fail("hl background: filled without time\n");
+	if (guess_color(b, last, "x") != '-')
+		fail("hl background: guessed state is not the first state\n");
+
+	// finished in background, few lines at a time
+	while (!hl_fill_start_states(b, last, 1))
+		rounds++;
+	if (guess_color(b, last, "x") != 'c')
+		fail("hl background: comment not found after %d rounds\n", rounds);
+
+	// comment is closed, old state is a guess until filled again
+	block_iter_goto_line(&v.cursor, 1);
+	view_update_cursor_y(&v);
+	hl_insert_text("*/\n");
+	last = b->nl - 1;
+	if (guess_color(b, last, "x") != 'c')
+		fail("hl background: invalidated state was not used\n");
+	if (!hl_fill_start_states(b, last, -1))
+		fail("hl background: fill without time limit failed\n");
+	if (guess_color(b, last, "x") != '-')
+		fail("hl background: state was not corrected\n");
+
+	// small hole is filled even if time is up, nothing is left to do
+	block_iter_goto_line(&v.cursor, 10);
+	view_update_cursor_y(&v);
+	hl_insert_text("y\n");
+	if (!hl_fill_start_states(b, last, 0))
+		fail("hl background: filled hole was not reported finished\n");
+	line_states_sanity_check(&b->line_start_states);
+
+	b->syn = NULL;
+	gbuf_free(&text);
+	ptr_array_remove(&b->views, &v);
+	free_buffer(b);
+	buffer = NULL;
+	view = NULL;
+}
+
+static void test_block_arena(void)
+{
+	struct block_arena a;
+	unsigned char *data, *big;
+	long size = 100;
+	LIST_HEAD(head);
+
+	clear(&a);
+	data = block_arena_alloc(&a, &size);
+	if (size != 128)
+		fail("block_arena_alloc: size %ld, expected 128\n", size);
+	block_arena_free(&a, data, size);
+	size = 70;
+	if (block_arena_alloc(&a, &size) != data)
+		fail("block_arena_alloc: freed data not reused\n");
+
+	size = 20000;
+	big = block_arena_alloc(&a, &size);
+	memset(big, 'x', size);
+	size = 30000;
+	big = block_arena_realloc(&a, big, 20000, 20000, &size);
+	if (big[19999] != 'x')
+		fail("block_arena_realloc: data lost\n");
+	block_arena_free(&a, big, size);
+
+	if (a.nr_mallocs != 3 || a.nr_allocs != 4)
+		fail("block_arena: %ld allocs, %ld mallocs\n", a.nr_allocs, a.nr_mallocs);
+	block_arena_release(&a, &head);
+}
+
+static void test_huge_file(void)
+{
+	char filename[] = "/tmp/dex-test-XXXXXX";
+	long size = 0, offset = 0, mapped = 0, i;
+	char *text = xnew(char, 40000 * 80 + 8);
+	struct buffer *b;
+	struct block *blk;
+	int fd;
+
+	srand(4);
+	for (i = 0; i < 40000; i++) {
+		int len = rand() % 70;
+
+		memset(text + size, 'a' + i % 26, len);
+		size += len;
+		text[size++] = '\n';
+	}
+	// incomplete last line
+	size += sprintf(text + size, "tail");
+
+	fd = mkstemp(filename);
+	if (fd < 0 || xwrite(fd, text, size) != size)
+		fail("test_huge_file: can't write %s\n", filename);
+	close(fd);
+
+	b = buffer_new(NULL);
+	b->huge = true;
+	if (load_buffer(b, true, filename))
+		fail("test_huge_file: can't load %s\n", filename);
+	unlink(filename);
+	if (!b->huge || !b->ro)
+		fail("test_huge_file: not loaded as huge file\n");
+	finish_loading(b);
+	block_tree_sanity_check(&b->blocks);
+
+	if (b->nl != 40001)
+		fail("test_huge_file: %ld lines\n", b->nl);
+	text[size++] = '\n';
+	list_for_each_entry(blk, &b->blocks, node) {
+		if (offset + blk->size > size || memcmp(blk->data, text + offset, blk->size))
+			fail("test_huge_file: contents differ at %ld\n", offset);
+		if (blk->mapped)
+			mapped += blk->size;
+		offset += blk->size;
+	}
+	if (offset != size || mapped != size - 5)
+		fail("test_huge_file: %ld bytes, %ld mapped\n", offset, mapped);
+
+	free_buffer(b);
+	free(text);
+}
+
+static void test_lz(void)
+{
+	static const long sizes[] = { 0, 1, 4, 15, 16, 300, 5000, 100000 };
+	unsigned char *src = xnew(unsigned char, 100000);
+	unsigned char *z = xnew(unsigned char, 100000);
+	unsigned char *dst = xnew(unsigned char, 100000);
+	int i, k;
+
+	srand(5);
+	for (k = 0; k < 3; k++) {
+		for (i = 0; i < 100000; i++) {
+			if (k == 0)
+				src[i] = rand();
+			else if (k == 1)
+				src[i] = "hello, world\n"[i % 13];
+			else
+				src[i] = rand() % 4 ? 'a' + rand() % 3 : src[i / 2];
+		}
+		for (i = 0; i < ARRAY_COUNT(sizes); i++) {
+			long size = sizes[i];
+			long zsize = lz_compress(src, size, z, 100000);
+
+			if (zsize < 0) {
+				if (k)
+					fail("lz_compress: %d/%ld failed\n", k, size);
+				continue;
+			}
+			if (k == 1 && size == 100000 && zsize > 1000)
+				fail("lz_compress: %ld bytes compressed to %ld\n", size, zsize);
+			memset(dst, 0, size);
+			lz_decompress(z, zsize, dst, size);
+			if (memcmp(src, dst, size))
+				fail("lz_decompress: %d/%ld differs\n", k, size);
+		}
+	}
+	if (lz_compress(src, 100000, z, 100) != -1)
+		fail("lz_compress: overflow not detected\n");
+	free(src);
+	free(z);
+	free(dst);
+}
+
+static long slow_count_nl(const char *buf, long size)
+{
+	long i, nl = 0;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] == '\n')
+			nl++;
+	}
+	return nl;
+}
+
+static void test_newline_kernels(void)
+{
+	char src[9000], dst[9000];
+	int i, k, size;
+
+	srand(2);
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = rand() % 4 ? 'a' + i % 26 : '\n';
+
+	for (k = 0; newline_kernels[k]; k++) {
+		const struct newline_kernel *kernel = newline_kernels[k];
+
+		if (!kernel->supported())
+			continue;
+		for (size = 0; size < 8900; size += 61) {
+			const char *buf = src + size % 13;
+			long expected = slow_count_nl(buf, size), n;
+
+			if (kernel->count(buf, size) != expected)
+				fail("%s: count_nl(%d) failed\n", kernel->name, size);
+			if (kernel->copy_count(dst, buf, size) != expected || memcmp(dst, buf, size))
+				fail("%s: copy_count_nl(%d) failed\n", kernel->name, size);
+
+			for (n = 1; n <= expected; n += 7) {
+				long tmp = n;
+				const char *nl = kernel->find_nth(buf, size, &tmp);
+
+				if (!nl || *nl != '\n' || slow_count_nl(buf, nl - buf + 1) != n)
+					fail("%s: find_nth_nl(%d, %ld) failed\n", kernel->name, size, n);
+			}
+			n = expected + 2;
+			if (kernel->find_nth(buf, size, &n) || n != 2)
+				fail("%s: find_nth_nl(%d) past end failed\n", kernel->name, size);
+		}
+	}
+}
+
+static void test_utf8_kernels(void)
+{
+	static const struct {
+		const char *str;
+		enum utf8_class class;
+	} tests[] = {
+		{ "", UTF8_ASCII },
+		{ "plain text\n", UTF8_ASCII },
+		{ "\xc3\xa4 \xe2\x82\xac \xf0\x9f\x98\x80", UTF8_VALID },
+		{ "\xef\xbf\xbf \xf4\x8f\xbf\xbf \xed\x9f\xbf", UTF8_VALID },
+		{ "\xc0\xaf", UTF8_INVALID },		// overlong
+		{ "\xe0\x9f\xbf", UTF8_INVALID },	// overlong
+		{ "\xf0\x8f\xbf\xbf", UTF8_INVALID },	// overlong
+		{ "\xed\xa0\x80", UTF8_INVALID },	// surrogate
+		{ "\xf4\x90\x80\x80", UTF8_INVALID },	// above U+10FFFF
+		{ "\xf5\x80\x80\x80", UTF8_INVALID },
+		{ "\xbf", UTF8_INVALID },
+		{ "\xc3\xa4\xa4", UTF8_INVALID },
+		{ "\xe2\x82", UTF8_INVALID },		// truncated at end
+		{ "caf\xe9", UTF8_INVALID },		// Latin-1
+	};
+	static const char *const seqs[] = {
+		"a", "\n", "\xc3\xa4", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\x9f\xbf",
+	};
+	const struct utf8_kernel *scalar = NULL;
+	unsigned char buf[300];
+	int i, j, k;
+
+	// scalar kernel is always last
+	for (k = 0; utf8_kernels[k]; k++)
+		scalar = utf8_kernels[k];
+
+	for (k = 0; utf8_kernels[k]; k++) {
+		const struct utf8_kernel *kernel = utf8_kernels[k];
+
+		if (!kernel->supported())
+			continue;
+		for (i = 0; i < ARRAY_COUNT(tests); i++) {
+			// at every offset around 32 byte block boundary
+			for (j = 0; j < 40; j++) {
+				long len = strlen(tests[i].str);
+
+				memset(buf, 'x', j);
+				memcpy(buf + j, tests[i].str, len);
+				if (kernel->classify(buf, j + len) != tests[i].class)
+					fail("%s: classify(%d, %d) failed\n", kernel->name, i, j);
+			}
+		}
+	}
+
+	srand(3);
+	for (i = 0; i < 5000; i++) {
+		long len = 0;
+
+		while (len < 250) {
+			const char *seq = seqs[rand() % (i % 2 ? 2 : ARRAY_COUNT(seqs))];
+
+			memcpy(buf + len, seq, strlen(seq));
+			len += strlen(seq);
+		}
+		// corrupt or truncate some
+		if (i % 3 == 0)
+			buf[rand() % len] ^= 1 << rand() % 8;
+		len -= rand() % 8;
+		for (k = 0; utf8_kernels[k]; k++) {
+			const struct utf8_kernel *kernel = utf8_kernels[k];
+
+			if (kernel->supported() && kernel->classify(buf, len) != scalar->classify(buf, len))
+				fail("%s: random classify %d failed\n", kernel->name, i);
+		}
+	}
+}
+
+static void test_decode_chunks(void)
+{
+	// ASCII, U+00E4, U+20AC, U+1F600, lone low surrogate
+	static const char utf16[] = "x\0\xe4\0\xac\x20\x3d\xd8\x00\xde\x00\xdc";
+	static const char utf8[] = "x\xc3\xa4\xe2\x82\xac\xf0\x9f\x98\x80\xc2\xbf";
+	long nr_lines = 20000, isize = 0, osize = 0, pos = 0, i;
+	char *in = xnew(char, nr_lines * 40);
+	char *out = xnew(char, nr_lines * 40);
+	struct file_decoder *dec;
+	char *buf;
+	ssize_t size;
+
+	for (i = 0; i < nr_lines; i++) {
+		int units = i % 17 == 0 ? 6 : 5;
+
+		memcpy(in + isize, utf16, units * 2);
+		isize += units * 2;
+		memcpy(in + isize, "\r\0\n\0", 4);
+		isize += 4;
+		memcpy(out + osize, utf8, units == 6 ? 12 : 10);
+		osize += units == 6 ? 12 : 10;
+		memcpy(out + osize, "\r\n", 2);
+		osize += 2;
+	}
+
+	dec = new_file_decoder("UTF-16LE", (unsigned char *)in, isize);
+	while (file_decoder_read_decoded(dec, 100000, &buf, &size)) {
+		if (pos + size > osize || memcmp(buf, out + pos, size))
+			fail("test_decode_chunks: output differs at %ld\n", pos);
+		pos += size;
+	}
+	if (pos != osize || dec->ipos != isize)
+		fail("test_decode_chunks: %ld bytes of output\n", pos);
+	if (file_decoder_nr_errors(dec) != (nr_lines + 16) / 17)
+		fail("test_decode_chunks: %d errors\n", file_decoder_nr_errors(dec));
+	free_file_decoder(dec);
+	free(in);
+	free(out);
+}
+
+// convert in pieces of step bytes to test incomplete characters
+static char *convert(struct cconv *c, const char *in, long len, long step, size_t *size, int *errors)
+{
+	char *out;
+	long i;
+
+	for (i = 0; i < len; i += step)
+		cconv_process(c, in + i, len - i < step ? len - i : step);
+	cconv_flush(c);
+	out = cconv_consume_all(c, size);
+	out = xmemdup(out, *size);
+	*errors = cconv_nr_errors(c);
+	cconv_free(c);
+	return out;
+}
+
+static void test_cconv_pair(const char *encoding, bool to_utf8, const char *in, long len)
+{
+	static const long steps[] = { 1, 3, 7, 1000000 };
+	size_t isize, nsize;
+	int ierrors, nerrors, i;
+	char *iout = convert(to_utf8 ? iconv_to_utf8(encoding) : iconv_from_utf8(encoding), in, len, 1000000, &isize, &ierrors);
+
+	for (i = 0; i < ARRAY_COUNT(steps); i++) {
+		struct cconv *c = to_utf8 ? cconv_to_utf8(encoding) : cconv_from_utf8(encoding);
+		char *nout = convert(c, in, len, steps[i], &nsize, &nerrors);
+
+		if (nsize != isize || memcmp(nout, iout, isize) || nerrors != ierrors) {
+			fail("test_cconv: %s %s differs from iconv, step %ld, %d/%d errors\n",
+				encoding, to_utf8 ? "decoding" : "encoding", steps[i], nerrors, ierrors);
+		}
+		free(nout);
+	}
+	free(iout);
+}
+
+// random UTF-8 text of the first nr of chars, with invalid bytes if wanted
+static char *random_text(const char *const *chars, int nr, bool invalid, long *lenp)
+{
+	char *text = xnew(char, 40000);
+	long len = 0;
+
+	while (len < 30000) {
+		const char *ch = chars[rand() % nr];
+
+		memcpy(text + len, ch, strlen(ch));
+		len += strlen(ch);
+		if (invalid && rand() % 50 == 0)
+			text[len++] = rand() % 2 ? 0xff : 0x80;
+	}
+	text[len++] = '\n';
+	*lenp = len;
+	return text;
+}
+
+static void test_cconv(void)
+{
+	static const struct {
+		const char *encoding;
+		// representable chars
+		int first;
+		int nr_chars;
+	} encodings[] = {
+		{ "UTF-16LE", 0, 6 },
+		{ "UTF-16BE", 0, 6 },
+		{ "UTF-32LE", 0, 6 },
+		{ "UTF-32BE", 0, 6 },
+		{ "ISO-8859-1", 0, 3 },
+		{ "WINDOWS-1252", 1, 3 },
+	};
+	// U+0081, ASCII, U+00E4, U+20AC, U+4E2D, U+1F600
+	static const char *const chars[] = {
+		"\xc2\x81", "abcdefghijklmnopqrstuvwxyz0123456789\n", "\xc3\xa4",
+		"\xe2\x82\xac", "\xe4\xb8\xad", "\xf0\x9f\x98\x80",
+	};
+	char *bytes = xnew(char, 4096);
+	int i, k;
+
+	srand(7);
+	for (i = 0; i < 4096; i++)
+		bytes[i] = rand() % 4 ? rand() % 0x80 : rand() % 0x100;
+
+	for (k = 0; k < ARRAY_COUNT(encodings); k++) {
+		const char *encoding = encodings[k].encoding;
+		size_t esize, dsize;
+		int errors;
+		long len;
+		char *text = random_text(chars, ARRAY_COUNT(chars), true, &len);
+		char *encoded = convert(cconv_from_utf8(encoding), text, len, len, &esize, &errors);
+		char *decoded;
+
+		test_cconv_pair(encoding, false, text, len);
+		test_cconv_pair(encoding, true, encoded, esize);
+		test_cconv_pair(encoding, true, bytes, 4096);
+		test_cconv_pair(encoding, true, bytes, 4095);
+		free(encoded);
+		free(text);
+
+		text = random_text(chars + encodings[k].first, encodings[k].nr_chars, false, &len);
+		encoded = convert(cconv_from_utf8(encoding), text, len, len, &esize, &errors);
+		decoded = convert(cconv_to_utf8(encoding), encoded, esize, 5, &dsize, &errors);
+		if (dsize != len || memcmp(decoded, text, len) || errors)
+			fail("test_cconv: %s round trip failed\n", encoding);
+		free(decoded);
+		free(encoded);
+		free(text);
+	}
+	free(bytes);
+}
+
 int main(int argc, char *argv[])
 {
 	const char *home = getenv("HOME");
@@ -47,11 +1913,40 @@ int main(int argc, char *argv[])
 		home = "";
 	home_dir = xstrdup(home);
 
+	select_newline_kernel();
+	select_utf8_kernel();
+
 	setlocale(LC_CTYPE, "");
 	charset = nl_langinfo(CODESET);
 	if (streq(charset, "UTF-8"))
 		term_utf8 = true;
 
 	test_relative_filename();
-	return 0;
+	test_newline_kernels();
+	test_utf8_kernels();
+	test_block_arena();
+	test_compact_blocks();
+	test_replace_hunks();
+	test_undo_trim();
+	test_undo_trim_branches();
+	test_change_slabs();
+	test_change_branches();
+	test_diff();
+	test_reload();
+	test_background_save();
+	test_journal();
+	test_journal_trim();
+	test_journal_loading();
+	test_edit_loading();
+	test_detect_loading();
+	test_events();
+	test_hl();
+	test_hl_background();
+	test_huge_file();
+	test_decode_chunks();
+	test_cconv();
+	test_lz();
+	test_block_tree();
+	test_line_states();
+	return exit_status;
 }
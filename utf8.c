@@ -0,0 +1,265 @@
+#include "utf8.h"
+#include "common.h"
+
+#include <inttypes.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+// length of valid sequence starting with non-ASCII byte, 0 if invalid
+static int sequence_length(const unsigned char *buf, long size)
+{
+	unsigned int first = buf[0];
+	unsigned int min = 0x80, max = 0xbf;
+	int len, i;
+
+	if (first >= 0xc2 && first <= 0xdf) {
+		len = 2;
+	} else if (first >= 0xe0 && first <= 0xef) {
+		len = 3;
+		if (first == 0xe0)
+			min = 0xa0; // overlong
+		else if (first == 0xed)
+			max = 0x9f; // surrogate
+	} else if (first >= 0xf0 && first <= 0xf4) {
+		len = 4;
+		if (first == 0xf0)
+			min = 0x90; // overlong
+		else if (first == 0xf4)
+			max = 0x8f; // above U+10FFFF
+	} else {
+		return 0;
+	}
+
+	if (len > size || buf[1] < min || buf[1] > max)
+		return 0;
+	for (i = 2; i < len; i++) {
+		if ((buf[i] & 0xc0) != 0x80)
+			return 0;
+	}
+	return len;
+}
+
+// skips ASCII 8 bytes at a time
+static enum utf8_class scalar_classify(const unsigned char *buf, long size)
+{
+	enum utf8_class class = UTF8_ASCII;
+	long i = 0;
+
+	while (i < size) {
+		int len;
+
+		if (i + 8 <= size) {
+			uint64_t w;
+
+			memcpy(&w, buf + i, 8);
+			if (!(w & 0x8080808080808080ULL)) {
+				i += 8;
+				continue;
+			}
+		}
+		if (buf[i] < 0x80) {
+			i++;
+			continue;
+		}
+		len = sequence_length(buf + i, size - i);
+		if (!len)
+			return UTF8_INVALID;
+		class = UTF8_VALID;
+		i += len;
+	}
+	return class;
+}
+
+static bool scalar_supported(void)
+{
+	return true;
+}
+
+static const struct utf8_kernel scalar_kernel = {
+	.name = "scalar",
+	.supported = scalar_supported,
+	.classify = scalar_classify,
+};
+
+#if HAVE_X86_KERNELS
+
+/*
+ * Lookup algorithm by Keiser and Lemire, "Validating UTF-8 In Less Than
+ * One Instruction Per Byte". Every pair of adjacent bytes is classified
+ * by three 16 entry tables indexed by high and low nibble of the first
+ * byte and high nibble of the second. Each bit is an error that is
+ * present only if all three lookups agree on it.
+ */
+#define TOO_SHORT	(1 << 0)	// 11______ 0_______, 11______ 11______
+#define TOO_LONG	(1 << 1)	// 0_______ 10______
+#define OVERLONG_3	(1 << 2)	// 11100000 100_____
+#define TOO_LARGE	(1 << 3)	// 11110100 1001____ and bigger
+#define SURROGATE	(1 << 4)	// 11101101 101_____
+#define OVERLONG_2	(1 << 5)	// 1100000_ 10______
+#define TOO_LARGE_1000	(1 << 6)	// 11110101 1000____ and bigger
+#define OVERLONG_4	(1 << 6)	// 11110000 1000____
+#define TWO_CONTS	(1 << 7)	// 10______ 10______
+#define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+// input shifted right by n bytes with bytes from end of prev shifted in
+#define PREV(input, prev, n) \
+	_mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static __m256i avx2_check(__m256i input, __m256i prev)
+{
+	const __m256i byte_1_high = TABLE(
+		// ASCII followed by anything
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		// continuation
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		// 2, 2, 3 and 4 byte leads
+		TOO_SHORT | OVERLONG_2,
+		TOO_SHORT,
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+	const __m256i byte_1_low = TABLE(
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m256i byte_2_high = TABLE(
+		// ASCII
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		// 1000____, 1001____, 101_____
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		// lead
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i prev1 = PREV(input, prev, 1);
+	__m256i special, third, fourth;
+
+	special = _mm256_and_si256(
+		_mm256_and_si256(
+			_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+			_mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+		_mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+	// 3rd and 4th bytes of sequences must be continuations, others
+	// were checked above
+	third = _mm256_subs_epu8(PREV(input, prev, 2), _mm256_set1_epi8(0xe0 - 0x80));
+	fourth = _mm256_subs_epu8(PREV(input, prev, 3), _mm256_set1_epi8(0xf0 - 0x80));
+	return _mm256_xor_si256(_mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(0x80)), special);
+}
+
+// non-zero if last bytes start a sequence that continues in next block
+__attribute__((target("avx2")))
+static __m256i avx2_incomplete(__m256i input)
+{
+	const __m256i max = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+
+	return _mm256_subs_epu8(input, max);
+}
+
+__attribute__((target("avx2")))
+static enum utf8_class avx2_classify(const unsigned char *buf, long size)
+{
+	__m256i error = _mm256_setzero_si256();
+	__m256i prev = _mm256_setzero_si256();
+	__m256i incomplete = _mm256_setzero_si256();
+	bool ascii = true;
+	long i = 0;
+
+	while (i < size) {
+		unsigned char tail[32];
+		__m256i input;
+
+		if (i + 32 <= size) {
+			input = _mm256_loadu_si256((const __m256i *)(buf + i));
+		} else {
+			// zeros after end of input are ASCII
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, buf + i, size - i);
+			input = _mm256_loadu_si256((const __m256i *)tail);
+		}
+		i += 32;
+
+		if (!_mm256_movemask_epi8(input)) {
+			error = _mm256_or_si256(error, incomplete);
+			incomplete = _mm256_setzero_si256();
+		} else {
+			ascii = false;
+			error = _mm256_or_si256(error, avx2_check(input, prev));
+			incomplete = avx2_incomplete(input);
+			if (!_mm256_testz_si256(error, error))
+				return UTF8_INVALID;
+		}
+		prev = input;
+	}
+	error = _mm256_or_si256(error, incomplete);
+	if (!_mm256_testz_si256(error, error))
+		return UTF8_INVALID;
+	return ascii ? UTF8_ASCII : UTF8_VALID;
+}
+
+static bool avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static const struct utf8_kernel avx2_kernel = {
+	.name = "avx2",
+	.supported = avx2_supported,
+	.classify = avx2_classify,
+};
+
+#endif
+
+// best first
+const struct utf8_kernel *const utf8_kernels[] = {
+#if HAVE_X86_KERNELS
+	&avx2_kernel,
+#endif
+	&scalar_kernel,
+	NULL
+};
+
+const struct utf8_kernel *utf8_kernel = &scalar_kernel;
+
+void select_utf8_kernel(void)
+{
+	int i;
+
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+#endif
+	for (i = 0; utf8_kernels[i]; i++) {
+		if (utf8_kernels[i]->supported()) {
+			utf8_kernel = utf8_kernels[i];
+			break;
+		}
+	}
+	d_print("%s\n", utf8_kernel->name);
+}
@@ -0,0 +1,34 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include "libc.h"
+
+enum utf8_class {
+	UTF8_ASCII,
+	UTF8_VALID,
+	UTF8_INVALID,
+};
+
+/*
+ * Validation of files ahead of decoding them, see file_decoder_validate()
+ * in decoder.c. Valid UTF-8 means RFC 3629: no overlong sequences,
+ * surrogates or characters above U+10FFFF. Best implementation for the
+ * CPU is selected at startup by select_utf8_kernel().
+ */
+struct utf8_kernel {
+	const char *name;
+	bool (*supported)(void);
+	enum utf8_class (*classify)(const unsigned char *buf, long size);
+};
+
+extern const struct utf8_kernel *utf8_kernel;
+extern const struct utf8_kernel *const utf8_kernels[];
+
+void select_utf8_kernel(void);
+
+static inline enum utf8_class classify_utf8(const unsigned char *buf, long size)
+{
+	return utf8_kernel->classify(buf, size);
+}
+
+#endif
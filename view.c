@@ -1,24 +1,16 @@
 #include "view.h"
 #include "window.h"
+#include "block-tree.h"
+#include "newline.h"
 #include "uchar.h"
 
 struct view *view;
 
 void view_update_cursor_y(struct view *v)
 {
-	struct buffer *b = v->buffer;
-	struct block *blk;
-	unsigned int nl = 0;
-
-	list_for_each_entry(blk, &b->blocks, node) {
-		if (blk == v->cursor.blk) {
-			nl += count_nl(blk->data, v->cursor.offset);
-			v->cy = nl;
-			return;
-		}
-		nl += blk->nl;
-	}
-	BUG_ON(1);
+	struct block *blk = v->cursor.blk;
+
+	v->cy = block_tree_line(blk) + count_nl(blk->data, v->cursor.offset);
 }
 
 void view_update_cursor_x(struct view *v)
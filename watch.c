@@ -0,0 +1,399 @@
+#include "watch.h"
+#include "buffer.h"
+#include "view.h"
+#include "block.h"
+#include "change.h"
+#include "load-save.h"
+#include "journal.h"
+#include "diff.h"
+#include "gbuf.h"
+#include "error.h"
+#include "event.h"
+#include "common.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+/*
+ * Directories of open files are watched, not the files themselves,
+ * because generators, git and most editors replace a file by renaming
+ * a new one over it.
+ */
+struct watched_dir {
+	int wd;
+	bool used;
+	char *path;
+};
+
+static int inotify_fd = -1;
+static struct ptr_array watched_dirs;
+
+static long dirname_len(const char *filename)
+{
+	long len = strrchr(filename, '/') - filename;
+
+	// file in root directory
+	return len ? len : 1;
+}
+
+static struct watched_dir *find_watched_dir(const char *path, long len)
+{
+	long i;
+
+	for (i = 0; i < watched_dirs.count; i++) {
+		struct watched_dir *d = watched_dirs.ptrs[i];
+
+		if (!strncmp(d->path, path, len) && d->path[len] == 0)
+			return d;
+	}
+	return NULL;
+}
+
+static void free_watched_dir(struct watched_dir *d)
+{
+	ptr_array_remove(&watched_dirs, d);
+	free(d->path);
+	free(d);
+}
+
+#ifdef __linux__
+
+static void watch_dir(const char *filename)
+{
+	long len = dirname_len(filename);
+	struct watched_dir *d = find_watched_dir(filename, len);
+	char *path;
+	int wd;
+
+	if (d) {
+		d->used = true;
+		return;
+	}
+	path = xstrcut(filename, len);
+	wd = inotify_add_watch(inotify_fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+	if (wd < 0) {
+		// directory of a new file might not exist yet
+		free(path);
+		return;
+	}
+	d = xnew(struct watched_dir, 1);
+	d->wd = wd;
+	d->used = true;
+	d->path = path;
+	ptr_array_add(&watched_dirs, d);
+}
+
+static void mark_changed(struct watched_dir *d, const char *name)
+{
+	long len = strlen(d->path);
+	long i;
+
+	for (i = 0; i < buffers.count; i++) {
+		struct buffer *b = buffers.ptrs[i];
+		const char *f = b->abs_filename;
+
+		if (f == NULL)
+			continue;
+		if (name == NULL) {
+			// events were lost
+			b->file_changed = true;
+		} else if (dirname_len(f) == len && !strncmp(f, d->path, len) && streq(strrchr(f, '/') + 1, name)) {
+			b->file_changed = true;
+		}
+	}
+}
+
+static void read_events(int fd, short revents, void *data)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	ssize_t len;
+
+	while ((len = read(fd, u.buf, sizeof(u.buf))) > 0) {
+		ssize_t pos = 0;
+
+		while (pos < len) {
+			struct inotify_event *ev = (struct inotify_event *)(u.buf + pos);
+			long i;
+
+			for (i = 0; i < watched_dirs.count; i++) {
+				struct watched_dir *d = watched_dirs.ptrs[i];
+
+				if (ev->mask & IN_Q_OVERFLOW) {
+					mark_changed(d, NULL);
+					break;
+				}
+				if (d->wd == ev->wd) {
+					if (ev->mask & IN_IGNORED)
+						free_watched_dir(d);
+					else if (ev->len)
+						mark_changed(d, ev->name);
+					break;
+				}
+			}
+			pos += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+// watch directories of open files, forget directories no longer needed
+void update_watches(void)
+{
+	long i;
+
+	if (inotify_fd < 0) {
+		if (!options.auto_reload)
+			return;
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotify_fd < 0)
+			return;
+		add_fd_handler(inotify_fd, POLLIN, read_events, NULL);
+	}
+	for (i = 0; i < watched_dirs.count; i++) {
+		struct watched_dir *d = watched_dirs.ptrs[i];
+		d->used = false;
+	}
+	for (i = 0; options.auto_reload && i < buffers.count; i++) {
+		struct buffer *b = buffers.ptrs[i];
+
+		if (b->abs_filename)
+			watch_dir(b->abs_filename);
+	}
+	for (i = watched_dirs.count - 1; i >= 0; i--) {
+		struct watched_dir *d = watched_dirs.ptrs[i];
+
+		if (!d->used) {
+			inotify_rm_watch(inotify_fd, d->wd);
+			free_watched_dir(d);
+		}
+	}
+}
+
+#else
+
+void update_watches(void)
+{
+}
+
+#endif
+
+static bool file_changed(const struct stat *a, const struct stat *b)
+{
+	return a->st_mtime != b->st_mtime ||
+#ifdef __linux__
+		a->st_mtim.tv_nsec != b->st_mtim.tv_nsec ||
+#endif
+		a->st_size != b->st_size ||
+		a->st_dev != b->st_dev ||
+		a->st_ino != b->st_ino;
+}
+
+// after replacing hunks, offsets inside a hunk move to its beginning
+static long map_offset(const struct gbuf *hunks, long first, long offset)
+{
+	const unsigned char *p = hunks->buffer;
+	const unsigned char *end = p + hunks->len;
+	long pos = first, diff = 0;
+
+	while (p < end) {
+		long skip = get_varint(&p);
+		long del = get_varint(&p);
+		long ins = get_varint(&p);
+
+		p += ins;
+		pos += skip;
+		if (offset < pos)
+			break;
+		if (offset < pos + del)
+			return pos + diff;
+		pos += del;
+		diff += ins - del;
+	}
+	return offset + diff;
+}
+
+static void add_lines(struct gbuf *buf, const struct diff_lines *lines, long start, long end)
+{
+	long i;
+
+	for (i = start; i < end; i++)
+		gbuf_add_buf(buf, lines->ptr[i].text, lines->ptr[i].len);
+}
+
+/*
+ * Converts line hunks to byte hunks starting from *first. Hunks must not
+ * delete the last newline of the buffer so a hunk at the end deletes
+ * the newline before it instead.
+ */
+static void make_hunks(struct gbuf *out, long *first, const struct diff_lines *a,
+	const struct diff_lines *b, const struct diff_hunk *hunks, long nr)
+{
+	long line = 0, offset = 0, end = 0, i;
+	GBUF(ins);
+
+	for (i = 0; i < nr; i++) {
+		const struct diff_hunk *h = &hunks[i];
+		long start, del;
+
+		while (line < h->old_start)
+			offset += a->ptr[line++].len;
+		start = offset;
+		while (line < h->old_end)
+			offset += a->ptr[line++].len;
+		del = offset - start;
+
+		gbuf_clear(&ins);
+		add_lines(&ins, b, h->new_start, h->new_end);
+		if (h->old_end == a->count && del) {
+			if (start) {
+				start--;
+				gbuf_make_space(&ins, 0, 1);
+				ins.buffer[0] = '\n';
+			} else {
+				del--;
+			}
+			if (ins.len && ins.buffer[ins.len - 1] == '\n')
+				ins.len--;
+		}
+		if (i == 0) {
+			*first = start;
+			end = start;
+		}
+		add_hunk(out, start - end, del, (const char *)ins.buffer, ins.len);
+		end = start + del;
+	}
+	gbuf_free(&ins);
+}
+
+static void get_lines(struct buffer *b, struct diff_lines *lines)
+{
+	struct block *blk;
+
+	list_for_each_entry(blk, &b->blocks, node)
+		diff_lines_add(lines, (const char *)blk->data, blk->size);
+}
+
+/*
+ * Replace lines of b that differ from its file as one change that can
+ * be undone. Cursors stay on unchanged lines.
+ */
+int reload_buffer(struct buffer *b)
+{
+	struct view *saved_view = view;
+	struct buffer *saved_buffer = buffer;
+	struct buffer *f = buffer_new(b->encoding);
+	struct diff_lines old = { NULL, 0, 0 };
+	struct diff_lines new = { NULL, 0, 0 };
+	struct diff_hunk *hunks;
+	long nr, first = 0, i;
+	long *offsets;
+	GBUF(buf);
+	struct view tmp;
+
+	if (load_buffer(f, true, b->abs_filename)) {
+		free_buffer(f);
+		return -1;
+	}
+	finish_loading(f);
+	get_lines(b, &old);
+	get_lines(f, &new);
+	nr = diff(&old, &new, &hunks);
+	make_hunks(&buf, &first, &old, &new, hunks, nr);
+	free(hunks);
+
+	if (buf.len) {
+		// cursors and selections of all views as offsets
+		offsets = xnew(long, b->views.count * 3);
+		for (i = 0; i < b->views.count; i++) {
+			struct view *v = b->views.ptrs[i];
+
+			if (v != view && v->restore_cursor)
+				offsets[i * 3] = v->saved_cursor_offset;
+			else
+				offsets[i * 3] = block_iter_get_offset(&v->cursor);
+			offsets[i * 3 + 1] = v->sel_so;
+			offsets[i * 3 + 2] = v->sel_eo;
+		}
+
+		if (b != buffer) {
+			clear(&tmp);
+			tmp.buffer = b;
+			tmp.cursor.head = &b->blocks;
+			view = &tmp;
+			buffer = b;
+		}
+		view->cursor.blk = BLOCK(b->blocks.next);
+		block_iter_goto_offset(&view->cursor, first);
+		buffer_replace_hunks((const char *)buf.buffer, buf.len);
+
+		for (i = 0; i < b->views.count; i++) {
+			struct view *v = b->views.ptrs[i];
+			long offset = map_offset(&buf, first, offsets[i * 3]);
+
+			if (v != view && v->restore_cursor) {
+				v->saved_cursor_offset = offset;
+			} else {
+				v->cursor.blk = BLOCK(b->blocks.next);
+				block_iter_goto_offset(&v->cursor, offset);
+			}
+			if (v->selection) {
+				v->sel_so = map_offset(&buf, first, offsets[i * 3 + 1]);
+				if (offsets[i * 3 + 2] != UINT_MAX)
+					v->sel_eo = map_offset(&buf, first, offsets[i * 3 + 2]);
+			}
+		}
+		free(offsets);
+		view = saved_view;
+		buffer = saved_buffer;
+
+		b->saved_change = b->cur_change;
+		journal_saved(b);
+	}
+	b->st = f->st;
+	b->newline = f->newline;
+
+	gbuf_free(&buf);
+	diff_lines_free(&old);
+	diff_lines_free(&new);
+	free_buffer(f);
+	return 0;
+}
+
+/*
+ * Reload unmodified buffers whose files have been changed by other
+ * programs. Returns true if the screen needs to be updated.
+ */
+bool reload_changed_files(void)
+{
+	bool changed = false;
+	long i;
+
+	for (i = 0; i < buffers.count; i++) {
+		struct buffer *b = buffers.ptrs[i];
+		struct stat st;
+
+		if (!b->file_changed)
+			continue;
+		// try again when loading or background save is finished
+		if (b->loader || b->saving_change)
+			continue;
+		b->file_changed = false;
+
+		if (!options.auto_reload || b->huge)
+			continue;
+		if (stat(b->abs_filename, &st) || !S_ISREG(st.st_mode) || !file_changed(&b->st, &st))
+			continue;
+		if (b->map && st.st_dev == b->st.st_dev && st.st_ino == b->st.st_ino) {
+			error_msg("%s was rewritten in place while mapped.", buffer_filename(b));
+		} else if (buffer_modified(b)) {
+			error_msg("%s has been changed by another program.", buffer_filename(b));
+		} else if (reload_buffer(b) == 0) {
+			info_msg("Reloaded %s.", buffer_filename(b));
+		}
+		changed = true;
+	}
+	return changed;
+}
@@ -0,0 +1,12 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "libc.h"
+
+struct buffer;
+
+void update_watches(void);
+bool reload_changed_files(void);
+int reload_buffer(struct buffer *b);
+
+#endif
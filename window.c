@@ -4,6 +4,7 @@
 #include "path.h"
 #include "lock.h"
 #include "load-save.h"
+#include "journal.h"
 #include "error.h"
 #include "move.h"
 #include "frame.h"
@@ -36,7 +37,7 @@ struct view *window_open_empty_buffer(struct window *w)
 	return window_add_buffer(w, open_empty_buffer());
 }
 
-struct view *window_open_buffer(struct window *w, const char *filename, bool must_exist, const char *encoding)
+static struct view *open_buffer(struct window *w, const char *filename, bool must_exist, const char *encoding, bool huge)
 {
 	char *absolute;
 	bool dir_missing = false;
@@ -84,6 +85,7 @@ struct view *window_open_buffer(struct window *w, const char *filename, bool mus
 	dex /proc/$(pidof tail)/fd/3
 	*/
 	b = buffer_new(encoding);
+	b->huge = huge;
 	if (load_buffer(b, must_exist, filename)) {
 		free_buffer(b);
 		free(absolute);
@@ -102,6 +104,7 @@ struct view *window_open_buffer(struct window *w, const char *filename, bool mus
 		b->abs_filename = xstrdup(filename);
 	}
 	update_short_filename(b);
+	load_journal(b);
 
 	if (options.lock_files) {
 		if (lock_file(b->abs_filename)) {
@@ -117,6 +120,11 @@ struct view *window_open_buffer(struct window *w, const char *filename, bool mus
 	return window_add_buffer(w, b);
 }
 
+struct view *window_open_buffer(struct window *w, const char *filename, bool must_exist, const char *encoding)
+{
+	return open_buffer(w, filename, must_exist, encoding, false);
+}
+
 struct view *window_get_view(struct window *w, struct buffer *b)
 {
 	struct view *v = window_find_view(w, b);
@@ -330,11 +338,11 @@ static bool is_useless_empty_view(struct view *v)
 	return true;
 }
 
-struct view *window_open_file(struct window *w, const char *filename, const char *encoding)
+static struct view *open_file(struct window *w, const char *filename, const char *encoding, bool huge)
 {
 	struct view *prev = w->view;
 	bool useless = is_useless_empty_view(prev);
-	struct view *v = window_open_buffer(w, filename, false, encoding);
+	struct view *v = open_buffer(w, filename, huge, encoding, huge);
 
 	if (v == NULL)
 		return NULL;
@@ -349,6 +357,17 @@ struct view *window_open_file(struct window *w, const char *filename, const char
 	return v;
 }
 
+struct view *window_open_file(struct window *w, const char *filename, const char *encoding)
+{
+	return open_file(w, filename, encoding, false);
+}
+
+// huge files must exist
+struct view *window_open_huge_file(struct window *w, const char *filename)
+{
+	return open_file(w, filename, NULL, true);
+}
+
 void window_open_files(struct window *w, char **filenames, const char *encoding)
 {
 	struct view *empty = w->view;
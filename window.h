@@ -50,6 +50,7 @@ void window_close_current_view(struct window *w);
 void set_view(struct view *v);
 struct view *window_open_new_file(struct window *w);
 struct view *window_open_file(struct window *w, const char *filename, const char *encoding);
+struct view *window_open_huge_file(struct window *w, const char *filename);
 void window_open_files(struct window *w, char **filenames, const char *encoding);
 void mark_buffer_tabbars_changed(struct buffer *b);
 int vertical_tabbar_width(struct window *win);